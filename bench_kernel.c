@@ -0,0 +1,1280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+
+#include "unit_testing.h"
+#include "tinyos.h"
+#include "symposium.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+/*
+	Kernel benchmarks.
+
+	These are not correctness tests: each benchmark runs a fixed workload
+	and reports its measurements with MSG(). A benchmark fails only if the
+	workload itself goes wrong. To see how a benchmark scales with the number
+	of cores, run it as e.g.
+
+	./bench_kernel -c 1,2,4,8,16,32 bench_symposium_scaling
+
+	Some benchmarks also report context switches; these are only counted
+	when the BIOS is built with 'make STATS=1'.
+*/
+
+
+/* Wall-clock time in seconds */
+static double bench_time()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1E-9 * t.tv_nsec;
+}
+
+/* Some workloads print their progress on the host stdout; this keeps it out of the measurements */
+static int bench_quiet_stdout()
+{
+	fflush(stdout);
+	int saved = dup(1);
+	int fd = open("/dev/null", O_WRONLY);
+	dup2(fd, 1);
+	close(fd);
+	return saved;
+}
+
+static void bench_restore_stdout(int saved)
+{
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+}
+
+
+BOOT_TEST(bench_symposium_scaling,
+	"Run a fixed symposium of threads and report the elapsed time. Run it for a range\n"
+	"of cores (e.g., -c 1,2,4,8,16,32) to see how the scheduler scales.",
+	.timeout = 300
+	)
+{
+	symposium_t symp = { .N = 32, .bites = 5 };
+	adjust_symposium(&symp, 0, 0);
+
+	int saved = bench_quiet_stdout();
+	double t0 = bench_time();
+
+	Pid_t pid = Exec(SymposiumOfThreads, sizeof(symp), &symp);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL) == pid);
+
+	double elapsed = bench_time() - t0;
+	bench_restore_stdout(saved);
+
+	MSG("cores=%2u philosophers=%d bites=%d: %.3f sec\n", cpu_cores(), symp.N, symp.bites, elapsed);
+	return 0;
+}
+
+
+/*
+	Timeout benchmark: a number of threads sleep in Cond_TimedWait with a long
+	timeout, and are woken up by a broadcast. Each wait arms a timeout, and each
+	wakeup cancels it.
+ */
+#define TIMEOUT_WAITERS 1000
+#define TIMEOUT_ROUNDS 100
+
+static Mutex bt_mx = MUTEX_INIT;
+static CondVar bt_wake = COND_INIT;
+static CondVar bt_all_waiting = COND_INIT;
+static int bt_waiting;
+static int bt_round;
+
+static int timeout_waiter(int argl, void* args)
+{
+	for (int r = 0; r < TIMEOUT_ROUNDS; r++) {
+		Mutex_Lock(&bt_mx);
+		int round = bt_round;
+		if (++bt_waiting == TIMEOUT_WAITERS)
+			Cond_Signal(&bt_all_waiting);
+		while (bt_round == round)
+			Cond_TimedWait(&bt_mx, &bt_wake, 1000000);
+		Mutex_Unlock(&bt_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_timeouts,
+	"Arm and cancel 100k timeouts, with 1000 timed waiters at any time, and\n"
+	"report the time per timeout.",
+	.timeout = 300
+	)
+{
+	Tid_t tids[TIMEOUT_WAITERS];
+	bt_waiting = 0;
+	bt_round = 0;
+
+	double t0 = bench_time();
+
+	for (int i = 0; i < TIMEOUT_WAITERS; i++)
+		tids[i] = CreateThread(timeout_waiter, 0, NULL);
+
+	for (int r = 0; r < TIMEOUT_ROUNDS; r++) {
+		Mutex_Lock(&bt_mx);
+		while (bt_waiting < TIMEOUT_WAITERS)
+			Cond_Wait(&bt_mx, &bt_all_waiting);
+		bt_waiting = 0;
+		bt_round++;
+		Cond_Broadcast(&bt_wake);
+		Mutex_Unlock(&bt_mx);
+	}
+
+	for (int i = 0; i < TIMEOUT_WAITERS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+
+	double elapsed = bench_time() - t0;
+	double ops = (double)TIMEOUT_WAITERS * TIMEOUT_ROUNDS;
+
+	MSG("cores=%2u timeouts=%.0f: %.3f sec, %.2f usec per timeout\n",
+		cpu_cores(), ops, elapsed, 1E6 * elapsed / ops);
+	return 0;
+}
+
+
+/*
+	Thread creation benchmark: short-lived threads are created and joined in
+	batches, so that the cost of CreateThread and of releasing the thread dominates.
+ */
+#define SPAWN_THREADS 20000
+
+static int spawn_noop(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(bench_thread_spawn,
+	"Create and join 20000 threads that return at once, in batches of 1 and 16\n"
+	"threads, and report the threads per second.",
+	.timeout = 300
+	)
+{
+	int batches[] = { 1, 16 };
+	for (int b = 0; b < 2; b++) {
+		int batch = batches[b];
+		Tid_t tids[16];
+
+		double t0 = bench_time();
+		for (int n = 0; n < SPAWN_THREADS; n += batch) {
+			for (int i = 0; i < batch; i++)
+				tids[i] = CreateThread(spawn_noop, i, NULL);
+			for (int i = 0; i < batch; i++) {
+				int exitval;
+				ASSERT(ThreadJoin(tids[i], &exitval) == 0);
+				ASSERT(exitval == i);
+			}
+		}
+		double elapsed = bench_time() - t0;
+
+		MSG("cores=%2u create/join batch=%2d: %9.0f threads/sec\n", cpu_cores(), batch,
+			SPAWN_THREADS / elapsed);
+	}
+	return 0;
+}
+
+
+/*
+	Idle thread memory: many threads block at once, and the resident memory
+	of the host process is measured.
+ */
+#define IDLE_THREADS 5000
+
+static Mutex idle_mx = MUTEX_INIT;
+static CondVar idle_cv = COND_INIT;
+static int idle_waiting, idle_done;
+
+static int idle_thread_task(int argl, void* args)
+{
+	Mutex_Lock(&idle_mx);
+	idle_waiting++;
+	Cond_Broadcast(&idle_cv);
+	while (!idle_done)
+		Cond_Wait(&idle_mx, &idle_cv);
+	Mutex_Unlock(&idle_mx);
+	return 0;
+}
+
+/* The resident memory of the host process, in bytes */
+static double bench_resident()
+{
+	long size, resident;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	int n = fscanf(f, "%ld %ld", &size, &resident);
+	fclose(f);
+	return (n == 2) ? (double)resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+BOOT_TEST(bench_idle_threads,
+	"Block 5000 threads, with the default and the minimum stack size, and report\n"
+	"the stack memory per thread, as reserved, committed and resident in the host.",
+	.timeout = 300
+	)
+{
+	unsigned int sizes[] = { 0, MIN_STACK_SIZE };
+	static Tid_t tids[IDLE_THREADS];
+
+	for (int k = 0; k < 2; k++) {
+		idle_waiting = idle_done = 0;
+		double rss0 = bench_resident();
+
+		for (int i = 0; i < IDLE_THREADS; i++) {
+			tids[i] = CreateThreadEx(idle_thread_task, 0, NULL, sizes[k]);
+			ASSERT(tids[i] != NOTHREAD);
+		}
+		Mutex_Lock(&idle_mx);
+		while (idle_waiting < IDLE_THREADS)
+			Cond_Wait(&idle_mx, &idle_cv);
+		Mutex_Unlock(&idle_mx);
+
+		double rss = bench_resident() - rss0;
+		procinfo info;
+		Fid_t finfo = OpenInfo();
+		ASSERT(finfo != NOFILE);
+		do
+			ASSERT(Read(finfo, (char*)&info, sizeof(info)) == sizeof(info));
+		while (info.pid != GetPid());
+		Close(finfo);
+
+		Mutex_Lock(&idle_mx);
+		idle_done = 1;
+		Cond_Broadcast(&idle_cv);
+		Mutex_Unlock(&idle_mx);
+		for (int i = 0; i < IDLE_THREADS; i++)
+			ASSERT(ThreadJoin(tids[i], NULL) == 0);
+
+		MSG("cores=%2u idle threads=%d stack=%4uK: %6.1fK reserved, %5.1fK committed, %5.1fK resident per thread\n",
+			cpu_cores(), IDLE_THREADS, (unsigned)(sizes[k] ? sizes[k] : 128 * 1024) / 1024,
+			info.stack_size / 1024.0 / info.thread_count, info.stack_used / 1024.0 / info.thread_count,
+			rss / 1024 / IDLE_THREADS);
+	}
+	return 0;
+}
+
+
+/*
+	Broadcast benchmark: many threads wait on a condition variable, and are
+	woken up together by Cond_Broadcast, over a number of rounds.
+ */
+#define BCAST_THREADS 1000
+#define BCAST_ROUNDS 50
+
+static Mutex bcast_mx = MUTEX_INIT;
+static CondVar bcast_cv = COND_INIT;
+static CondVar bcast_done_cv = COND_INIT;
+static int bcast_round, bcast_arrived, bcast_stop;
+
+static int bcast_thread(int argl, void* args)
+{
+	Mutex_Lock(&bcast_mx);
+	int round = bcast_round;
+	while (1) {
+		if (++bcast_arrived == BCAST_THREADS)
+			Cond_Signal(&bcast_done_cv);
+		while (bcast_round == round && !bcast_stop)
+			Cond_Wait(&bcast_mx, &bcast_cv);
+		if (bcast_stop)
+			break;
+		round = bcast_round;
+	}
+	Mutex_Unlock(&bcast_mx);
+	return 0;
+}
+
+BOOT_TEST(bench_cond_broadcast,
+	"1000 threads wait on a condition variable, and are woken up by Cond_Broadcast\n"
+	"50 times. Report the time of the broadcast call per woken thread, and the time\n"
+	"until all threads have run.",
+	.timeout = 300
+	)
+{
+	static Tid_t tids[BCAST_THREADS];
+	bcast_round = bcast_arrived = bcast_stop = 0;
+
+	for (int i = 0; i < BCAST_THREADS; i++) {
+		tids[i] = CreateThread(bcast_thread, 0, NULL);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+
+	double tcall = 0.0, tround = 0.0;
+	Mutex_Lock(&bcast_mx);
+	for (int r = 0; r <= BCAST_ROUNDS; r++) {
+		while (bcast_arrived < BCAST_THREADS)
+			Cond_Wait(&bcast_mx, &bcast_done_cv);
+		if (r == BCAST_ROUNDS)
+			break;
+
+		bcast_arrived = 0;
+		bcast_round++;
+		double t0 = bench_time();
+		Cond_Broadcast(&bcast_cv);
+		double t1 = bench_time();
+		while (bcast_arrived < BCAST_THREADS)
+			Cond_Wait(&bcast_mx, &bcast_done_cv);
+		tcall += t1 - t0;
+		tround += bench_time() - t0;
+	}
+	bcast_stop = 1;
+	Cond_Broadcast(&bcast_cv);
+	Mutex_Unlock(&bcast_mx);
+
+	for (int i = 0; i < BCAST_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+
+	MSG("cores=%2u threads=%d: broadcast %6.1f nsec per thread, round %8.1f usec\n",
+		cpu_cores(), BCAST_THREADS, 1E9 * tcall / (BCAST_ROUNDS * BCAST_THREADS),
+		1E6 * tround / BCAST_ROUNDS);
+	return 0;
+}
+
+
+/*
+	Context switch benchmark: two threads call the scheduler in turns. On one
+	core, every yield switches to the other thread.
+ */
+#define PINGPONG_YIELDS 200000
+
+static int yield_thread(int argl, void* args)
+{
+	for (int i = 0; i < argl; i++)
+		yield(SCHED_USER);
+	return 0;
+}
+
+BOOT_TEST(bench_yield_pingpong,
+	"Two threads yield to each other 200000 times each, and report the time per\n"
+	"yield. On one core, each yield is a context switch.",
+	.timeout = 300
+	)
+{
+	uintptr_t sw0 = cpu_context_switches();
+	double t0 = bench_time();
+
+	Tid_t t1 = CreateThread(yield_thread, PINGPONG_YIELDS, NULL);
+	Tid_t t2 = CreateThread(yield_thread, PINGPONG_YIELDS, NULL);
+	ASSERT(ThreadJoin(t1, NULL) == 0);
+	ASSERT(ThreadJoin(t2, NULL) == 0);
+
+	double elapsed = bench_time() - t0;
+	uintptr_t switches = cpu_context_switches() - sw0;
+
+	MSG("cores=%2u yields=%d: %.0f nsec per yield, %lu context switches\n", cpu_cores(),
+		2 * PINGPONG_YIELDS, 1E9 * elapsed / (2 * PINGPONG_YIELDS), (unsigned long)switches);
+	return 0;
+}
+
+
+/*
+	Wakeup benchmark: a thread wakes up another one, and measures the time
+	until the woken thread runs. A third thread keeps the core of the waker 
+	busy, so that the woken thread is queued on its own core, which is idle 
+	(see sched_wakeup_core).
+ */
+#define WAKEUP_ROUNDS 5000
+#define WAKEUP_SPIN 200
+
+static Mutex wakeup_mx = MUTEX_INIT;
+static CondVar wakeup_cv = COND_INIT;
+static volatile int wakeup_go, wakeup_ack, wakeup_done;
+static double wakeup_t0, wakeup_latency;
+
+static int wakeup_sleeper(int argl, void* args)
+{
+	Mutex_Lock(&wakeup_mx);
+	for (int i = 0; i < argl; i++) {
+		while (!wakeup_go)
+			Cond_Wait(&wakeup_mx, &wakeup_cv);
+		wakeup_go = 0;
+		wakeup_latency += bench_time() - wakeup_t0;
+		wakeup_ack = 1;
+	}
+	Mutex_Unlock(&wakeup_mx);
+	return 0;
+}
+
+static int wakeup_spinner(int argl, void* args)
+{
+	while (!wakeup_done)
+		yield(SCHED_USER);
+	return 0;
+}
+
+BOOT_TEST(bench_idle_wakeup,
+	"A thread wakes up another one 5000 times, and reports the time until the\n"
+	"woken thread runs, with idle cores that halt at once and with idle cores\n"
+	"that spin (sched_idle_spin).",
+	.timeout = 300
+	)
+{
+	int saved_spin = sched_idle_spin;
+	int spins[] = { 0, WAKEUP_SPIN };
+
+	for (int k = 0; k < 2; k++) {
+		sched_idle_spin = spins[k];
+		wakeup_go = wakeup_ack = wakeup_done = 0;
+		wakeup_latency = 0.0;
+
+		Tid_t sleeper = CreateThread(wakeup_sleeper, WAKEUP_ROUNDS, NULL);
+		Tid_t spinner = CreateThread(wakeup_spinner, 0, NULL);
+		for (int i = 0; i < WAKEUP_ROUNDS; i++) {
+			Mutex_Lock(&wakeup_mx);
+			wakeup_t0 = bench_time();
+			wakeup_go = 1;
+			Cond_Signal(&wakeup_cv);
+			Mutex_Unlock(&wakeup_mx);
+			while (!wakeup_ack)
+				yield(SCHED_USER);
+			wakeup_ack = 0;
+		}
+		wakeup_done = 1;
+		ASSERT(ThreadJoin(sleeper, NULL) == 0);
+		ASSERT(ThreadJoin(spinner, NULL) == 0);
+
+		MSG("cores=%2u idle_spin=%3d: %6.2f usec from wakeup to run\n",
+			cpu_cores(), spins[k], 1E6 * wakeup_latency / WAKEUP_ROUNDS);
+	}
+
+	sched_idle_spin = saved_spin;
+	return 0;
+}
+
+
+/*
+	Quantum jitter benchmark: two CPU-bound threads per core read the clock
+	in a loop. A gap between two readings means that the thread was
+	preempted, and the time between two gaps is one quantum of the thread.
+	The first run of each thread is not a whole quantum, and is skipped.
+ */
+#define JITTER_TIME 1.0
+#define JITTER_GAP (0.5E-6 * QUANTUM)
+
+struct jitter_stats {
+	unsigned long count;
+	double sum, sumsq, max;
+};
+
+static int jitter_thread(int argl, void* args)
+{
+	struct jitter_stats* js = args;
+	double start = bench_time(), last = start, run = start;
+	while (last - start < JITTER_TIME) {
+		double t = bench_time();
+		if (t - last > JITTER_GAP) {
+			if (run != start) {
+				double q = last - run;
+				js->count++;
+				js->sum += q;
+				js->sumsq += q * q;
+				if (q > js->max) js->max = q;
+			}
+			run = t;
+		}
+		last = t;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_quantum_jitter,
+	"Two CPU-bound threads per core run for 1 sec each, and report the mean, the\n"
+	"standard deviation and the maximum of the time they run between preemptions.",
+	.timeout = 300
+	)
+{
+	unsigned int nthreads = 2 * cpu_cores();
+	Tid_t tids[2 * MAX_CORES];
+	struct jitter_stats js[2 * MAX_CORES];
+
+	memset(js, 0, sizeof(js));
+	for (unsigned int i = 0; i < nthreads; i++)
+		tids[i] = CreateThread(jitter_thread, 0, &js[i]);
+	for (unsigned int i = 0; i < nthreads; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+
+	struct jitter_stats all = { 0, 0.0, 0.0, 0.0 };
+	for (unsigned int i = 0; i < nthreads; i++) {
+		all.count += js[i].count;
+		all.sum += js[i].sum;
+		all.sumsq += js[i].sumsq;
+		if (js[i].max > all.max) all.max = js[i].max;
+	}
+	ASSERT(all.count > 0);
+	double mean = all.sum / all.count;
+	double sdev = sqrt(fmax(0.0, all.sumsq / all.count - mean * mean));
+
+	MSG("cores=%2u quantum=%ld usec: %6.0f usec mean, %6.0f usec std.dev., %6.0f usec max, over %lu quanta\n",
+		cpu_cores(), QUANTUM, 1E6 * mean, 1E6 * sdev, 1E6 * all.max, all.count);
+	return 0;
+}
+
+
+/*
+	Mutex contention benchmark: a number of threads lock the same lock for a
+	short critical section, with some work between critical sections. The
+	sleeping Mutex is compared to the yielding spinlock of the kernel.
+ */
+#define CONTENTION_SECTIONS 200000
+#define CONTENTION_MAX_THREADS 8
+
+static Mutex contention_mx = MUTEX_INIT;
+static Spinlock contention_spinlock = SPINLOCK_INIT;
+static volatile unsigned long contention_counter;
+
+/* Some work that the compiler cannot remove */
+static void contention_work(int n)
+{
+	for (volatile int i = 0; i < n; i++);
+}
+
+static int contention_thread(int argl, void* args)
+{
+	int use_mutex = *(int*)args;
+	for (int i = 0; i < argl; i++) {
+		if (use_mutex) Mutex_Lock(&contention_mx); else spin_lock(&contention_spinlock);
+		contention_counter++;
+		contention_work(50);
+		if (use_mutex) Mutex_Unlock(&contention_mx); else spin_unlock(&contention_spinlock);
+		contention_work(200);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_mutex_contention,
+	"Threads lock a Mutex (or a kernel spinlock) 200000 times in total, for a short\n"
+	"critical section, and report the time and the context switches per critical section.",
+	.timeout = 300
+	)
+{
+	for (int nthreads = 1; nthreads <= CONTENTION_MAX_THREADS; nthreads *= 2) {
+		for (int use_mutex = 0; use_mutex <= 1; use_mutex++) {
+			Tid_t tids[CONTENTION_MAX_THREADS];
+			int per_thread = CONTENTION_SECTIONS / nthreads;
+			contention_counter = 0;
+
+			uintptr_t sw0 = cpu_context_switches();
+			double t0 = bench_time();
+
+			for (int i = 0; i < nthreads; i++)
+				tids[i] = CreateThread(contention_thread, per_thread, &use_mutex);
+			for (int i = 0; i < nthreads; i++)
+				ASSERT(ThreadJoin(tids[i], NULL) == 0);
+
+			double elapsed = bench_time() - t0;
+			uintptr_t switches = cpu_context_switches() - sw0;
+			double sections = (double) per_thread * nthreads;
+			ASSERT(contention_counter == per_thread * nthreads);
+
+			MSG("cores=%2u threads=%d %-8s: %6.3f usec per section, %5.3f switches per section\n",
+				cpu_cores(), nthreads, use_mutex ? "mutex" : "spinlock",
+				1E6 * elapsed / sections, switches / sections);
+		}
+	}
+	return 0;
+}
+
+
+/*
+	Spinlock contention benchmark: one thread per core locks the same kernel
+	spinlock for a very short critical section with preemption off, as the
+	kernel does, until a deadline passes. The
+	time per acquisition shows how the lock scales with the number of cores,
+	and the smallest and largest share of the acquisitions among the threads
+	show how fair it is. Build with SPINLOCK=ticket or SPINLOCK=mcs to compare
+	the implementations.
+ */
+#define SPINLOCK_BENCH_TIME 0.5
+
+static Spinlock spinbench_lock = SPINLOCK_INIT;
+static unsigned long spinbench_counter;
+static double spinbench_deadline;
+
+static int spinbench_thread(int argl, void* args)
+{
+	unsigned long* count = args;
+	unsigned long n = 0;
+	do {
+		int preempt = preempt_off;
+		spin_lock(&spinbench_lock);
+		spinbench_counter++;
+		contention_work(10);
+		spin_unlock(&spinbench_lock);
+		if (preempt) preempt_on;
+		contention_work(10);
+		n++;
+	} while (bench_time() < spinbench_deadline);
+	*count = n;
+	return 0;
+}
+
+BOOT_TEST(bench_spinlock_contention,
+	"One thread per core locks a kernel spinlock for half a second, and reports the\n"
+	"time per acquisition, and the smallest and largest share of the acquisitions.",
+	.timeout = 120
+	)
+{
+	unsigned int nthreads = cpu_cores();
+	Tid_t tids[MAX_CORES];
+	unsigned long counts[MAX_CORES];
+
+	spinbench_counter = 0;
+	spinbench_deadline = bench_time() + SPINLOCK_BENCH_TIME;
+	double t0 = bench_time();
+	for (unsigned int i = 0; i < nthreads; i++)
+		tids[i] = CreateThread(spinbench_thread, 0, &counts[i]);
+	for (unsigned int i = 0; i < nthreads; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+	double elapsed = bench_time() - t0;
+
+	unsigned long total = 0, min = counts[0], max = counts[0];
+	for (unsigned int i = 0; i < nthreads; i++) {
+		total += counts[i];
+		if (counts[i] < min) min = counts[i];
+		if (counts[i] > max) max = counts[i];
+	}
+	ASSERT(spinbench_counter == total);
+
+	MSG("cores=%2u spinlock=%-6s: %7.1f nsec per acquisition, share per thread %5.1f%% .. %5.1f%% (fair %5.1f%%)\n",
+		nthreads, SPINLOCK_NAME, 1E9 * elapsed / total,
+		100.0 * min / total, 100.0 * max / total, 100.0 / nthreads);
+	return 0;
+}
+
+
+TEST_SUITE(scheduler_benchmarks,
+	"Benchmarks for the scheduler."
+	)
+{
+	&bench_symposium_scaling,
+	&bench_timeouts,
+	&bench_thread_spawn,
+	&bench_idle_threads,
+	&bench_cond_broadcast,
+	&bench_yield_pingpong,
+	&bench_idle_wakeup,
+	&bench_quantum_jitter,
+	&bench_mutex_contention,
+	&bench_spinlock_contention,
+	NULL
+};
+
+
+/*
+	Stream throughput benchmarks: a writer thread sends a fixed volume of data
+	in messages of a given size, and the main thread reads it with reads of the
+	same size.
+ */
+struct bench_stream {
+	Fid_t fd;
+	unsigned int msgsize;
+	size_t total;
+};
+
+static int bench_stream_writer(int argl, void* args)
+{
+	struct bench_stream* bs = args;
+	char* buf = malloc(bs->msgsize);
+	memset(buf, 'x', bs->msgsize);
+
+	size_t sent = 0;
+	while (sent < bs->total) {
+		unsigned int n = bs->msgsize;
+		if (n > bs->total - sent) n = bs->total - sent;
+		for (unsigned int off = 0; off < n;) {
+			int rc = Write(bs->fd, buf + off, n - off);
+			if (rc <= 0) { free(buf); return -1; }
+			off += rc;
+		}
+		sent += n;
+	}
+	free(buf);
+	return 0;
+}
+
+/* Context switches during the last transfer (needs make STATS=1) */
+static uintptr_t bench_switches;
+
+/* Move the data from wfd to rfd, and return the elapsed time */
+static double bench_stream_transfer(Fid_t wfd, Fid_t rfd, unsigned int msgsize, size_t total)
+{
+	struct bench_stream bs = { .fd = wfd, .msgsize = msgsize, .total = total };
+	char* buf = malloc(msgsize);
+
+	uintptr_t sw0 = cpu_context_switches();
+	double t0 = bench_time();
+	Tid_t writer = CreateThread(bench_stream_writer, sizeof(bs), &bs);
+
+	size_t received = 0;
+	while (received < total) {
+		int rc = Read(rfd, buf, msgsize);
+		if (rc <= 0) break;
+		received += rc;
+	}
+
+	int exitval;
+	ThreadJoin(writer, &exitval);
+	double elapsed = bench_time() - t0;
+	bench_switches = cpu_context_switches() - sw0;
+
+	free(buf);
+	return (received == total && exitval == 0) ? elapsed : -1.0;
+}
+
+static const unsigned int bench_msgsizes[] = { 1, 64, 4096, 65536 };
+
+/* Transfer less data for tiny messages, to keep the run time reasonable */
+static size_t bench_stream_volume(unsigned int msgsize)
+{
+	return (msgsize < 64) ? (256 << 10) : (16 << 20);
+}
+
+BOOT_TEST(bench_pipe_throughput,
+	"Report the throughput of a pipe in MB/s, for messages of 1 B, 64 B, 4 KB and 64 KB."
+	)
+{
+	for (unsigned int i = 0; i < sizeof(bench_msgsizes) / sizeof(bench_msgsizes[0]); i++) {
+		unsigned int msgsize = bench_msgsizes[i];
+		size_t total = bench_stream_volume(msgsize);
+
+		pipe_t pipe;
+		ASSERT(Pipe(&pipe) == 0);
+		double elapsed = bench_stream_transfer(pipe.write, pipe.read, msgsize, total);
+		ASSERT(elapsed > 0);
+		Close(pipe.read);
+		Close(pipe.write);
+
+		MSG("cores=%2u pipe   msg=%6u B: %9.2f MB/s, %8.1f switches/MB\n", cpu_cores(), msgsize,
+			total / elapsed / (1 << 20), bench_switches / ((double)total / (1 << 20)));
+	}
+
+	/* Streaming through a large pipe */
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe) == 0);
+	ASSERT(SetPipeSize(pipe.write, PIPE_MAX_SIZE) == PIPE_MAX_SIZE);
+	size_t total = bench_stream_volume(65536);
+	double elapsed = bench_stream_transfer(pipe.write, pipe.read, 65536, total);
+	ASSERT(elapsed > 0);
+	Close(pipe.read);
+	Close(pipe.write);
+	MSG("cores=%2u pipe   msg=%6u B: %9.2f MB/s, %8.1f switches/MB (capacity %d KB)\n", cpu_cores(), 65536,
+		total / elapsed / (1 << 20), bench_switches / ((double)total / (1 << 20)), PIPE_MAX_SIZE >> 10);
+
+	return 0;
+}
+
+static int bench_stream_reader(int argl, void* args)
+{
+	struct bench_stream* bs = args;
+	char* buf = malloc(bs->msgsize);
+	int rc;
+	bs->total = 0;
+	while ((rc = Read(bs->fd, buf, bs->msgsize)) > 0)
+		bs->total += rc;
+	free(buf);
+	return 0;
+}
+
+#define BENCH_PIPE_PEERS 4
+
+BOOT_TEST(bench_pipe_contention,
+	"Report the throughput and context switches of a pipe shared by 4 writers and 4 readers."
+	)
+{
+	const unsigned int msgsize = 4096;
+	size_t total = bench_stream_volume(msgsize);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe) == 0);
+
+	struct bench_stream wr = { .fd = pipe.write, .msgsize = msgsize, .total = total / BENCH_PIPE_PEERS };
+	struct bench_stream rd[BENCH_PIPE_PEERS];
+	Tid_t writers[BENCH_PIPE_PEERS], readers[BENCH_PIPE_PEERS];
+
+	uintptr_t sw0 = cpu_context_switches();
+	double t0 = bench_time();
+
+	for (int i = 0; i < BENCH_PIPE_PEERS; i++) {
+		rd[i] = (struct bench_stream) { .fd = pipe.read, .msgsize = msgsize };
+		readers[i] = CreateThread(bench_stream_reader, 0, &rd[i]);
+		writers[i] = CreateThread(bench_stream_writer, sizeof(wr), &wr);
+	}
+	for (int i = 0; i < BENCH_PIPE_PEERS; i++)
+		ASSERT(ThreadJoin(writers[i], NULL) == 0);
+	Close(pipe.write);
+
+	size_t received = 0;
+	for (int i = 0; i < BENCH_PIPE_PEERS; i++) {
+		ASSERT(ThreadJoin(readers[i], NULL) == 0);
+		received += rd[i].total;
+	}
+
+	double elapsed = bench_time() - t0;
+	uintptr_t switches = cpu_context_switches() - sw0;
+	ASSERT(received == total);
+	Close(pipe.read);
+
+	MSG("cores=%2u pipe   msg=%6u B, %d writers, %d readers: %9.2f MB/s, %8.1f switches/MB\n",
+		cpu_cores(), msgsize, BENCH_PIPE_PEERS, BENCH_PIPE_PEERS,
+		total / elapsed / (1 << 20), switches / ((double)total / (1 << 20)));
+	return 0;
+}
+
+
+/*
+	Pipe ping-pong: a client sends one byte over a pipe and the server sends it
+	back over another. Several pairs run at once, so that a woken thread finds
+	other threads in the run queues.
+ */
+#define PINGPONG_ROUNDS 20000
+#define PINGPONG_MAX_PAIRS 4
+
+static int pingpong_server(int argl, void* args)
+{
+	pipe_t* p = args;
+	char c;
+	while (Read(p[0].read, &c, 1) == 1)
+		ASSERT(Write(p[1].write, &c, 1) == 1);
+	return 0;
+}
+
+static int pingpong_client(int argl, void* args)
+{
+	pipe_t* p = args;
+	for (int i = 0; i < argl; i++) {
+		char c = i;
+		ASSERT(Write(p[0].write, &c, 1) == 1);
+		ASSERT(Read(p[1].read, &c, 1) == 1);
+		ASSERT(c == (char)i);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_pingpong,
+	"Report the round trip latency of 1 and 4 pairs of threads that exchange one byte\n"
+	"over pipes, with and without directed yield (sched_handoff).",
+	.timeout = 300
+	)
+{
+	int npairs[] = { 1, PINGPONG_MAX_PAIRS };
+	int saved_handoff = sched_handoff;
+
+	for (int k = 0; k < 2; k++)
+		for (int handoff = 0; handoff <= 1; handoff++) {
+			int n = npairs[k];
+			pipe_t pipes[PINGPONG_MAX_PAIRS][2];
+			Tid_t servers[PINGPONG_MAX_PAIRS], clients[PINGPONG_MAX_PAIRS];
+			sched_handoff = handoff;
+
+			uintptr_t sw0 = cpu_context_switches();
+			double t0 = bench_time();
+			for (int i = 0; i < n; i++) {
+				ASSERT(Pipe(&pipes[i][0]) == 0 && Pipe(&pipes[i][1]) == 0);
+				servers[i] = CreateThread(pingpong_server, 0, pipes[i]);
+				clients[i] = CreateThread(pingpong_client, PINGPONG_ROUNDS, pipes[i]);
+			}
+			for (int i = 0; i < n; i++) {
+				ASSERT(ThreadJoin(clients[i], NULL) == 0);
+				Close(pipes[i][0].write);
+				ASSERT(ThreadJoin(servers[i], NULL) == 0);
+				Close(pipes[i][0].read);
+				Close(pipes[i][1].read);
+				Close(pipes[i][1].write);
+			}
+			double elapsed = bench_time() - t0;
+			uintptr_t switches = cpu_context_switches() - sw0;
+
+			MSG("cores=%2u pipe ping-pong pairs=%d handoff=%d: %7.2f usec per round trip, %6.2f switches per round trip\n",
+				cpu_cores(), n, handoff, 1E6 * elapsed / PINGPONG_ROUNDS,
+				(double)switches / ((double)n * PINGPONG_ROUNDS));
+		}
+
+	sched_handoff = saved_handoff;
+	return 0;
+}
+
+/*
+	Tickless benchmark: a pair of threads exchange one byte over pipes, first
+	alone and then while one CPU-bound thread per core counts loop iterations.
+	With sched_tickless, a thread that blocks does not cancel and re-arm the
+	core timer when no other thread is queued, and a lone thread on a core is
+	not interrupted at the end of its quantum.
+ */
+#define TICKLESS_TIME 1.0
+#define TICKLESS_ROUNDS 5000
+
+static volatile int tickless_done;
+
+static int tickless_worker(int argl, void* args)
+{
+	unsigned long* count = args;
+	unsigned long n = 0;
+	while (!tickless_done) {
+		contention_work(100);
+		n++;
+	}
+	*count = n;
+	return 0;
+}
+
+/* Return the round trip latency of a ping-pong pair */
+static double tickless_pingpong()
+{
+	pipe_t pipes[2];
+	ASSERT(Pipe(&pipes[0]) == 0 && Pipe(&pipes[1]) == 0);
+	double t0 = bench_time();
+	Tid_t server = CreateThread(pingpong_server, 0, pipes);
+	Tid_t client = CreateThread(pingpong_client, TICKLESS_ROUNDS, pipes);
+	ASSERT(ThreadJoin(client, NULL) == 0);
+	double roundtrip = (bench_time() - t0) / TICKLESS_ROUNDS;
+	Close(pipes[0].write);
+	ASSERT(ThreadJoin(server, NULL) == 0);
+	Close(pipes[0].read);
+	Close(pipes[1].read);
+	Close(pipes[1].write);
+	return roundtrip;
+}
+
+BOOT_TEST(bench_tickless,
+	"A pair of threads exchange one byte over pipes 5000 times, alone and next to one\n"
+	"CPU-bound thread per core, with the quantum timer always armed and with\n"
+	"sched_tickless. Report the round trip latencies and the loop rate of the\n"
+	"CPU-bound threads.",
+	.timeout = 300
+	)
+{
+	int saved_tickless = sched_tickless;
+
+	for (int tickless = 0; tickless <= 1; tickless++) {
+		unsigned int nworkers = cpu_cores();
+		Tid_t workers[MAX_CORES];
+		unsigned long counts[MAX_CORES];
+		sched_tickless = tickless;
+		tickless_done = 0;
+
+		double alone = tickless_pingpong();
+
+		double t0 = bench_time();
+		for (unsigned int i = 0; i < nworkers; i++)
+			workers[i] = CreateThread(tickless_worker, 0, &counts[i]);
+		double busy = tickless_pingpong();
+		while (bench_time() - t0 < TICKLESS_TIME)
+			yield(SCHED_USER);
+		tickless_done = 1;
+
+		unsigned long total = 0;
+		for (unsigned int i = 0; i < nworkers; i++) {
+			ASSERT(ThreadJoin(workers[i], NULL) == 0);
+			total += counts[i];
+		}
+		double elapsed = bench_time() - t0;
+
+		MSG("cores=%2u tickless=%d: %7.2f usec per round trip alone, %7.2f usec next to workers, %6.3f loops/usec per worker\n",
+			cpu_cores(), tickless, 1E6 * alone, 1E6 * busy, 1E-6 * total / elapsed / nworkers);
+	}
+
+	sched_tickless = saved_tickless;
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_relay,
+	"Report the throughput of relaying a stream from one pipe to another, with Read/Write and with Splice."
+	)
+{
+	const unsigned int msgsize = 4096;
+	size_t total = bench_stream_volume(msgsize);
+	char* buf = malloc(msgsize);
+
+	for (int splice = 0; splice <= 1; splice++) {
+		pipe_t p1, p2;
+		ASSERT(Pipe(&p1) == 0);
+		ASSERT(Pipe(&p2) == 0);
+
+		struct bench_stream wr = { .fd = p1.write, .msgsize = msgsize, .total = total };
+		struct bench_stream rd = { .fd = p2.read, .msgsize = msgsize };
+
+		double t0 = bench_time();
+		Tid_t writer = CreateThread(bench_stream_writer, sizeof(wr), &wr);
+		Tid_t reader = CreateThread(bench_stream_reader, 0, &rd);
+
+		/* The relay */
+		size_t relayed = 0;
+		while (relayed < total) {
+			int rc;
+			if (splice)
+				rc = Splice(p1.read, p2.write, msgsize);
+			else if ((rc = Read(p1.read, buf, msgsize)) > 0)
+				for (int n = 0; n < rc; )
+					n += Write(p2.write, buf + n, rc - n);
+			ASSERT(rc > 0);
+			relayed += rc;
+		}
+		Close(p2.write);
+
+		ASSERT(ThreadJoin(writer, NULL) == 0);
+		ASSERT(ThreadJoin(reader, NULL) == 0);
+		double elapsed = bench_time() - t0;
+		ASSERT(rd.total == total);
+		Close(p1.read);
+		Close(p1.write);
+		Close(p2.read);
+
+		MSG("cores=%2u relay  msg=%6u B, %-10s: %9.2f MB/s\n", cpu_cores(), msgsize,
+			splice ? "Splice" : "Read/Write", total / elapsed / (1 << 20));
+	}
+
+	free(buf);
+	return 0;
+}
+
+BOOT_TEST(bench_writev,
+	"Report the cost of writing a 16-byte header and a 64-byte payload to the null\n"
+	"device, with two Write calls and with one WriteV call."
+	)
+{
+	const int msgs = 1000000;
+	char header[16] = { 0 }, payload[64] = { 0 };
+	iovec_t iov[2] = { { header, sizeof(header) }, { payload, sizeof(payload) } };
+
+	Fid_t null = OpenNull();
+	ASSERT(null != NOFILE);
+
+	for (int vec = 0; vec <= 1; vec++) {
+		double t0 = bench_time();
+		for (int i = 0; i < msgs; i++) {
+			if (vec)
+				ASSERT(WriteV(null, iov, 2) == sizeof(header) + sizeof(payload));
+			else {
+				ASSERT(Write(null, header, sizeof(header)) == sizeof(header));
+				ASSERT(Write(null, payload, sizeof(payload)) == sizeof(payload));
+			}
+		}
+		double elapsed = bench_time() - t0;
+
+		MSG("cores=%2u header+payload, %-10s: %7.1f nsec per message\n", cpu_cores(),
+			vec ? "WriteV" : "2 x Write", 1E9 * elapsed / msgs);
+	}
+
+	Close(null);
+	return 0;
+}
+
+/*
+	Serial throughput: write 1 MB to the console of terminal 0 and read 1 MB
+	from its keyboard, 16 KB per call. The test terminal checks the output,
+	and types the input, as fast as it can.
+ */
+#define SERIAL_BENCH_KB 1024
+#define SERIAL_BENCH_CHUNK 16384
+
+BOOT_TEST(bench_serial_throughput,
+	"Write 1 MB to terminal 0 and read 1 MB from it, 16 KB per call, and report the\n"
+	"throughput in each direction.",
+	.minimum_terminals = 1, .timeout = 120
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm != NOFILE);
+
+	char line[1025];
+	memset(line, 'x', 1024);
+	line[1024] = '\0';
+	static char buffer[SERIAL_BENCH_CHUNK];
+	const unsigned int total = SERIAL_BENCH_KB << 10;
+
+	for (int write = 1; write >= 0; write--) {
+		for (int i = 0; i < SERIAL_BENCH_KB; i++) {
+			if (write) expect(0, line); else sendme(0, line);
+		}
+		memset(buffer, 'x', sizeof(buffer));
+
+		double t0 = bench_time();
+		for (unsigned int count = 0; count < total;) {
+			unsigned int remain = total - count;
+			unsigned int size = (remain < SERIAL_BENCH_CHUNK) ? remain : SERIAL_BENCH_CHUNK;
+			int rc = write ? Write(fterm, buffer, size) : Read(fterm, buffer, size);
+			ASSERT(rc > 0);
+			count += rc;
+		}
+		double elapsed = bench_time() - t0;
+
+		MSG("cores=%2u serial %-5s: %7.2f MB/s\n", cpu_cores(), write ? "write" : "read",
+			total / elapsed / (1 << 20));
+	}
+
+	Close(fterm);
+	return 0;
+}
+
+static int bench_connect_client(int argl, void* args)
+{
+	return Connect(*(Fid_t*)args, 100, 1000);
+}
+
+BOOT_TEST(bench_socket_throughput,
+	"Report the throughput of a socket pair in MB/s, for messages of 1 B, 64 B, 4 KB and 64 KB."
+	)
+{
+	for (unsigned int i = 0; i < sizeof(bench_msgsizes) / sizeof(bench_msgsizes[0]); i++) {
+		unsigned int msgsize = bench_msgsizes[i];
+		size_t total = bench_stream_volume(msgsize);
+
+		Fid_t lsock = Socket(100);
+		ASSERT(Listen(lsock) == 0);
+		Fid_t cli = Socket(NOPORT);
+		Tid_t client = CreateThread(bench_connect_client, sizeof(cli), &cli);
+		Fid_t srv = Accept(lsock);
+		ASSERT(srv != NOFILE);
+		int rc;
+		ASSERT(ThreadJoin(client, &rc) == 0 && rc == 0);
+
+		double elapsed = bench_stream_transfer(cli, srv, msgsize, total);
+		ASSERT(elapsed > 0);
+		Close(srv);
+		Close(cli);
+		Close(lsock);
+
+		MSG("cores=%2u socket msg=%6u B: %9.2f MB/s, %8.1f switches/MB\n", cpu_cores(), msgsize,
+			total / elapsed / (1 << 20), bench_switches / ((double)total / (1 << 20)));
+	}
+	return 0;
+}
+
+
+/*
+	Echo server benchmark: a number of clients send 64-byte requests over
+	sockets and wait for the echo. The server uses either one thread per
+	connection, or a single thread that waits for all of them with Poll.
+ */
+#define ECHO_CLIENTS 6
+#define ECHO_REQUESTS 5000
+
+static int bench_echo_client(int argl, void* args)
+{
+	char msg[64] = { 0 };
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, 100, 1000) == 0);
+	for (int i = 0; i < ECHO_REQUESTS; i++) {
+		ASSERT(Write(sock, msg, sizeof(msg)) == sizeof(msg));
+		for (int n = 0; n < sizeof(msg); ) {
+			int rc = Read(sock, msg + n, sizeof(msg) - n);
+			ASSERT(rc > 0);
+			n += rc;
+		}
+	}
+	Close(sock);
+	return 0;
+}
+
+/* Echo until the client hangs up. Requests are small, so each one arrives whole. */
+static int bench_echo_connection(int sock, void* args)
+{
+	char msg[64];
+	int rc;
+	while ((rc = Read(sock, msg, sizeof(msg))) > 0)
+		ASSERT(Write(sock, msg, rc) == rc);
+	Close(sock);
+	return 0;
+}
+
+BOOT_TEST(bench_poll_server,
+	"Report the round trips per second of an echo server with 6 clients, with one\n"
+	"server thread per connection and with a single server thread using Poll."
+	)
+{
+	for (int poll = 0; poll <= 1; poll++) {
+		Fid_t lsock = Socket(100);
+		ASSERT(Listen(lsock) == 0);
+
+		double t0 = bench_time();
+		Tid_t clients[ECHO_CLIENTS], servers[ECHO_CLIENTS];
+		for (int i = 0; i < ECHO_CLIENTS; i++)
+			clients[i] = CreateThread(bench_echo_client, 0, NULL);
+
+		if (!poll) {
+			for (int i = 0; i < ECHO_CLIENTS; i++) {
+				Fid_t sock = Accept(lsock);
+				ASSERT(sock != NOFILE);
+				servers[i] = CreateThread(bench_echo_connection, sock, NULL);
+			}
+			for (int i = 0; i < ECHO_CLIENTS; i++)
+				ASSERT(ThreadJoin(servers[i], NULL) == 0);
+		} else {
+			pollfd_t fds[ECHO_CLIENTS + 1] = { { .fd = lsock, .events = POLL_READ } };
+			unsigned int n = 1;
+			int accepted = 0;
+			while (accepted < ECHO_CLIENTS || n > 1) {
+				ASSERT(Poll(fds, n, -1) > 0);
+				for (unsigned int i = 1; i < n; i++) {
+					if (!(fds[i].revents & POLL_READ)) continue;
+					char msg[64];
+					int rc = Read(fds[i].fd, msg, sizeof(msg));
+					if (rc > 0)
+						ASSERT(Write(fds[i].fd, msg, rc) == rc);
+					else {
+						Close(fds[i].fd);
+						fds[i--] = fds[--n];
+					}
+				}
+				if (fds[0].revents & POLL_READ) {
+					Fid_t sock = Accept(lsock);
+					ASSERT(sock != NOFILE);
+					fds[n++] = (pollfd_t){ .fd = sock, .events = POLL_READ };
+					accepted++;
+				}
+			}
+		}
+
+		for (int i = 0; i < ECHO_CLIENTS; i++)
+			ASSERT(ThreadJoin(clients[i], NULL) == 0);
+		double elapsed = bench_time() - t0;
+		Close(lsock);
+
+		MSG("cores=%2u echo clients=%d, %-18s: %9.0f round trips/sec\n", cpu_cores(), ECHO_CLIENTS,
+			poll ? "1 thread with Poll" : "thread per client", ECHO_CLIENTS * ECHO_REQUESTS / elapsed);
+	}
+	return 0;
+}
+
+
+TEST_SUITE(stream_benchmarks,
+	"Benchmarks for pipes and sockets."
+	)
+{
+	&bench_pipe_throughput,
+	&bench_socket_throughput,
+	&bench_pipe_contention,
+	&bench_pipe_pingpong,
+	&bench_tickless,
+	&bench_pipe_relay,
+	&bench_writev,
+	&bench_serial_throughput,
+	&bench_poll_server,
+	NULL
+};
+
+
+TEST_SUITE(all_benchmarks,
+	"All kernel benchmarks."
+	)
+{
+	&scheduler_benchmarks,
+	&stream_benchmarks,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
@@ -3,14 +3,17 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <sys/signalfd.h>
 #include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -28,15 +31,46 @@
 	- Core threads mask all signals except for USR1.
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
+	- A halted core sleeps in sigwaitinfo(), or on a futex when 
+	CORE_HALT_FUTEX is defined (see cpu_core_halt_spin).
+	- When CORE_TIMER_DIRECT is defined, the core timers send SIGUSR1 
+	to their own core, bypassing the PIC (see core_timer_signal).
 
  */
 
 
+/*
+	Core statistics are collected when CORE_STATISTICS is defined
+	(build with 'make STATS=1'), and printed when vm_boot returns.
+ */
 #if 0
 #define CORE_STATISTICS
 #endif
 
 
+/*
+	Halted cores sleep on a futex, when CORE_HALT_FUTEX is defined
+	(build with 'make HALT=futex'). Else, they sleep in sigwaitinfo().
+ */
+#if 0
+#define CORE_HALT_FUTEX
+#endif
+
+
+/*
+	Core timers interrupt their core directly, when CORE_TIMER_DIRECT is
+	defined (build with 'make TIMER=direct'). Else, they signal the PIC.
+ */
+#if 0
+#define CORE_TIMER_DIRECT
+#endif
+
+/* glibc does not define this */
+#if defined(CORE_TIMER_DIRECT) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
 /*
 	Per-core data.
  */
@@ -52,6 +86,11 @@ typedef struct core
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+#if defined(CORE_HALT_FUTEX)
+	/* Set while the core is in cpu_core_halt_spin() */
+	volatile sig_atomic_t halting;
+#endif
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -60,8 +99,14 @@ typedef struct core
 	volatile uintptr_t irq_delivered[maximum_interrupt_no];
 	volatile uintptr_t hlt_count;
 	volatile uintptr_t rst_count;
+	volatile uintptr_t spn_count;			/* halts that ended while spinning */
 	volatile TimerDuration hlt_time;
 	volatile TimerDuration run_time;
+	volatile uintptr_t swap_count;
+	volatile unsigned long timer_deadline;	/* the expiration of the timer (nsec), or 0 */
+	volatile uintptr_t alarm_count;			/* ALARMs delivered with a deadline */
+	volatile unsigned long alarm_latency;	/* total nsec from deadline to delivery */
+	volatile unsigned long alarm_latency_max;
 #endif
 
 } Core;
@@ -94,9 +139,15 @@ static volatile sig_atomic_t PIC_active;
 /* Bit vector denoting halted cores */
 static _Atomic uint32_t halt_vector;
 
+/* Bit vector denoting the halted cores that are asleep (not spinning) */
+static _Atomic uint32_t park_vector;
+
 /* PIC thread id */
 static pthread_t PIC_thread;
 
+/* The epoll instance of the PIC daemon */
+static int PIC_epfd = -1;
+
 /* Save the sigaction for SIGUSR1 */
 static struct sigaction USR1_saved_sigaction;
 
@@ -109,6 +160,9 @@ static struct sigaction USR1_sigaction;
 /* Forward decl. of per-core signal handler */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
+/* Forward decl. of core restart */
+static int __core_restart(uint c);
+
 /* PIC daemon statistics */
 static unsigned long PIC_loops;
 
@@ -158,8 +212,7 @@ static inline Core* curr_core() {
 
 
 /*
-	Cause PIC daemon to loop. This needs to happen when we wish 
-	the PIC daemon to refresh the list of fds it is polling.
+	Cause PIC daemon to loop. This is used to stop the PIC daemon.
  */
 static inline void interrupt_pic_thread()
 {
@@ -180,6 +233,9 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+#if defined(CORE_HALT_FUTEX)
+	core->halting = 0;
+#endif
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -191,8 +247,14 @@ static void* core_thread(void* _core)
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
 	/* create a thread-specific timer */
+#if defined(CORE_TIMER_DIRECT)
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+	core->timer_sigevent.sigev_notify_thread_id = gettid();
+	core->timer_sigevent.sigev_signo = SIGUSR1;
+#else
 	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
 	core->timer_sigevent.sigev_signo = SIGALRM;
+#endif
 	core->timer_sigevent.sigev_value.sival_int = core->id;
 	// Could also be CLOCK_REALTIME
 	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
@@ -232,7 +294,8 @@ static void* core_thread(void* _core)
 static inline int intr_fetch_set(Core* core, Interrupt intno)
 {
 	uint32_t sel = 1<<intno;
-	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_ACQ_REL);
+	/* Sequentially consistent, against the halt_vector (see cpu_core_halt_spin) */
+	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_SEQ_CST);
 	return (old & sel) != 0;
 }
 
@@ -302,6 +365,13 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 		core->irq_raised[intno] ++;
 #endif
 
+#if defined(CORE_HALT_FUTEX)
+		/* A halted core is restarted instead, and dispatches the interrupt */
+		if(__atomic_load_n(& halt_vector, __ATOMIC_SEQ_CST) & (1u << core->id)) {
+			__core_restart(core->id);
+			return;
+		}
+#endif
 		interrupt_core(core);
 	}
 }
@@ -325,6 +395,14 @@ static inline void dispatch_interrupts(Core* core)
 		assert(0 <= irq  && irq < maximum_interrupt_no);
 #if defined(CORE_STATISTICS)
 		core->irq_delivered[irq]++;
+		if(irq == ALARM && core->timer_deadline != 0) {
+			unsigned long now = bios_clock_ns();
+			unsigned long latency = (now > core->timer_deadline) ? now - core->timer_deadline : 0;
+			core->timer_deadline = 0;
+			core->alarm_count++;
+			core->alarm_latency += latency;
+			if(latency > core->alarm_latency_max) core->alarm_latency_max = latency;
+		}
 #endif
 		interrupt_handler* handler =  core->intvec[irq];
 		if(handler != NULL) handler();
@@ -342,6 +420,24 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	With CORE_TIMER_DIRECT, the timer of a core sends SIGUSR1 to the core
+	thread itself, and the receiver of the signal raises the ALARM. This
+	saves the two signals through the PIC thread, at each timer expiration.
+	Other SIGUSR1 are sent by pthread_sigqueue(), with a different si_code.
+ */
+static inline void core_timer_signal(Core* core, siginfo_t* si)
+{
+#if defined(CORE_TIMER_DIRECT)
+	if(si->si_code == SI_TIMER && ! intr_fetch_set(core, ALARM)) {
+#if defined(CORE_STATISTICS)
+		core->irq_raised[ALARM] ++;
+#endif
+	}
+#endif
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
  */
@@ -353,6 +449,13 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	core_timer_signal(core, si);
+
+#if defined(CORE_HALT_FUTEX)
+	/* The interrupt was raised just before the core halted; it is left to the core */
+	if(core->halting) return;
+#endif
+
 	dispatch_interrupts(core);
 }
 
@@ -386,13 +489,20 @@ static TimerDuration get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	Each io_device has a ring buffer. The cores transfer bytes to and from the 
+	ring only, and the PIC moves bytes between the ring and the fd in bulk: it
+	fills the ring of an RX device as soon as the fd has data, and drains the
+	ring of a TX device as soon as the fd can take data. Thus, a transfer of 
+	many bytes costs no host system calls on the core, and an operation of the
+	PIC costs one readv() or writev() for as many bytes as the ring and the 
+	fd allow.
 
-	A not-ready device is made ready when select() returns it as such.
+	An io_device is ready if I/O transfers may succeed, i.e., if the ring is 
+	not empty (RX) or not full (TX).
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
-	When a not-ready device becomes ready, an interrupt is raised.
+	When a not-ready device becomes ready, an interrupt is raised by the PIC.
  */
 
 typedef enum io_direction
@@ -402,9 +512,24 @@ typedef enum io_direction
 } io_direction;
 
 
+/* The size of the ring buffer of an io_device (a power of 2) */
+#define SERIAL_BUFSIZE 4096
+
 
 /*
 	An io_device is a file descriptor from which we either read or write bytes.
+
+	The ring holds the bytes in positions [tail, head), modulo SERIAL_BUFSIZE.
+	Bytes are added at the head, by the PIC (RX) or the cores (TX), and removed
+	from the tail, by the cores (RX) or the PIC (TX). The cores remove bytes 
+	by compare-and-swap on the tail, and add bytes while they hold 'busy', so 
+	that a core which is interrupted in the middle of a transfer never blocks 
+	another transfer.
+
+	The fd is registered with the PIC as one-shot. While the PIC has work for
+	a device (space in the ring of an RX device, bytes in the ring of a TX 
+	device), it arms the fd after each operation. Else, it sets 'unwatched' 
+	and leaves the fd disarmed, and the core that gives it work arms the fd.
  */
 typedef struct io_device
 {
@@ -414,20 +539,13 @@ typedef struct io_device
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
 	TimerDuration last_int;	    /* used by PIC for timeouts */
-} io_device;
+	uint32_t pic_token;			/* the epoll data of the fd (see PIC_daemon) */
 
-
-/*
-	Determine device readiness without blocking
- */
-static int io_device_ready(int fd, io_direction dir) {
-	struct pollfd pfd;
-	pfd.fd = fd;
-	int evt = (dir==IODIR_RX) ? POLLIN : POLLOUT;
-	pfd.events = evt;
-	CHECK(poll(&pfd, 1, 0));
-	return (pfd.revents & evt) ? 1 : 0;
-}
+	unsigned int head, tail;	/* the ring positions, modulo SERIAL_BUFSIZE */
+	int unwatched;				/* the fd is not armed, and the PIC will not arm it */
+	int busy;					/* a core is adding bytes to the ring (TX) */
+	char ring[SERIAL_BUFSIZE];	/* the ring buffer */
+} io_device;
 
 
 /*
@@ -456,65 +574,269 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
 	this->fd = fd;
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
-	this->ready = io_device_ready(fd, iodir);
+	this->ready = 1;
 	this->last_int = get_coarse_time();
 
+	/* The PIC watches an RX device, since its ring is empty (see PIC_daemon) */
+	this->head = this->tail = 0;
+	this->unwatched = (iodir == IODIR_TX);
+	this->busy = 0;
+
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
 }
 
+
 /*
-	Destroy device
+	Arm the fd of the device with the PIC, for one event.
  */
-static int io_device_destroy(io_device* this)
+static void io_device_arm(io_device* this)
 {
-	int rc;
-	while((rc = close(this->fd))==-1 && errno==EINTR);
-	if(rc==-1) perror("io_device_destroy: ");
-	return rc;
+	struct epoll_event ev = {
+		.events = EPOLLONESHOT | ((this->iodir == IODIR_RX) ? EPOLLIN : EPOLLOUT),
+		.data.u32 = this->pic_token
+	};
+	CHECK(epoll_ctl(PIC_epfd, EPOLL_CTL_MOD, this->fd, &ev));
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/* The number of bytes in the ring */
+static inline unsigned int io_device_count(io_device* this)
 {
-	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
+	return __atomic_load_n(&this->head, __ATOMIC_SEQ_CST) 
+		- __atomic_load_n(&this->tail, __ATOMIC_SEQ_CST);
+}
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
-	if(!ok) perror("io_device_read:");
-	assert(ok);
+/* Whether the PIC has work for the device */
+static inline int io_device_pic_work(io_device* this)
+{
+	unsigned int count = io_device_count(this);
+	return (this->iodir == IODIR_RX) ? count < SERIAL_BUFSIZE : count > 0;
+}
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
+
+/*
+	Arm the fd, if the PIC does not watch it. This is called by the cores, 
+	after they give work to the PIC.
+ */
+static void io_device_watch(io_device* this)
+{
+	if(__atomic_load_n(&this->unwatched, __ATOMIC_SEQ_CST)
+		&& __atomic_exchange_n(&this->unwatched, 0, __ATOMIC_SEQ_CST))
+		io_device_arm(this);
+}
+
+/*
+	Stop watching the fd, after an operation of the PIC. If 'recheck' is set,
+	the device is checked again, in case a core gave work to the PIC before 
+	it saw 'unwatched'.
+ */
+static void io_device_unwatch(io_device* this, int recheck)
+{
+	__atomic_store_n(&this->unwatched, 1, __ATOMIC_SEQ_CST);
+	if(recheck && io_device_pic_work(this))
+		io_device_watch(this);
+}
+
+
+/*
+	Make a device not-ready, after a failed transfer. Return 1 if the 
+	transfer may now succeed, because the PIC changed the ring before it 
+	could see that the device is not-ready.
+ */
+static int io_device_not_ready(io_device* this)
+{
+	__atomic_store_n(&this->ready, 0, __ATOMIC_SEQ_CST);
+	unsigned int count = io_device_count(this);
+	int ready = (this->iodir == IODIR_RX) ? count > 0 : count < SERIAL_BUFSIZE;
+	if(ready)
+		this->ready = 1;
+	return ready;
+}
+
+
+/*
+	Return the segments of the ring from position 'pos', of total size 'size'.
+	This is the number of segments (1 or 2).
+ */
+static int io_device_segments(io_device* this, unsigned int pos, unsigned int size, 
+	struct iovec* iov)
+{
+	unsigned int off = pos % SERIAL_BUFSIZE;
+	unsigned int first = SERIAL_BUFSIZE - off;
+	iov[0].iov_base = this->ring + off;
+	if(size <= first) {
+		iov[0].iov_len = size;
+		return 1;
 	}
-	return rc==1;
+	iov[0].iov_len = first;
+	iov[1].iov_base = this->ring;
+	iov[1].iov_len = size - first;
+	return 2;
+}
+
+
+/*
+	Transfer up to 'size' bytes from the ring of an RX device to 'buf'. 
+	Return the number of bytes transferred.
+ */
+static unsigned int io_device_read(io_device* this, char* buf, unsigned int size)
+{
+	assert(this->iodir == IODIR_RX);
+	if(size == 0) return 0;
+
+	unsigned int tail, n;
+	do {
+		tail = __atomic_load_n(&this->tail, __ATOMIC_SEQ_CST);
+		unsigned int count = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE) - tail;
+		n = (count < size) ? count : size;
+
+		struct iovec iov[2];
+		int nseg = io_device_segments(this, tail, n, iov);
+		memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+		if(nseg == 2)
+			memcpy(buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+		/* If the tail moved, the bytes may have been overwritten */
+		if(n > 0 && __atomic_compare_exchange_n(&this->tail, &tail, tail + n, 0, 
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
+	} while(n > 0 || io_device_not_ready(this));
+
+	/* On failure, the fd may be disarmed after an end of file */
+	io_device_watch(this);
+	return n;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Transfer up to 'size' bytes from 'buf' to the ring of a TX device. 
+	Return the number of bytes transferred.
+ */
+static unsigned int io_device_write(io_device* this, const char* buf, unsigned int size)
 {
 	assert(this->iodir == IODIR_TX);
+	if(size == 0) return 0;
+
+	/* 
+	  Another core is adding bytes, and it may have been interrupted: fail, 
+	  as on a full ring. The PIC raises the interrupt after it drains them.
+	 */
+	if(__atomic_exchange_n(&this->busy, 1, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&this->ready, 0, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+
+	unsigned int n;
+	do {
+		unsigned int head = this->head;
+		unsigned int space = SERIAL_BUFSIZE - (head - __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE));
+		n = (space < size) ? space : size;
+
+		struct iovec iov[2];
+		int nseg = io_device_segments(this, head, n, iov);
+		memcpy(iov[0].iov_base, buf, iov[0].iov_len);
+		if(nseg == 2)
+			memcpy(iov[1].iov_base, buf + iov[0].iov_len, iov[1].iov_len);
+		__atomic_store_n(&this->head, head + n, __ATOMIC_SEQ_CST);
+	} while(n == 0 && io_device_not_ready(this));
+
+	__atomic_store_n(&this->busy, 0, __ATOMIC_RELEASE);
+	if(n > 0)
+		io_device_watch(this);
+	return n;
+}
+
 
-	/* Try to write */
+/*
+	Check whether a transfer may succeed, without doing it. On failure, the 
+	device is made not-ready, as in a failed transfer.
+ */
+static int io_device_poll(io_device* this)
+{
+	unsigned int count = io_device_count(this);
+	int rc = (this->iodir == IODIR_RX) ? count > 0 : count < SERIAL_BUFSIZE;
+	return rc || io_device_not_ready(this);
+}
+
+
+/*
+	Read from the fd of an RX device into the free space of its ring, or write
+	the bytes of the ring of a TX device to its fd, with one system call. 
+	Return the result of the call.
+ */
+static int io_device_readv(io_device* this)
+{
+	unsigned int head = this->head;
+	unsigned int space = SERIAL_BUFSIZE - (head - __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE));
+	if(space == 0) return 0;
+
+	struct iovec iov[2];
+	int nseg = io_device_segments(this, head, space, iov);
 	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	while((rc = readv(this->fd, iov, nseg))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
-	if(! ok) perror("io_device_write:");
+	int ok = rc>=0 || (errno==EAGAIN || errno==EWOULDBLOCK);
+	if(!ok) perror("io_device_readv:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
+	if(rc > 0)
+		__atomic_store_n(&this->head, head + rc, __ATOMIC_SEQ_CST);
+	return rc;
+}
+
+static int io_device_writev(io_device* this)
+{
+	unsigned int tail = this->tail;
+	unsigned int count = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE) - tail;
+	if(count == 0) return 0;
+
+	struct iovec iov[2];
+	int nseg = io_device_segments(this, tail, count, iov);
+	int rc;
+	while((rc = writev(this->fd, iov, nseg))==-1 && errno == EINTR);
+
+	int ok = rc>=0 || (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE);
+	if(! ok) perror("io_device_writev:");
+	assert(ok);
 
-	return rc==1;
+	if(rc > 0)
+		__atomic_store_n(&this->tail, tail + rc, __ATOMIC_SEQ_CST);
+	return rc;
 }
 
 
 
+/*
+	Write out the bytes of a TX device that the PIC has not drained. This is 
+	called when the VM stops, and waits up to SERIAL_TIMEOUT for the fd.
+ */
+static void io_device_flush(io_device* this)
+{
+	while(this->iodir == IODIR_TX && this->head != this->tail) {
+		struct pollfd pfd = { .fd = this->fd, .events = POLLOUT };
+		int rc = poll(&pfd, 1, SERIAL_TIMEOUT/1000);
+		if(rc == -1 && errno == EINTR) continue;
+		if(rc <= 0) break;
+		if(io_device_writev(this) == -1 && errno != EAGAIN) break;
+	}
+}
+
+
+/*
+	Destroy device
+ */
+static int io_device_destroy(io_device* this)
+{
+	io_device_flush(this);
+
+	int rc;
+	while((rc = close(this->fd))==-1 && errno==EINTR);
+	if(rc==-1) perror("io_device_destroy: ");
+	return rc;
+}
+
+
 
 
 /*
@@ -565,19 +887,27 @@ static int terminal_destroy(terminal* this)
 	Implementation:
 	- Use Linux signal file descriptors to receive signals. Currently,
 	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
+	  * SIGUSR1 is sent to wake up the PIC_daemon thread, when the VM stops.
 
 	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
-
-	- Monitor these fds together with the fds of the terminals.
+	    results to an interrupt on the core. With CORE_TIMER_DIRECT, the 
+	    timers do not send SIGALRM.
+
+	- Monitor these fds together with the fds of the terminals, with an 
+	  epoll instance. All fds are registered once, when the PIC starts. The 
+	  terminal fds are one-shot: the fd of a device is armed while the PIC 
+	  has work for it, and the PIC sees it once, when it becomes ready. Thus,
+	  a device whose ring is full (RX) or empty (TX) does not wake up the 
+	  PIC at all.
 	
 	- At each loop dispatch interrupts as needed:
 	  * ALARM interrupts to those cores whose timer has expired
 	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
-	    an io_device which is now READY.		
+	    an io_device which is now READY, after the PIC filled or drained 
+	    its ring.
+	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
+	    an io_device which has not raised an interrupt for SERIAL_TIMEOUT.
+	    This is a safety net, in case some edge is lost.
  */
 
 
@@ -627,93 +957,92 @@ static void close_signalfd(int sfd)
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
-
+/* 
+	The epoll data of each fd: the signal fds, and then the kbd and con 
+	of each terminal.
+ */
+#define PIC_SIGALRM 0
+#define PIC_SIGUSR1 1
+#define PIC_TERM(i, dir)  (2 + 2*(i) + (dir))
+#define PIC_EVENTS  PIC_TERM(MAX_TERMINALS, 0)
 
-static void pic_selector_reset(pic_selector* ps)
+static void pic_add_fd(int epfd, int fd, uint32_t events, uint32_t token)
 {
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
+	struct epoll_event ev = { .events = events, .data.u32 = token };
+	CHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev));
 }
 
 
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
+static inline io_device* pic_device(uint32_t token)
 {
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
+	terminal* term = & TERM[(token - PIC_TERM(0,0)) / 2];
+	return ((token - PIC_TERM(0,0)) % 2 == IODIR_RX) ? & term->kbd : & term->con;
 }
 
 
-
-static int pic_select(pic_selector* ps)
+/*
+	Raise the interrupt of a device, and make it ready.
+ */
+static void io_device_raise(io_device* dev, TimerDuration now)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
+	dev->ready = 1;
+	dev->last_int = now;
+	Core* core = (Core*) dev->int_core;
+	switch(dev->iodir) {
+		case IODIR_RX:
+			raise_interrupt(core, SERIAL_RX_READY); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
 	}
-	return selcode;
-}
-
-
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
-{
-	return FD_ISSET(fd, & ps->fds[dir]);
 }
 
 
-
-
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
-{
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
-}
-
-
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
+/*
+	Do the operation of a device whose fd is ready, and arm the fd again if 
+	there is more work. If the device was not-ready and the operation made it
+	ready, raise its interrupt.
+ */
+static void pic_device_event(io_device* dev, TimerDuration now)
 {
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
+	int rc;
+	if(dev->iodir == IODIR_RX) {
+		/* At end of file, the fd is armed again by the next failed transfer */
+		rc = io_device_readv(dev);
+		if(rc == -1 || (rc > 0 && io_device_pic_work(dev)))
+			io_device_arm(dev);
+		else
+			io_device_unwatch(dev, rc > 0);
+	} else {
+		/* On a broken pipe, the fd is armed again by the next transfer */
+		rc = io_device_writev(dev);
+		if(rc == -1 && errno == EPIPE)
+			io_device_unwatch(dev, 0);
+		else if(io_device_pic_work(dev))
+			io_device_arm(dev);
+		else
+			io_device_unwatch(dev, 1);
 	}
+
+	if(rc > 0 && ! __atomic_load_n(&dev->ready, __ATOMIC_SEQ_CST))
+		io_device_raise(dev, now);
 }
 
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+/*
+	Raise the interrupts of the devices which have not raised one for 
+	SERIAL_TIMEOUT. This is called every SERIAL_TIMEOUT.
+ */
+static void pic_serial_timeouts(TimerDuration now)
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
+	for(uint i=0; i<nterm; i++) {
+		io_device* devs[2] = { & TERM[i].kbd, & TERM[i].con };
+		for(int d=0; d<2; d++)
+			if(now - devs[d]->last_int >= SERIAL_TIMEOUT)
+				io_device_raise(devs[d], now);
 	}
 }
 
 
-
-
 static void PIC_daemon(void)
 {
 
@@ -729,6 +1058,25 @@ static void PIC_daemon(void)
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+
+	/* Register all fds */
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(epfd);
+	pic_add_fd(epfd, sigalrmfd, EPOLLIN, PIC_SIGALRM);
+	pic_add_fd(epfd, sigusr1fd, EPOLLIN, PIC_SIGUSR1);
+	for(uint i=0; i<nterm; i++) {
+		io_device_check(& TERM[i].kbd);
+		io_device* devs[2] = { & TERM[i].kbd, & TERM[i].con };
+		for(int d=0; d<2; d++) {
+			/* Only a watched device is armed (the kbd, see io_device_init) */
+			uint32_t events = (devs[d]->iodir == IODIR_RX) ? EPOLLIN : EPOLLOUT;
+			devs[d]->pic_token = PIC_TERM(i, devs[d]->iodir);
+			pic_add_fd(epfd, devs[d]->fd, EPOLLONESHOT | (devs[d]->unwatched ? 0 : events), 
+				devs[d]->pic_token);
+		}
+	}
+	PIC_epfd = epfd;
+	TimerDuration next_timeout = get_coarse_time() + SERIAL_TIMEOUT;
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -736,51 +1084,51 @@ static void PIC_daemon(void)
 	/* The PIC multiplexing loop */
 	while(PIC_active) {
 
-		pic_selector ps;
-
-		pic_selector_reset(&ps);
-
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
-
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
+		/* Without terminals, there are no serial timeouts */
+		int timeout = -1;
+		if(nterm > 0) {
+			TimerDuration now = get_coarse_time();
+			timeout = (next_timeout > now) ? (next_timeout - now + 999) / 1000 : 0;
+		}
 
-		if(pic_select(&ps) == -1)
+		struct epoll_event events[PIC_EVENTS];
+		int nev = epoll_wait(epfd, events, PIC_EVENTS, timeout);
+		if(nev == -1) {
+			if(errno != EINTR)  perror("PIC_daemon: ");
 			continue;
+		}
 
 		PIC_loops++ ;
-
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
+		TimerDuration now = get_coarse_time();
+
+		for(int e=0; e<nev; e++) {
+			uint32_t token = events[e].data.u32;
+			if(token == PIC_SIGALRM) {
+				struct signalfd_siginfo sfdinfo;
+				while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
+					Core* core = & CORE[sfdinfo.ssi_int];
+					raise_interrupt(core, ALARM);
+				}
+			} else if(token == PIC_SIGUSR1) {
+				drain_signalfd(sigusr1fd);
+			} else {
+				pic_device_event(pic_device(token), now);
 			}
 		}
 
-
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
+		if(nterm > 0 && now >= next_timeout) {
+			pic_serial_timeouts(now);
+			next_timeout = now + SERIAL_TIMEOUT;
 		}
-
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
-		}
-
-
 	}
 
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
+	/* Close the fds */
+	PIC_epfd = -1;
+	CHECK(close(epfd));
 	close_signalfd(sigusr1fd);
 	close_signalfd(sigalrmfd);
 
@@ -899,8 +1247,9 @@ void vm_run(vm_config* vmc)
 	pthread_barrier_init(& system_barrier, NULL, ncores+1);
 	pthread_barrier_init(& core_barrier, NULL, ncores);
 
-	/* Initialize the halted vector */
+	/* Initialize the halted vectors */
 	halt_vector = 0;
+	park_vector = 0;
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -917,9 +1266,15 @@ void vm_run(vm_config* vmc)
 			CORE[c].irq_raised[intno] = 0;
 			CORE[c].hlt_count = 0;
 			CORE[c].rst_count = 0;
+			CORE[c].spn_count = 0;
 			CORE[c].hlt_time = 0;
 			CORE[c].run_time = get_coarse_time();
 		}
+		CORE[c].swap_count = 0;
+		CORE[c].timer_deadline = 0;
+		CORE[c].alarm_count = 0;
+		CORE[c].alarm_latency = 0;
+		CORE[c].alarm_latency_max = 0;
 #endif
 
 		/* Create the core thread */
@@ -970,6 +1325,12 @@ void vm_run(vm_config* vmc)
 		for(uint i=0;i<maximum_interrupt_no;i++) 
 			fprintf(stderr," %tu(%tu)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
 		fprintf(stderr, "  hlt(rst): %tu(%tu)", CORE[c].hlt_count, CORE[c].rst_count);
+		if(CORE[c].spn_count)
+			fprintf(stderr, "  spn: %tu", CORE[c].spn_count);
+		fprintf(stderr, "  ctxsw: %tu", CORE[c].swap_count);
+		if(CORE[c].alarm_count)
+			fprintf(stderr, "  alarm lat(max): %.1f(%.1f)us", 
+				1E-3*CORE[c].alarm_latency/CORE[c].alarm_count, 1E-3*CORE[c].alarm_latency_max);
 		fprintf(stderr, "  hltt: %2.3lf", 1E-6*CORE[c].hlt_time);
 		double util = 100.0 - 100.0 * CORE[c].hlt_time / (double)CORE[c].run_time ;
 		total_util += util;
@@ -994,56 +1355,162 @@ uint cpu_cores()
 
 
 
-void cpu_core_halt()
+/*
+	Halting and restarting cores.
+
+	A halting core sets its bit in halt_vector, and a core is restarted by
+	clearing it. The halting core first spins, watching its bit and its
+	pending interrupts, and then sleeps. Before sleeping, it also sets its
+	bit in park_vector, so that a core restarted while spinning costs no 
+	system call to the restarting core.
+
+	The halt_vector and the pending interrupts of a core are accessed in
+	sequentially consistent order: either the halting core sees an interrupt
+	raised concurrently, or the raising core sees the halt bit set. In the
+	same way, either the halting core sees its halt bit cleared, or the 
+	restarting core sees its park bit set.
+
+	With sigwaitinfo(), the halting core blocks SIGUSR1 and sleeps until it 
+	receives one. Raised interrupts are signalled as usual, and restarts are 
+	signalled only to parked cores.
+
+	With CORE_HALT_FUTEX, the halting core sleeps on the halt_vector word, 
+	with a FUTEX_WAIT_BITSET on its bit, and it is woken by a FUTEX_WAKE_BITSET
+	on its bit. An interrupt raised for a halted core restarts it instead of 
+	sending SIGUSR1, and the core dispatches it before returning, with SIGUSR1
+	blocked as in the signal handler. SIGUSR1 is not blocked while halting: a
+	signal that arrives is ignored by the handler, and the core sees the 
+	interrupt as pending. So, a halt and a restart cost at most one system 
+	call each, when no interrupt is raised.
+ */
+
+/* True while the core is halted and has no pending interrupts */
+static inline int core_halted(Core* core, uint32_t cmask)
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	return (__atomic_load_n(& halt_vector, __ATOMIC_SEQ_CST) & cmask) 
+		&& core->intr_pending == 0;
+}
+
+
+/* Sleep until the core is restarted or interrupted */
+static void core_park(Core* core, uint32_t cmask)
+{
+	__atomic_fetch_or(& park_vector, cmask, __ATOMIC_SEQ_CST);
+
+#if defined(CORE_HALT_FUTEX)
+#if defined(CORE_TIMER_DIRECT)
+	/* The timer signal must interrupt the futex wait, even if the core halts with interrupts disabled */
+	sigset_t saved_mask;
+	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, &saved_mask));
+#endif
+	uint32_t hv;
+	while(((hv = __atomic_load_n(& halt_vector, __ATOMIC_SEQ_CST)) & cmask) 
+		&& core->intr_pending == 0) {
+		/* This returns at once if halt_vector is not hv any more */
+		int rc = syscall(SYS_futex, & halt_vector, FUTEX_WAIT_BITSET_PRIVATE, hv, NULL, NULL, cmask);
+		assert(rc==0 || errno == EAGAIN || errno == EINTR);
+		(void)rc;
+	}
+#if defined(CORE_TIMER_DIRECT)
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
+#endif
+#else
+	if(core_halted(core, cmask)) {
+		siginfo_t info;
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+		if(rc>0)
+			core_timer_signal(core, &info);
+		else
+			assert(errno == EINTR || errno == EAGAIN);
+	}
+#endif
+
+	__atomic_fetch_and(& park_vector, ~cmask, __ATOMIC_SEQ_CST);
+}
+
+
+/* Wake up a parked core, after it has been restarted */
+static inline void core_unpark(uint c)
+{
+	uint32_t cmask = 1 << c;
+	if(__atomic_load_n(& park_vector, __ATOMIC_SEQ_CST) & cmask) {
+#if defined(CORE_HALT_FUTEX)
+		CHECK(syscall(SYS_futex, & halt_vector, FUTEX_WAKE_BITSET_PRIVATE, 1, NULL, NULL, cmask));
+#else
+		interrupt_core(CORE+c);
+#endif
+	}
+}
+
 
+uint cpu_core_halt_spin(uint spins)
+{
 	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
 
+#if defined(CORE_HALT_FUTEX)
+	core->halting = 1;
+#else
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+#endif
+
 #if defined(CORE_STATISTICS)
 	TimerDuration stime0 = get_coarse_time();
+	core->hlt_count ++;
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_SEQ_CST);
 
+	/* Spin for a while, then sleep */
+	uint n;
+	for(n=0; n<spins && core_halted(core, cmask); n++)
+		cpu_pause();
+
+	if(n == spins)
+		core_park(core, cmask);
 #if defined(CORE_STATISTICS)
-	core->hlt_count ++;
+	else
+		core->spn_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
+	/* Unset halt bit */
+	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
 
-	if(rc>0) {
-		/* Got signal, dispatch */
+#if defined(CORE_HALT_FUTEX)
+	core->halting = 0;
+	if(core->intr_pending) {
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 		dispatch_interrupts(core);
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
-	}
+#else
+	/* Dispatch the interrupts that woke us up */
+	dispatch_interrupts(core);
+	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+#endif
 
 #if defined(CORE_STATISTICS)
-	/* Unset halt bit */
 	core->hlt_time += get_coarse_time()-stime0;
 #endif
 
-	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	return n;
+}
 
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+void cpu_core_halt()
+{
+	cpu_core_halt_spin(0);
 }
 
+
 static int __core_restart(uint c)
 {
 	uint32_t cmask = 1 << c;
 
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
 	if( prevhv & cmask ) {
-		interrupt_core(CORE+c);
+		core_unpark(c);
 #if defined(CORE_STATISTICS)		
 		__atomic_fetch_add(& CORE[c].rst_count, 1 , __ATOMIC_RELAXED);
 #endif
@@ -1054,9 +1521,9 @@ static int __core_restart(uint c)
 }
 
 
-void cpu_core_restart(uint c)
+int cpu_core_restart(uint c)
 {
-	__core_restart(c);
+	return __core_restart(c);
 }
 
 
@@ -1073,12 +1540,32 @@ void cpu_core_restart_one()
 
 }
 
+uint cpu_core_restart_many(uint n)
+{
+	uint restarted = 0;
+	uint32_t hv = halt_vector;
+
+	/* As above, only cores with core_id < physical_cores are restarted */
+	while(hv != 0 && restarted < n) {
+		uint c = __builtin_ctz(hv);
+		hv &= hv - 1;
+		if(c < physical_cores && __core_restart(c))
+			restarted++;
+	}
+	return restarted;
+}
+
 void cpu_core_restart_all()
 {
 	for(uint c=0; c < ncores; c++)
 		__core_restart(c);
 }
 
+void cpu_pause()
+{
+	sched_yield();
+}
+
 void cpu_core_barrier_sync()
 {
 	pthread_barrier_wait(& core_barrier);
@@ -1118,6 +1605,101 @@ void cpu_enable_interrupts()
 }
 
 
+#ifdef CPU_FAST_CONTEXT
+
+/*
+	The fast context switch.
+
+	A switch pushes the callee-saved registers of the System V ABI, and the
+	SSE and x87 control words, on the stack of the old context, saves the stack
+	pointer, and pops the same from the stack of the new context. The caller
+	saves all other registers, since this is a function call.
+
+	The stack of a suspended context, from its saved stack pointer up:
+
+	  mxcsr (4 bytes), x87 control word (4 bytes)
+	  r15, r14, r13, r12, rbx, rbp
+	  return address
+ */
+void __cpu_switch(void** save_sp, void* load_sp);
+void __cpu_start();
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl __cpu_switch\n"
+	".hidden __cpu_switch\n"
+	".type __cpu_switch, @function\n"
+	"__cpu_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size __cpu_switch, .-__cpu_switch\n"
+
+	/* A new context 'returns' here, with its function in r12 */
+	".p2align 4\n"
+	".globl __cpu_start\n"
+	".hidden __cpu_start\n"
+	".type __cpu_start, @function\n"
+	"__cpu_start:\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size __cpu_start, .-__cpu_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The initial frame, as left by __cpu_switch, at the 16-byte aligned top of the stack */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*)top - 8;
+
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile("fnstcw %0" : "=m"(fpucw));
+
+	frame[0] = mxcsr | ((uint64_t)fpucw << 32);
+	frame[1] = 0;                       	/* r15 */
+	frame[2] = 0;                       	/* r14 */
+	frame[3] = 0;                       	/* r13 */
+	frame[4] = (uintptr_t) ctx_func;    	/* r12 */
+	frame[5] = 0;                       	/* rbx */
+	frame[6] = 0;                       	/* rbp, ends backtraces */
+	frame[7] = (uintptr_t) __cpu_start; 	/* return address */
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+#if defined(CORE_STATISTICS)
+	curr_core()->swap_count++;
+#endif
+	__cpu_switch(&oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1137,9 +1719,25 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 
 void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 {
+#if defined(CORE_STATISTICS)
+	curr_core()->swap_count++;
+#endif
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
+
+uintptr_t cpu_context_switches()
+{
+	uintptr_t count = 0;
+#if defined(CORE_STATISTICS)
+	for(uint c=0; c<ncores; c++)
+		count += CORE[c].swap_count;
+#endif
+	return count;
+}
+
 
 
 /*
@@ -1159,6 +1757,9 @@ TimerDuration bios_set_timer(TimerDuration usec)
 
 	struct itimerspec oldtime;
 	
+#if defined(CORE_STATISTICS)
+	curr_core()->timer_deadline = usec ? bios_clock_ns() + 1000ul*usec : 0;
+#endif
 	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
@@ -1176,6 +1777,13 @@ TimerDuration bios_clock()
 	return get_coarse_time();
 }	
 
+unsigned long bios_clock_ns()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec + curtime.tv_sec*1000000000ul;
+}
+
 
 
 uint bios_serial_ports()
@@ -1209,7 +1817,7 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -1219,7 +1827,37 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
+}
+
+
+/*
+	Read up to 'size' bytes from serial port 'serial' into 'buf', and return 
+	the number of bytes read.
+ */
+unsigned int bios_read_serial_buf(uint serial, char* buf, unsigned int size)
+{
+	return io_device_read(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Write up to 'size' bytes from 'buf' to serial port 'serial', and return
+	the number of bytes written.
+ */
+unsigned int bios_write_serial_buf(uint serial, const char* buf, unsigned int size)
+{
+	return io_device_write(& TERM[serial].con, buf, size);
+}
+
+
+/*
+	Check whether serial port 'serial' can be read (or written, if 'write' is nonzero)
+	without transferring any data.
+ */
+int bios_serial_ready(uint serial, int write)
+{
+	return io_device_poll(write ? & TERM[serial].con : & TERM[serial].kbd);
 }
 
 
@@ -66,9 +66,9 @@
 
 	The virtual machine has a number of serial ports connected to terminals.
 
-	Each serial port/terminal can support reading and writing of single bytes.
-	The reads return keyboard input, whereas the writes send characters to display
-	on the screen.
+	Each serial port/terminal can support reading and writing of bytes, singly
+	or in buffers. The reads return keyboard input, whereas the writes send 
+	characters to display on the screen.
 
 	Terminals are numbered from 0, up to @c MAX_TERMINALS-1. 
 
@@ -85,16 +85,21 @@
 
 	./terminal 1
 
-	Data can be read from  a serial port, one byte at a time. A read
+	Data can be read from  a serial port, one byte or a buffer at a time. A read
 	may fail if the device is not-ready to perform the operation. On a device
 	which is ready, the read will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_RX_READY interrupt is raised.
 
-	Data can be written to a serial port, one byte at a time. A write
+	Data can be written to a serial port, one byte or a buffer at a time. A write
 	may fail if the device is not-ready to perform the operation. On a device
 	which is ready, the write will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_TX_READY interrupt is raised.
 
+	Each serial port has a small buffer for each direction, which the VM fills
+	from the keyboard and drains to the screen in bulk. A read or write only
+	copies bytes to or from this buffer, so it is best to transfer many bytes 
+	per call.
+
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
@@ -382,13 +387,43 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/**
+	@brief Halt the core, after spinning for a while.
+
+	This is like @c cpu_core_halt(), but the core first waits for up to
+	@c spins rounds of @c cpu_pause() for an interrupt or a restart, before 
+	it halts. A core that is restarted while it spins wakes up sooner, and 
+	it costs less to the core that restarts it.
+
+	@param spins the max. number of rounds to spin
+	@returns the number of rounds spun before the core was restarted or
+		interrupted, or @c spins if the core halted
+	@see cpu_core_halt
+*/
+uint cpu_core_halt_spin(uint spins);
+
+
+/**
+	@brief Give up the processor of the core for a while, in a spin loop.
+
+	This function should be called from time to time by a core that spins
+	with interrupts disabled, waiting for another core (e.g., to release a
+	spinlock). It is similar to the @c PAUSE instruction under a hypervisor
+	with pause-loop exiting: the host may run other cores in the meantime, in
+	particular the core that is waited for, when the host has fewer processors 
+	than the simulated cores.
+*/
+void cpu_pause();
+
+
 /**
 	@brief Restart the given core.
 
 	This call will restart the given core, if it was halted.
 	@param c the core to restart
+	@returns 1 if the core was halted and has been restarted, 0 otherwise
 */
-void cpu_core_restart(uint c);
+int cpu_core_restart(uint c);
 
 /**
 	@brief Restart some halted core.
@@ -397,6 +432,16 @@ void cpu_core_restart(uint c);
 */
 void cpu_core_restart_one();
 
+/**
+	@brief Restart up to a number of halted cores.
+
+	This is like calling @c cpu_core_restart_one() @c n times, but the 
+	halted cores are found in one pass.
+	@param n the max. number of cores to restart
+	@returns the number of cores that were restarted
+*/
+uint cpu_core_restart_many(uint n);
+
 /**
 	@brief Signal all halted cores to restart.
 
@@ -405,10 +450,30 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Use the fast context switch.
+
+	On the x86-64, contexts are switched by a few lines of assembly, which save
+	only the callee-saved registers on the stack of the old context. The signal
+	mask is not part of a context: it is set once per core, when the core starts,
+	and it is changed only by the interrupt functions. Build with 'make UCONTEXT=1' 
+	(which defines @c CPU_UCONTEXT) to use @c swapcontext instead, which saves
+	and restores the signal mask with a system call on every switch.
+*/
+#if defined(__x86_64__) && !defined(CPU_UCONTEXT)
+#define CPU_FAST_CONTEXT
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
+#ifdef CPU_FAST_CONTEXT
+typedef struct cpu_context {
+	void* sp;	/**< @brief The stack pointer, where the registers are saved */
+} cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -435,6 +500,15 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 */
 void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 
+/**
+	@brief Return the number of context switches.
+
+	This is the total number of calls to @c cpu_swap_context on all cores
+	since the VM booted. It is only counted if the BIOS was built with
+	CORE_STATISTICS (make STATS=1); otherwise, it is always 0.
+*/
+uintptr_t cpu_context_switches();
+
 
 /********************************************************************************
  ********************************************************************************/
@@ -483,6 +557,15 @@ TimerDuration bios_cancel_timer();
  */
 TimerDuration bios_clock();
 
+/**
+	@brief Get the time of a precise monotonic clock, in nsec.
+
+	The clock counts from an arbitrary point in time. Its resolution is
+	fine enough to time short code sections (such as a critical section), 
+	but it costs more than @c bios_clock.
+ */
+unsigned long bios_clock_ns();
+
 
 
 
@@ -546,4 +629,59 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into the buffer 
+	@c buf. The number of bytes read is returned, which may be less than 
+	@c size if fewer bytes have been received.
+
+	If this operation returns 0 (and @c size is not 0), a @c SERIAL_RX_READY 
+	interrupt will be raised when data is ready to be received.
+
+	@param serial the serial device to read from
+	@param buf the buffer in which to store the bytes
+	@param size the size of the buffer
+	@return the number of bytes read
+ */
+unsigned int bios_read_serial_buf(uint serial, char* buf, unsigned int size);
+
+
+/**
+	@brief Write bytes to a serial port.
+
+	Try to write up to @c size bytes from buffer @c buf to serial port 
+	@c serial. The number of bytes written is returned, which may be less than
+	@c size if the buffer of the serial port is full.
+
+	If this operation returns 0 (and @c size is not 0), a @c SERIAL_TX_READY 
+	interrupt will be raised when the device is ready to accept data. The
+	operation may also return 0 while another core writes to the same serial 
+	port.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param size the number of bytes to send
+	@return the number of bytes written
+ */
+unsigned int bios_write_serial_buf(uint serial, const char* buf, unsigned int size);
+
+
+/**
+	@brief Check whether a serial port is ready for a transfer.
+
+	This call checks whether a byte can be read from (or, if @c write is nonzero,
+	written to) serial port @c serial, without transferring any data.
+
+	If this operation returns 0, the device is treated as after a failed transfer:
+	a @c SERIAL_RX_READY (or @c SERIAL_TX_READY) interrupt will be raised when 
+	the device becomes ready.
+
+	@param serial the serial device to check
+	@param write zero to check for reading, nonzero to check for writing
+	@return a integer designating readiness (non-zero) or not (zero)
+ */
+int bios_serial_ready(uint serial, int write);
+
+
 #endif
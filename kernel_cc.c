@@ -1,9 +1,13 @@
 
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_streams.h"
 #include "kernel_cc.h"
 
 
@@ -19,50 +23,702 @@
   */
 
 
+/* Tell the CPU that we are in a spin loop */
+static inline void cpu_relax()
+{
+#if defined(__x86__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+
 /*
- 	Pre-emption aware mutex.
- 	-------------------------
+ 	Pre-emption aware spinlock.
+ 	---------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	This spinlock will act as a pure spinlock if preemption is off, and a
+ 	yielding spinlock if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
- 	the non-preemptive domain of the kernel.
+ 	the non-preemptive domain of the kernel. It is used by the scheduler, and
+ 	to protect the internals of mutexes and condition variables.
+
+ 	There are three implementations, selected at build time (see the Makefile):
+
+ 	- A test-and-set lock (the default). Waiters spin on their cache, but every
+ 	  unlock makes all of them race for the lock, and some may starve.
+
+ 	- A ticket lock (SPINLOCK_TICKET). Each waiter takes a ticket and waits for
+ 	  the owner counter to reach it, so the lock is granted in FIFO order.
+ 	  Waiters still spin on the same cache line.
+
+ 	- An MCS lock (SPINLOCK_MCS). Each waiter appends a queue node to the lock,
+ 	  and spins on a flag of its own node, which its predecessor clears at unlock.
+ 	  The lock is granted in FIFO order, and an unlock touches only the cache
+ 	  line of the next waiter. This is the variant of K42, where the queue node
+ 	  lives on the stack of the waiter, and the holder keeps its successor in
+ 	  the lock itself. Thus, the lock needs no node at unlock.
+
+ 	In the queue locks, a waiter that is not running delays all the waiters behind
+ 	it. Therefore, only waiters in the non-preemptive domain join the queue. In 
+ 	the preemptive domain, a waiter polls the lock until it is free, yielding 
+ 	from time to time, as with the test-and-set lock.
 
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
+
+#define SPINLOCK_SPINS (cpu_cores()>1 ?  1000 : 10000)
+
+/* 
+	Called in each round of a spin loop, it yields from time to time in the 
+	preemptive domain, and else gives up the host processor of the core.
+ */
+static inline void spin_wait(int* spin)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+	cpu_relax();
+	if(*spin > 0)
+		(*spin)--;
+	else {
+		*spin = SPINLOCK_SPINS;
+		if(cpu_interrupts_enabled())
+			yield(SCHED_MUTEX);
+		else
+			cpu_pause();
+	}
+}
+
+
+#if defined(SPINLOCK_MCS) || defined(SPINLOCK_TICKET)
+
+/* Called by the queue locks on contention. Returns 1 if the lock was taken */
+static inline int spin_lock_preemptive(Spinlock* lock)
+{
+	if(! cpu_interrupts_enabled())
+		return 0;
+	int spin = SPINLOCK_SPINS;
+	while(! spin_trylock(lock))
+		spin_wait(&spin);
+	return 1;
+}
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-#if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
-#undef MUTEX_SPINS
+
+#if defined(SPINLOCK_MCS)
+
+/* The queue node of a waiter in an MCS lock */
+typedef struct spin_node {
+	struct spin_node* next;		/* the next waiter */
+	int waiting;				/* cleared when the lock is handed over */
+} spin_node;
+
+/* The tail of a held lock without waiters is the lock itself */
+#define SPIN_HELD(lock) ((spin_node*)(lock))
+
+void spin_lock(Spinlock* lock)
+{
+	if(spin_trylock(lock) || spin_lock_preemptive(lock))
+		return;
+
+	spin_node node;
+	spin_node* tail = __atomic_load_n((spin_node**)&lock->tail, __ATOMIC_RELAXED);
+	for(;;) {
+		if(tail == NULL) {
+			if(__atomic_compare_exchange_n((spin_node**)&lock->tail, &tail, SPIN_HELD(lock),
+					0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		node.next = NULL;
+		node.waiting = 1;
+		if(__atomic_compare_exchange_n((spin_node**)&lock->tail, &tail, &node,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	/* Link to the predecessor, and wait for it to hand over the lock */
+	if(tail == SPIN_HELD(lock))
+		__atomic_store_n((spin_node**)&lock->next, &node, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&tail->next, &node, __ATOMIC_RELEASE);
+
+	int spin = SPINLOCK_SPINS;
+	while(__atomic_load_n(&node.waiting, __ATOMIC_ACQUIRE))
+		spin_wait(&spin);
+
+	/* Move our successor to the lock, as our node goes away */
+	spin_node* next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE);
+	if(next == NULL) {
+		__atomic_store_n((spin_node**)&lock->next, NULL, __ATOMIC_RELAXED);
+		spin_node* expected = &node;
+		if(__atomic_compare_exchange_n((spin_node**)&lock->tail, &expected, SPIN_HELD(lock),
+				0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return;
+		/* Else, a waiter is linking itself to us */
+		while((next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE)) == NULL)
+			spin_wait(&spin);
+	}
+	__atomic_store_n((spin_node**)&lock->next, next, __ATOMIC_RELEASE);
+}
+
+int spin_trylock(Spinlock* lock)
+{
+	spin_node* expected = NULL;
+	return __atomic_load_n((spin_node**)&lock->tail, __ATOMIC_RELAXED) == NULL
+		&& __atomic_compare_exchange_n((spin_node**)&lock->tail, &expected, SPIN_HELD(lock),
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void spin_unlock(Spinlock* lock)
+{
+	spin_node* next = __atomic_load_n((spin_node**)&lock->next, __ATOMIC_ACQUIRE);
+
+	if(next == NULL) {
+		/* If there are no waiters, the lock becomes free */
+		spin_node* expected = SPIN_HELD(lock);
+		if(__atomic_compare_exchange_n((spin_node**)&lock->tail, &expected, NULL,
+				0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		/* Else, a waiter is linking itself to the lock */
+		int spin = SPINLOCK_SPINS;
+		while((next = __atomic_load_n((spin_node**)&lock->next, __ATOMIC_ACQUIRE)) == NULL)
+			spin_wait(&spin);
+	}
+
+	/* The node of the next waiter may go away as soon as it is cleared */
+	__atomic_store_n(&next->waiting, 0, __ATOMIC_RELEASE);
 }
 
+#undef SPIN_HELD
+
+#elif defined(SPINLOCK_TICKET)
+
+void spin_lock(Spinlock* lock)
+{
+	if(spin_trylock(lock) || spin_lock_preemptive(lock))
+		return;
+
+	unsigned short ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	int spin = SPINLOCK_SPINS;
+	while(__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+		spin_wait(&spin);
+}
+
+int spin_trylock(Spinlock* lock)
+{
+	Spinlock old, new;
+	__atomic_load(lock, &old, __ATOMIC_RELAXED);
+	if(old.owner != old.next) return 0;
+	new = (Spinlock){ old.owner, (unsigned short)(old.next + 1) };
+	return __atomic_compare_exchange(lock, &old, &new, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
 
-void Mutex_Unlock(Mutex* lock)
+void spin_unlock(Spinlock* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	/* Only the holder changes the owner counter */
+	__atomic_store_n(&lock->owner, (unsigned short)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+#else
+
+void spin_lock(Spinlock* lock)
+{
+	while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
+		int spin = SPINLOCK_SPINS;
+		while(__atomic_load_n(lock, __ATOMIC_RELAXED))
+			spin_wait(&spin);
+	}
+}
+
+int spin_trylock(Spinlock* lock)
+{
+	return !__atomic_test_and_set(lock, __ATOMIC_ACQUIRE);
+}
+
+void spin_unlock(Spinlock* lock)
+{
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+#endif
+
+#undef SPINLOCK_SPINS
+
+
+/* The cost of a contended lock acquisition, for the lock profile */
+typedef struct lock_wait {
+	unsigned long spins;		/* spin iterations */
+	unsigned long yields;		/* the times the waiter slept */
+} lock_wait;
+
+
+#ifdef LOCK_PROFILING
+
+/*
+	Lock profiling.
+	---------------
+
+	The kernel lock and the mutexes are profiled per site. A site is named by a 
+	string constant (the file and line of a Mutex_Lock call, or the name of a 
+	system call), and the sites are kept in an open addressing hash table, keyed 
+	by the address of the name. The counters are updated by relaxed atomics, 
+	since a site may be used on many cores at once.
+
+	A mutex remembers the site that locked it, and the time, to measure the 
+	hold time at unlock. The kernel lock has a single holder, which is kept in
+	kernel_site.
+ */
+
+#define LOCK_SITES 509
+
+typedef struct lock_site {
+	const char* name;
+	unsigned long acquisitions, contended, spins, yields;
+	unsigned long wait_time, hold_time;
+	unsigned long hold_hist[LOCKINFO_HIST];
+} lock_site;
+
+static lock_site lock_sites[LOCK_SITES];
+
+/* This counts the sites that do not fit in the table */
+static lock_site lock_site_overflow = { .name = "(other sites)" };
+
+static lock_site* lock_site_get(const char* name)
+{
+	uint h = ((uintptr_t) name >> 2) % LOCK_SITES;
+	for(uint i=0; i<LOCK_SITES; i++) {
+		lock_site* site = &lock_sites[(h + i) % LOCK_SITES];
+		const char* sname = __atomic_load_n(&site->name, __ATOMIC_ACQUIRE);
+		if(sname == NULL && __atomic_compare_exchange_n(&site->name, &sname, name,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return site;
+		if(sname == name)
+			return site;
+	}
+	return &lock_site_overflow;
+}
+
+#define LOCK_PROF_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+/* Record an acquisition, with w == NULL if it was not contended */
+static inline void lock_profile_acquired(lock_site* site, lock_wait* w, unsigned long wait_ns)
+{
+	LOCK_PROF_ADD(site->acquisitions, 1);
+	if(w) {
+		LOCK_PROF_ADD(site->contended, 1);
+		LOCK_PROF_ADD(site->spins, w->spins);
+		LOCK_PROF_ADD(site->yields, w->yields);
+		LOCK_PROF_ADD(site->wait_time, wait_ns);
+	}
+}
+
+static inline void lock_profile_released(lock_site* site, unsigned long hold_ns)
+{
+	uint bucket = 0;
+	for(unsigned long t = hold_ns >> 8; t && bucket < LOCKINFO_HIST-1; t >>= 1)
+		bucket++;
+	LOCK_PROF_ADD(site->hold_time, hold_ns);
+	LOCK_PROF_ADD(site->hold_hist[bucket], 1);
+}
+
+void lock_profile_reset()
+{
+	memset(lock_sites, 0, sizeof(lock_sites));
+	const char* name = lock_site_overflow.name;
+	memset(&lock_site_overflow, 0, sizeof(lock_site_overflow));
+	lock_site_overflow.name = name;
+}
+
+static int lock_site_cmp(const void* a, const void* b)
+{
+	const lock_site* sa = *(lock_site* const*) a;
+	const lock_site* sb = *(lock_site* const*) b;
+	return (sa->hold_time < sb->hold_time) - (sa->hold_time > sb->hold_time);
+}
+
+void lock_profile_print()
+{
+	lock_site* sorted[LOCK_SITES+1];
+	uint n = 0;
+	for(uint i=0; i<LOCK_SITES; i++)
+		if(lock_sites[i].acquisitions) sorted[n++] = &lock_sites[i];
+	if(lock_site_overflow.acquisitions) sorted[n++] = &lock_site_overflow;
+	if(n == 0) return;
+	qsort(sorted, n, sizeof(lock_site*), lock_site_cmp);
+
+	fprintf(stderr, "Lock profile (times in usec, holds per bucket from <256 nsec, doubling):\n");
+	fprintf(stderr, "%-32s %10s %10s %12s %8s %12s %12s  %s\n",
+		"site", "acquired", "contended", "spins", "yields", "wait", "hold", "hold histogram");
+	for(uint i=0; i<n; i++) {
+		lock_site* site = sorted[i];
+		fprintf(stderr, "%-32s %10lu %10lu %12lu %8lu %12.1f %12.1f ", site->name, 
+			site->acquisitions, site->contended, site->spins, site->yields,
+			site->wait_time * 1E-3, site->hold_time * 1E-3);
+		uint last = LOCKINFO_HIST;
+		while(last > 0 && site->hold_hist[last-1] == 0) last--;
+		for(uint b=0; b<last; b++)
+			fprintf(stderr, " %lu", site->hold_hist[b]);
+		fprintf(stderr, "\n");
+	}
+}
+
+
+/*
+	The lock information stream returns the sites of the table in order, and 
+	then the overflow site, skipping the unused ones.
+ */
+
+static int lockinfo_read(void* this, char* buf, unsigned int size)
+{
+	uint* cursor = this;
+	if(size < sizeof(lockinfo)) return -1;
+
+	while(*cursor <= LOCK_SITES) {
+		lock_site* site = (*cursor < LOCK_SITES) ? &lock_sites[*cursor] : &lock_site_overflow;
+		(*cursor)++;
+		if(__atomic_load_n(&site->acquisitions, __ATOMIC_RELAXED) == 0) continue;
+
+		lockinfo info;
+		memset(&info, 0, sizeof(info));
+		/* Long names are truncated from the front, to keep the line numbers */
+		size_t len = strlen(site->name);
+		const char* name = site->name;
+		if(len >= LOCKINFO_NAME_SIZE) name += len - (LOCKINFO_NAME_SIZE-1);
+		strncpy(info.name, name, LOCKINFO_NAME_SIZE-1);
+
+		info.acquisitions = __atomic_load_n(&site->acquisitions, __ATOMIC_RELAXED);
+		info.contended = __atomic_load_n(&site->contended, __ATOMIC_RELAXED);
+		info.spins = __atomic_load_n(&site->spins, __ATOMIC_RELAXED);
+		info.yields = __atomic_load_n(&site->yields, __ATOMIC_RELAXED);
+		info.wait_time = __atomic_load_n(&site->wait_time, __ATOMIC_RELAXED);
+		info.hold_time = __atomic_load_n(&site->hold_time, __ATOMIC_RELAXED);
+		for(uint b=0; b<LOCKINFO_HIST; b++)
+			info.hold_hist[b] = __atomic_load_n(&site->hold_hist[b], __ATOMIC_RELAXED);
+
+		memcpy(buf, &info, sizeof(info));
+		return sizeof(info);
+	}
+	return 0;
+}
+
+static int lockinfo_close(void* this)
+{
+	free(this);
+	return 0;
+}
+
+static file_ops lockinfo_ops = {
+	.Read = lockinfo_read,
+	.Close = lockinfo_close
+};
+
+Fid_t sys_OpenLockInfo()
+{
+	FCB* fcb;
+	Fid_t fid;
+	if(! FCB_reserve(1, &fid, &fcb)) return NOFILE;
+
+	uint* cursor = xmalloc(sizeof(uint));
+	*cursor = 0;
+	fcb->streamfunc = &lockinfo_ops;
+	fcb->streamobj = cursor;
+	return fid;
+}
+
+#else
+
+Fid_t sys_OpenLockInfo()
+{
+	return NOFILE;
+}
+
+#endif
+
+
+/*
+	Sleeping mutex.
+	---------------
+
+	A mutex is locked by a compare-and-swap of its state, from MUTEX_FREE to
+	MUTEX_LOCKED. On contention, the caller spins for a while, as long as the
+	owner of the mutex is the current thread of the core it locked the mutex on.
+	A running owner will probably unlock the mutex soon, and sleeping would cost
+	more than spinning. Else, the caller sleeps in the waitset of the mutex, after 
+	marking the state as MUTEX_WAITERS.
+
+	Unlocking a MUTEX_LOCKED mutex just clears the state. Unlocking a MUTEX_WAITERS 
+	mutex wakes up the first waiter of the waitset. Usually the mutex is released,
+	and the waiter competes for it with the running threads; if it loses, it goes
+	back to the front of the waitset. Handing the mutex over to a sleeping waiter 
+	would cost a context switch for every critical section, as long as the mutex 
+	is contended (a lock convoy). But if the first waiter has been waiting for 
+	more than MUTEX_HANDOFF_TIME, the mutex is handed over to it, and it is woken 
+	up already owning the mutex, so that waiters cannot starve.
+
+	A waiter that locks the mutex marks it as MUTEX_WAITERS if the waitset is not 
+	empty, so that the next unlock will wake up the next waiter.
+
+	In the non-preemptive domain (and before the scheduler starts), the mutex acts
+	as a spinlock, since the caller cannot sleep.
+
+	The waitset is protected by mx->waitset_lock, which is always locked with
+	preemption off, since an unlock may happen in an interrupt handler.
+ */
+
+#define MUTEX_FREE    0   /* not locked */
+#define MUTEX_LOCKED  1   /* locked, with no waiters */
+#define MUTEX_WAITERS 2   /* locked, and the waitset may be non-empty */
+
+/* The number of times to check a running owner, before sleeping */
+#define MUTEX_SPINS 1000
+
+/* The time that a waiter waits before the mutex is handed over to it */
+#define MUTEX_HANDOFF_TIME (QUANTUM/10)
+
+/** \cond HELPER Helper structure for mutexes. */
+typedef struct __mutex_waiter {
+	rlnode node;				/* become part of a ring */
+	TCB* thread;				/* thread to wait */
+	TimerDuration since;		/* the time the thread started waiting */
+	sig_atomic_t woken;			/* this is set when the waiter is removed from the ring */
+	sig_atomic_t granted;		/* this is set when the mutex is handed over to thread */
+} __mutex_waiter;
+/** \endcond */
+
+
+/* Return 1 if the owner of the mutex may be running on some core */
+static inline int mutex_owner_running(Mutex* mx)
+{
+	TCB* owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+	uint core = __atomic_load_n(&mx->owner_core, __ATOMIC_RELAXED);
+
+	/* The owner may not have recorded itself yet */
+	if(owner == NULL) return 1;
+	return core < cpu_cores() && cctx[core].current_thread == owner;
+}
+
+
+/* Try to lock a free mutex, returns 1 on success */
+static inline int mutex_trylock(Mutex* mx)
+{
+	char expected = MUTEX_FREE;
+	return __atomic_compare_exchange_n(&mx->locked, &expected, MUTEX_LOCKED, 
+		0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+/* 
+  Sleep in the waitset of a locked mutex, until the thread is woken up by an unlock.
+  A waiter that was woken up before goes to the front of the waitset, keeping its
+  waiting time in 'since'. Returns 1 if the mutex was locked, either because it was 
+  free or because it was handed over, and 0 if the caller should try again.
+ */
+static int mutex_sleep(Mutex* mx, TCB* self, TimerDuration* since)
+{
+	int locked = 1;
+	int preempt = preempt_off;
+	spin_lock(&mx->waitset_lock);
+
+	if(__atomic_exchange_n(&mx->locked, MUTEX_WAITERS, __ATOMIC_ACQUIRE) == MUTEX_FREE) {
+		/* The mutex was unlocked meanwhile, and it is ours */
+		if(mx->waitset == NULL)
+			__atomic_store_n(&mx->locked, MUTEX_LOCKED, __ATOMIC_RELAXED);
+	} else {
+		int woken_before = (*since != NO_TIMEOUT);
+		if(! woken_before) *since = bios_clock();
+		__mutex_waiter waiter = { .thread=self, .since=*since, .woken=0, .granted=0 };
+		rlnode_init(& waiter.node, &waiter);
+
+		/* We push the current thread to the back of the list, or to the front */
+		if(mx->waitset) {
+			__mutex_waiter* wset = mx->waitset;
+			rlist_push_back(& wset->node, & waiter.node);
+			if(woken_before) mx->waitset = &waiter;
+		} else {
+			mx->waitset = &waiter;
+		}
+
+		/* We may be woken up by others, but only an unlock removes us from the ring */
+		while(! waiter.woken) {
+			sleep_releasing(STOPPED, &mx->waitset_lock, SCHED_MUTEX, NO_TIMEOUT);
+			spin_lock(&mx->waitset_lock);
+		}
+		locked = waiter.granted;
+	}
+
+	spin_unlock(&mx->waitset_lock);
+	if(preempt) preempt_on;
+	return locked;
+}
+
+
+/*
+  Lock a free mutex, for a waiter that was woken up before but cannot sleep 
+  (a waiter that was moved from a condition variable with preemption off). 
+  The mutex is marked as MUTEX_WAITERS if the waitset is not empty. 
+  Returns 1 on success.
+ */
+static int mutex_trylock_woken(Mutex* mx)
+{
+	int preempt = preempt_off;
+	spin_lock(&mx->waitset_lock);
+	char expected = MUTEX_FREE;
+	int locked = __atomic_compare_exchange_n(&mx->locked, &expected, 
+		mx->waitset ? MUTEX_WAITERS : MUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+	spin_unlock(&mx->waitset_lock);
+	if(preempt) preempt_on;
+	return locked;
+}
+
+/* 
+  Lock a mutex that was found locked. A waiter that was woken up before passes
+  the time it started waiting in 'since', else NO_TIMEOUT.
+ */
+static void mutex_lock_contended(Mutex* mx, lock_wait* w, TimerDuration since)
+{
+	TCB* self = cur_thread();
+	int can_sleep = cpu_interrupts_enabled() && self != NULL && self->type != IDLE_THREAD;
+
+	while(1) {
+		/* Spin while the owner is running (or always, if we cannot sleep) */
+		int spin = MUTEX_SPINS;
+		while(__atomic_load_n(&mx->locked, __ATOMIC_RELAXED) != MUTEX_FREE) {
+			if(can_sleep && (spin-- == 0 || ! mutex_owner_running(mx)))
+				break;
+			cpu_relax();
+			w->spins++;
+		}
+
+		/* A woken waiter must mark the waiters, when it takes the mutex */
+		if(since == NO_TIMEOUT) {
+			if(mutex_trylock(mx)) return;
+		} else if(! can_sleep && mutex_trylock_woken(mx))
+			return;
+
+		if(can_sleep) {
+			w->yields++;
+			if(mutex_sleep(mx, self, &since))
+				return;
+		}
+	}
+}
+
+/* 
+  Record the owner, for the spinning of other threads. This is only a hint,
+  so we do not turn preemption off (which costs two system calls of the host).
+ */
+static inline void mutex_set_owner(Mutex* mx)
+{
+	uint core = cpu_core_id;
+	__atomic_store_n(&mx->owner, cctx[core].current_thread, __ATOMIC_RELAXED);
+	__atomic_store_n(&mx->owner_core, core, __ATOMIC_RELAXED);
+}
+
+/* The parentheses keep the name from expanding to the macro of LOCK_PROFILING */
+void (Mutex_Lock)(Mutex* mx)
+{
+	lock_wait w = { 0, 0 };
+	if(! mutex_trylock(mx))
+		mutex_lock_contended(mx, &w, NO_TIMEOUT);
+	mutex_set_owner(mx);
+}
+
+#ifdef LOCK_PROFILING
+/* Record that a mutex was locked at a site, with w == NULL if it was not contended */
+static void mutex_profile_locked(Mutex* mx, const char* name, lock_wait* w, unsigned long t0)
+{
+	unsigned long now = bios_clock_ns();
+	lock_site* site = lock_site_get(name);
+	lock_profile_acquired(site, w, now - t0);
+	mx->site = site;
+	mx->since = now;
+}
+
+void Mutex_Lock_at(Mutex* mx, const char* name)
+{
+	lock_wait w = { 0, 0 };
+	unsigned long t0 = bios_clock_ns();
+	int contended = ! mutex_trylock(mx);
+	if(contended)
+		mutex_lock_contended(mx, &w, NO_TIMEOUT);
+	mutex_set_owner(mx);
+	mutex_profile_locked(mx, name, contended ? &w : NULL, t0);
+}
+#endif
+
+
+/* Wake up the first waiter of a MUTEX_WAITERS mutex, handing the mutex over to it if it has waited long */
+static void mutex_unlock_contended(Mutex* mx)
+{
+	uint core = NOCORE;
+
+	int preempt = preempt_off;
+	spin_lock(&mx->waitset_lock);
+
+	__mutex_waiter* waiter = mx->waitset;
+	if(waiter == NULL) {
+		__atomic_store_n(&mx->locked, MUTEX_FREE, __ATOMIC_RELEASE);
+	} else {
+		/* Remove the waiter from the ring */
+		__mutex_waiter* nextw = waiter->node.next->obj;
+		mx->waitset = (nextw == waiter) ? NULL : nextw;
+		rlist_remove(& waiter->node);
+
+		if(bios_clock() - waiter->since >= MUTEX_HANDOFF_TIME) {
+			/* The waiter owns the mutex from now on */
+			__atomic_store_n(&mx->owner, waiter->thread, __ATOMIC_RELAXED);
+			__atomic_store_n(&mx->owner_core, waiter->thread->last_core, __ATOMIC_RELAXED);
+			if(mx->waitset == NULL)
+				__atomic_store_n(&mx->locked, MUTEX_LOCKED, __ATOMIC_RELAXED);
+			waiter->granted = 1;
+		} else {
+			/* The waiter will mark the mutex again, if others still wait */
+			__atomic_store_n(&mx->locked, MUTEX_FREE, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&waiter->woken, 1, __ATOMIC_RELEASE);
+
+		/* If the waiter is not asleep, it will see that it was woken anyway */
+		wakeup_deferred(waiter->thread, &core);
+	}
+
+	spin_unlock(&mx->waitset_lock);
+	wakeup_notify(core);
+	if(preempt) preempt_on;
+}
+
+
+void Mutex_Unlock(Mutex* mx)
+{
+#ifdef LOCK_PROFILING
+	lock_site* site = mx->site;
+	if(site) {
+		mx->site = NULL;
+		lock_profile_released(site, bios_clock_ns() - mx->since);
+	}
+#endif
+	__atomic_store_n(&mx->owner, NULL, __ATOMIC_RELAXED);
+
+	char expected = MUTEX_LOCKED;
+	if(! __atomic_compare_exchange_n(&mx->locked, &expected, MUTEX_FREE, 
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		mutex_unlock_contended(mx);
 }
 
 
 /*
 	Condition variables.	
+	--------------------
+
+	A thread that waits on a condition variable with a mutex must lock the mutex
+	again when it is signalled. The signaller usually holds the mutex, so waking
+	the thread up would only make it block again on the mutex. Instead, if the 
+	mutex is locked, the waiter is moved to the waitset of the mutex (wait 
+	morphing), and it is woken up by the unlock of the mutex, like any other 
+	waiter. Each waiter carries a __mutex_waiter for this purpose.
+
+	A waiter is moved with the lock of the condition variable and the lock of
+	the mutex waitset held, in this order.
 */
 
 
@@ -73,9 +729,67 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	Mutex* mutex;				/* the mutex to lock again, or NULL */
+	sig_atomic_t requeued;		/* this is set if the waiter is moved to the mutex */
+	__mutex_waiter mwaiter;		/* the waiter in the waitset of the mutex */
 } __cv_waiter;
 /** \endcond */
 
+
+/*
+  Move a signalled waiter to the back of the waitset of its mutex, if the mutex
+  is locked. Returns 1 if the waiter was moved, and 0 if it must be woken up.
+
+  *** MUST BE CALLED WITH waiter->mutex->waitset_lock HELD ***
+ */
+static int cv_requeue(__cv_waiter* waiter)
+{
+	Mutex* mx = waiter->mutex;
+
+	/* The unlock of a MUTEX_WAITERS mutex will look at the waitset */
+	char state = __atomic_load_n(&mx->locked, __ATOMIC_RELAXED);
+	while(state == MUTEX_LOCKED && ! __atomic_compare_exchange_n(&mx->locked, &state, 
+			MUTEX_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if(state == MUTEX_FREE)
+		return 0;
+
+	__mutex_waiter* mw = &waiter->mwaiter;
+	*mw = (__mutex_waiter) { .thread=waiter->thread, .since=bios_clock(), .woken=0, .granted=0 };
+	rlnode_init(& mw->node, mw);
+	if(mx->waitset) {
+		__mutex_waiter* wset = mx->waitset;
+		rlist_push_back(& wset->node, & mw->node);
+	} else {
+		mx->waitset = mw;
+	}
+	waiter->requeued = 1;
+	return 1;
+}
+
+
+/*
+  Lock the mutex of a waiter that was moved to the mutex waitset by cv_requeue.
+ */
+static void mutex_lock_requeued(Mutex* mx, __mutex_waiter* mw, lock_wait* w)
+{
+	/* We may have been woken up by a timeout, before the unlock of the mutex */
+	if(! __atomic_load_n(&mw->woken, __ATOMIC_ACQUIRE)) {
+		int preempt = preempt_off;
+		spin_lock(&mx->waitset_lock);
+		while(! mw->woken) {
+			sleep_releasing(STOPPED, &mx->waitset_lock, SCHED_MUTEX, NO_TIMEOUT);
+			spin_lock(&mx->waitset_lock);
+		}
+		spin_unlock(&mx->waitset_lock);
+		if(preempt) preempt_on;
+	}
+
+	w->yields++;
+	if(! mw->granted)
+		mutex_lock_contended(mx, w, mw->since);
+	mutex_set_owner(mx);
+}
+
 /**
    @internal
    A helper routine to remove a condition waiter from the CondVar ring.
@@ -99,16 +813,18 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 	condition variables. It is used to implement the @c Cond_Wait and @c Cond_TimedWait
 	system calls, as well as internal kernel 'wait' functionality.
 
-  The function must be called only while we have locked the mutex that 
-  is associated with this call. It will put the calling thread to sleep, 
-  unlocking the mutex. These operations happen atomically.  
+  The function must be called only while we have locked the mutex (or,
+  inside the kernel, the spinlock) that is associated with this call. 
+  It will put the calling thread to sleep, unlocking the mutex. These 
+  operations happen atomically.  
 
   When the thread is woken up later (by another thread that calls @c 
   Cond_Signal or @c Cond_Broadcast, or because the timeout has expired, or
   because the thread was awoken by another kernel routine), 
   it first re-locks the mutex and then returns.  
 
-  @param mx The mutex to be unlocked as the thread sleeps.
+  @param mutex The mutex to be unlocked as the thread sleeps, or NULL.
+  @param spinlock The spinlock to be unlocked, if @c mutex is NULL.
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
@@ -118,13 +834,19 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+static int cv_wait(Mutex* mutex, Spinlock* spinlock, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0, 
+		.mutex=mutex, .requeued=0 };
 	rlnode_init(& waiter.node, &waiter);
+#ifdef LOCK_PROFILING
+	/* The mutex is locked again for the site that locked it */
+	lock_site* site = mutex ? mutex->site : NULL;
+	const char* site_name = site ? site->name : __func__;
+#endif
 
-	Mutex_Lock(&(cv->waitset_lock));
+	spin_lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
 		__cv_waiter* wset = cv->waitset;
@@ -134,71 +856,531 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 
 	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
+	if(mutex) Mutex_Unlock(mutex); else spin_unlock(spinlock);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	spin_lock(&(cv->waitset_lock));
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
 		remove_from_ring(cv, &waiter);
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
-
-	Mutex_Lock(mutex);
+	int requeued = waiter.requeued;
+	spin_unlock(&(cv->waitset_lock));
+
+	if(requeued) {
+		lock_wait w = { 0, 0 };
+#ifdef LOCK_PROFILING
+		unsigned long t0 = bios_clock_ns();
+		mutex_lock_requeued(mutex, &waiter.mwaiter, &w);
+		mutex_profile_locked(mutex, site_name, &w, t0);
+#else
+		mutex_lock_requeued(mutex, &waiter.mwaiter, &w);
+#endif
+	}
+#ifdef LOCK_PROFILING
+	else if(mutex) Mutex_Lock_at(mutex, site_name); else spin_lock(spinlock);
+#else
+	else if(mutex) Mutex_Lock(mutex); else spin_lock(spinlock);
+#endif
 	return waiter.signalled;
 }
 
 
 /**
   @internal
-  Helper for Cond_Signal and Cond_Broadcast. This method 
-  will actually find a waiter to signal, if one exists. 
-  Else, it leaves the cv->waitset == NULL.
+  Helper for Cond_Signal. This method will actually find a waiter 
+  to signal, if one exists. Else, it leaves the cv->waitset == NULL.
+
+  It returns the core that the waiter was queued on, or NOCORE.
+  The caller must notify the core after releasing cv->waitset_lock, 
+  since the woken thread will need this lock as soon as it runs.
+  It must be called with preemption off.
  */
-static inline void cv_signal(CondVar* cv)
+static inline uint cv_signal(CondVar* cv)
 {
+	uint core;
+
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+
+		/* A waiter that is moved to a locked mutex stays asleep */
+		if(waiter->mutex) {
+			spin_lock(&waiter->mutex->waitset_lock);
+			int requeued = cv_requeue(waiter);
+			spin_unlock(&waiter->mutex->waitset_lock);
+			if(requeued) {
+				waiter->signalled = 1;
+				return NOCORE;
+			}
+		}
+
+		if(wakeup_deferred(waiter->thread, &core)) {
 			waiter->signalled = 1;
-			return;
+			return core;
 		}
 	}
+	return NOCORE;
 }
 
 
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
-	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
+	return cv_wait(mutex, NULL, cv, SCHED_USER, NO_TIMEOUT);
 }
 
 int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 {
 	/* We have to translate timeout from msec to usec */
-	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+	return cv_wait(mutex, NULL, cv, SCHED_USER, timeout*1000ul);
 }
 
 
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  /* The common case of no waiters */
+  if(__atomic_load_n(&cv->waitset, __ATOMIC_RELAXED) == NULL)
+    return;
+
+  int preempt = preempt_off;
+  spin_lock(&(cv->waitset_lock));
+  uint core = cv_signal(cv);
+  spin_unlock(&(cv->waitset_lock));
+  wakeup_notify(core);
+  if(preempt) preempt_on;
 }
 
 
+/*
+  The whole waitset is detached, and the waiters that are not moved to their
+  mutex are woken up as one batch. The waiters must be marked while 
+  cv->waitset_lock is held, since a waiter that has timed out may return 
+  (and its __cv_waiter is gone) as soon as the lock is released.
+ */
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  /* Do not even start a batch, for the common case of no waiters */
+  if(__atomic_load_n(&cv->waitset, __ATOMIC_RELAXED) == NULL)
+    return;
+
+  wakeup_batch wb;
+  wakeup_batch_begin(&wb);
+
+  spin_lock(&(cv->waitset_lock));
+  __cv_waiter* head = cv->waitset;
+  cv->waitset = NULL;
+  if(head) {
+    /* The waiters usually share a mutex, whose waitset lock is kept */
+    Mutex* locked = NULL;
+    __cv_waiter* waiter = head;
+    do {
+      __cv_waiter* next = waiter->node.next->obj;
+      waiter->removed = 1;
+      if(waiter->mutex != locked) {
+        if(locked) spin_unlock(&locked->waitset_lock);
+        locked = waiter->mutex;
+        if(locked) spin_lock(&locked->waitset_lock);
+      }
+      if((locked && cv_requeue(waiter)) || wakeup_batch_add(&wb, waiter->thread))
+        waiter->signalled = 1;
+      waiter = next;
+    } while(waiter != head);
+    if(locked) spin_unlock(&locked->waitset_lock);
+  }
+  spin_unlock(&(cv->waitset_lock));
+
+  wakeup_batch_end(&wb);
+}
+
+
+
+/*
+	Wait queues.
+	------------
+
+	Reader-writer locks, semaphores and event flags keep their waiting threads 
+	in a FIFO queue of __wq_waiter objects, protected by the spinlock of the 
+	object. A thread that changes the object grants it to the waiters that can 
+	proceed, removes them from the queue and wakes them up. Thus, only these 
+	threads are woken up, and they do not have to compete for the object again.
+
+	The state of each object tells if its queue is empty. If it is, the fast 
+	paths change the state by a compare-and-swap, without the spinlock. Else, 
+	the state only changes with the spinlock locked, and preemption off (since 
+	semaphores and event flags may be used by interrupt handlers).
+ */
+
+/** \cond HELPER Helper structure for wait queues. */
+typedef struct __wq_waiter {
+	rlnode node;				/* become part of a ring */
+	TCB* thread;				/* thread to wait */
+	unsigned int want;			/* what the thread waits for (depends on the object) */
+	int mode;					/* how the thread waits for it (depends on the object) */
+	unsigned int got;			/* what the thread was granted */
+	sig_atomic_t granted;		/* this is set when the waiter is removed by a grant */
+} __wq_waiter;
+/** \endcond */
+
+static inline void wq_remove(void** waitset, __wq_waiter* w)
+{
+	if(*waitset == w) {
+		__wq_waiter* nextw = w->node.next->obj;
+		*waitset = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+}
+
+/* Remove a waiter from the queue and wake it up. Its core is added to 'notify' */
+static inline void wq_grant(void** waitset, __wq_waiter* w, unsigned int got, uint32_t* notify)
+{
+	uint core = NOCORE;
+	wq_remove(waitset, w);
+	w->got = got;
+	w->granted = 1;
+	wakeup_deferred(w->thread, &core);
+	if(core != NOCORE) *notify |= 1u << core;
+}
+
+/* Notify the cores of the woken threads, after the spinlock is unlocked */
+static inline void wq_notify(uint32_t notify)
+{
+	while(notify) {
+		uint core = __builtin_ctz(notify);
+		notify &= notify - 1;
+		wakeup_notify(core);
+	}
+}
+
+/* Translate a timeout in msec (negative to wait for ever) to a deadline */
+static inline TimerDuration wq_deadline(timeout_t timeout)
+{
+	return ((long) timeout < 0) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+}
+
+/*
+	Add a waiter for the current thread to the back of a queue, and sleep until 
+	something is granted to it, or the deadline passes. It must be called with 
+	the spinlock locked, which is locked again on return. Returns 1 if the 
+	thread was granted the object. Else, the waiter is removed from the queue.
+ */
+static int wq_wait(void** waitset, Spinlock* lock, __wq_waiter* waiter, 
+	enum SCHED_CAUSE cause, TimerDuration deadline)
+{
+	waiter->thread = cur_thread();
+	waiter->got = 0;
+	waiter->granted = 0;
+	rlnode_init(& waiter->node, waiter);
+	if(*waitset) {
+		__wq_waiter* wset = *waitset;
+		rlist_push_back(& wset->node, & waiter->node);
+	} else {
+		*waitset = waiter;
+	}
+
+	/* We may be woken up by others, but only a grant removes us from the queue */
+	while(! waiter->granted) {
+		TimerDuration timeout = NO_TIMEOUT;
+		if(deadline != NO_TIMEOUT) {
+			TimerDuration now = bios_clock();
+			if(now >= deadline) {
+				wq_remove(waitset, waiter);
+				return 0;
+			}
+			timeout = deadline - now;
+		}
+		sleep_releasing(STOPPED, lock, cause, timeout);
+		spin_lock(lock);
+	}
+	return 1;
+}
+
+
+/*
+	Reader-writer locks.
+	--------------------
+
+	The state holds the number of readers, RW_WRITER if a writer holds the lock,
+	and RW_WAITERS if the queue is not empty. The waiters want RW_WRITER, or 
+	RW_READER.
+ */
+
+#define RW_READER   1u
+#define RW_READERS  0x3fffffffu
+#define RW_WAITERS  0x40000000u
+#define RW_WRITER   0x80000000u
+
+/* Hand a released lock over to the first writer, or to all the readers before it */
+static void rwlock_grant(RWLock* rw, uint32_t* notify)
+{
+	unsigned int state = 0;
+	__wq_waiter* w = rw->waitset;
+	if(w->want == RW_WRITER) {
+		wq_grant(&rw->waitset, w, RW_WRITER, notify);
+		state = RW_WRITER;
+	} else {
+		while((w = rw->waitset) != NULL && w->want == RW_READER) {
+			wq_grant(&rw->waitset, w, RW_READER, notify);
+			state++;
+		}
+	}
+	if(rw->waitset) state |= RW_WAITERS;
+	__atomic_store_n(&rw->state, state, __ATOMIC_RELEASE);
+}
+
+/* Take the lock, or sleep until it is handed over to us */
+static void rwlock_lock_contended(RWLock* rw, unsigned int want)
+{
+	int preempt = preempt_off;
+	spin_lock(&rw->waitset_lock);
+
+	unsigned int state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	while(1) {
+		int free = (want == RW_WRITER) ? (state == 0) : !(state & (RW_WRITER|RW_WAITERS));
+		unsigned int newstate = free ? (want == RW_WRITER ? RW_WRITER : state+1) : (state | RW_WAITERS);
+		if(__atomic_compare_exchange_n(&rw->state, &state, newstate, 
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			if(! free) {
+				__wq_waiter waiter = { .want = want };
+				wq_wait(&rw->waitset, &rw->waitset_lock, &waiter, SCHED_MUTEX, NO_TIMEOUT);
+			}
+			break;
+		}
+	}
+
+	spin_unlock(&rw->waitset_lock);
+	if(preempt) preempt_on;
+}
+
+/* Release the lock, handing it over to the waiters if we were the last holder */
+static void rwlock_unlock_contended(RWLock* rw, unsigned int held)
+{
+	uint32_t notify = 0;
+	int preempt = preempt_off;
+	spin_lock(&rw->waitset_lock);
+
+	unsigned int state = __atomic_fetch_sub(&rw->state, held, __ATOMIC_RELEASE) - held;
+	if((state & (RW_WRITER|RW_READERS)) == 0)
+		rwlock_grant(rw, &notify);
+
+	spin_unlock(&rw->waitset_lock);
+	wq_notify(notify);
+	if(preempt) preempt_on;
+}
+
+void RWLock_ReadLock(RWLock* rw)
+{
+	unsigned int state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	while(!(state & (RW_WRITER|RW_WAITERS)))
+		if(__atomic_compare_exchange_n(&rw->state, &state, state+1, 
+				1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+	rwlock_lock_contended(rw, RW_READER);
+}
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+	/* The last reader hands the lock over to the waiters */
+	unsigned int state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	while(!((state & RW_WAITERS) && (state & RW_READERS) == 1))
+		if(__atomic_compare_exchange_n(&rw->state, &state, state-1, 
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	rwlock_unlock_contended(rw, RW_READER);
+}
+
+void RWLock_WriteLock(RWLock* rw)
+{
+	unsigned int expected = 0;
+	if(! __atomic_compare_exchange_n(&rw->state, &expected, RW_WRITER, 
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		rwlock_lock_contended(rw, RW_WRITER);
+}
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+	unsigned int expected = RW_WRITER;
+	if(! __atomic_compare_exchange_n(&rw->state, &expected, 0, 
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		rwlock_unlock_contended(rw, RW_WRITER);
+}
+
+
+/*
+	Semaphores.
+	-----------
+
+	The value is -1 when it is 0 and the queue is not empty. A post hands the 
+	unit over to the first waiter, without increasing the value.
+ */
+
+static inline int sem_trywait(Semaphore* sem)
+{
+	int value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+	while(value > 0)
+		if(__atomic_compare_exchange_n(&sem->value, &value, value-1, 
+				1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
+
+static int sem_wait(Semaphore* sem, TimerDuration deadline)
+{
+	if(sem_trywait(sem)) return 1;
+	if(deadline != NO_TIMEOUT && bios_clock() >= deadline) return 0;
+
+	int ret = 1;
+	int preempt = preempt_off;
+	spin_lock(&sem->waitset_lock);
+
+	int value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+	while(1) {
+		int newvalue = (value > 0) ? value-1 : -1;
+		if(value == newvalue || __atomic_compare_exchange_n(&sem->value, &value, newvalue, 
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			if(newvalue < 0) {
+				__wq_waiter waiter = { .want = 1 };
+				ret = wq_wait(&sem->waitset, &sem->waitset_lock, &waiter, SCHED_USER, deadline);
+
+				/* If the last waiter timed out, the value is still -1 */
+				if(! ret && sem->waitset == NULL)
+					__atomic_store_n(&sem->value, 0, __ATOMIC_RELAXED);
+			}
+			break;
+		}
+	}
+
+	spin_unlock(&sem->waitset_lock);
+	if(preempt) preempt_on;
+	return ret;
+}
+
+void Sem_Wait(Semaphore* sem)
+{
+	sem_wait(sem, NO_TIMEOUT);
+}
+
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout)
+{
+	return sem_wait(sem, wq_deadline(timeout));
+}
+
+void Sem_Post(Semaphore* sem)
+{
+	int value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+	while(value >= 0)
+		if(__atomic_compare_exchange_n(&sem->value, &value, value+1, 
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+	uint32_t notify = 0;
+	int preempt = preempt_off;
+	spin_lock(&sem->waitset_lock);
+
+	/* The waiters may have timed out meanwhile */
+	value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+	while(value >= 0)
+		if(__atomic_compare_exchange_n(&sem->value, &value, value+1, 
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			break;
+	if(value < 0) {
+		wq_grant(&sem->waitset, sem->waitset, 1, &notify);
+		if(sem->waitset == NULL)
+			__atomic_store_n(&sem->value, 0, __ATOMIC_RELEASE);
+	}
+
+	spin_unlock(&sem->waitset_lock);
+	wq_notify(notify);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Event flags.
+	------------
+
+	Waiting and clearing only change the flags by atomic operations, so they 
+	do not need the spinlock unless the caller has to wait. Setting flags 
+	locks the spinlock, and grants the flags to the waiters, in FIFO order.
+ */
+
+/* Return the flags of 'mask' that satisfy a wait, or 0 */
+static inline unsigned int event_check(unsigned int flags, unsigned int mask, int mode)
+{
+	unsigned int got = flags & mask;
+	if((mode & EVENT_ALL) && got != mask) return 0;
+	return got;
+}
+
+/* Consume the flags that satisfy a wait, and return them (or 0) */
+static inline unsigned int event_take(EventFlags* ev, unsigned int mask, int mode)
+{
+	unsigned int flags = __atomic_load_n(&ev->flags, __ATOMIC_ACQUIRE);
+	while(1) {
+		unsigned int got = event_check(flags, mask, mode);
+		if(got == 0 || !(mode & EVENT_CLEAR))
+			return got;
+		if(__atomic_compare_exchange_n(&ev->flags, &flags, flags & ~got, 
+				1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return got;
+	}
+}
+
+unsigned int Event_Wait(EventFlags* ev, unsigned int mask, int mode, timeout_t timeout)
+{
+	unsigned int got = event_take(ev, mask, mode);
+	if(got || mask == 0 || timeout == 0) return got;
+
+	TimerDuration deadline = wq_deadline(timeout);
+	int preempt = preempt_off;
+	spin_lock(&ev->waitset_lock);
+
+	/* Flags are only set with the spinlock locked */
+	got = event_take(ev, mask, mode);
+	if(got == 0) {
+		__wq_waiter waiter = { .want = mask, .mode = mode };
+		if(wq_wait(&ev->waitset, &ev->waitset_lock, &waiter, SCHED_USER, deadline))
+			got = waiter.got;
+	}
+
+	spin_unlock(&ev->waitset_lock);
+	if(preempt) preempt_on;
+	return got;
+}
+
+unsigned int Event_Set(EventFlags* ev, unsigned int mask)
+{
+	uint32_t notify = 0;
+	int preempt = preempt_off;
+	spin_lock(&ev->waitset_lock);
+
+	unsigned int old = __atomic_fetch_or(&ev->flags, mask, __ATOMIC_ACQ_REL);
+
+	/* Grant the flags in FIFO order, since some waiters may consume them */
+	__wq_waiter* w = ev->waitset;
+	__wq_waiter* last = w ? w->node.prev->obj : NULL;
+	while(w) {
+		__wq_waiter* next = (w == last) ? NULL : w->node.next->obj;
+		unsigned int got = event_take(ev, w->want, w->mode);
+		if(got)
+			wq_grant(&ev->waitset, w, got, &notify);
+		w = next;
+	}
+
+	spin_unlock(&ev->waitset_lock);
+	wq_notify(notify);
+	if(preempt) preempt_on;
+	return old;
+}
+
+unsigned int Event_Clear(EventFlags* ev, unsigned int mask)
+{
+	return __atomic_fetch_and(&ev->flags, ~mask, __ATOMIC_ACQ_REL);
 }
 
 
@@ -222,8 +1404,8 @@ void Cond_Broadcast(CondVar* cv)
  * 
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+/* This spinlock is used to implement the kernel semaphore as a monitor. */
+static Spinlock kernel_mutex = SPINLOCK_INIT;
 
 /* Semaphore counter */
 static int kernel_sem = 1;
@@ -231,39 +1413,141 @@ static int kernel_sem = 1;
 /* Semaphore condition */
 static CondVar kernel_sem_cv = COND_INIT;
 
-void kernel_lock()
+/* Wait for the semaphore, with kernel_mutex held. Return the number of waits. */
+static inline unsigned long kernel_sem_down()
 {
-	Mutex_Lock(& kernel_mutex);
+	unsigned long waits = 0;
 	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+		cv_wait(NULL, & kernel_mutex, &kernel_sem_cv, SCHED_USER, NO_TIMEOUT);
+		waits++;
 	}
 	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+	return waits;
 }
 
-void kernel_unlock()
+#ifdef LOCK_PROFILING
+
+/* The site of the holder of the kernel semaphore, and the time it was taken */
+static lock_site* kernel_site = NULL;
+static unsigned long kernel_since;
+
+/* Release the semaphore, with kernel_mutex held */
+static inline void kernel_sem_up()
+{
+	lock_site* site = kernel_site;
+	if(site) {
+		kernel_site = NULL;
+		lock_profile_released(site, bios_clock_ns() - kernel_since);
+	}
+	kernel_sem++;
+	Cond_Signal(&kernel_sem_cv);
+}
+
+/* Take the semaphore for a site, with kernel_mutex held */
+static void kernel_sem_down_at(const char* name, unsigned long t0)
+{
+	lock_wait w = { 0, kernel_sem_down() };
+	unsigned long now = bios_clock_ns();
+	lock_site* site = lock_site_get(name);
+	lock_profile_acquired(site, w.yields ? &w : NULL, now - t0);
+	kernel_site = site;
+	kernel_since = now;
+}
+
+void kernel_lock_at(const char* name)
+{
+	unsigned long t0 = bios_clock_ns();
+	spin_lock(& kernel_mutex);
+	kernel_sem_down_at(name, t0);
+	spin_unlock(& kernel_mutex);
+}
+
+void kernel_lock()
+{
+	kernel_lock_at("kernel");
+}
+
+/* The name of the site of the holder, to take the lock again after a wait */
+#define KERNEL_SITE_SAVE  const char* site_name = kernel_site ? kernel_site->name : "kernel"
+#define KERNEL_SEM_DOWN   kernel_sem_down_at(site_name, bios_clock_ns())
+#define KERNEL_RELOCK     kernel_lock_at(site_name)
+
+#else
+
+static inline void kernel_sem_up()
 {
-	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+void kernel_lock()
+{
+	spin_lock(& kernel_mutex);
+	kernel_sem_down();
+	spin_unlock(& kernel_mutex);
+}
+
+#define KERNEL_SITE_SAVE
+#define KERNEL_SEM_DOWN   kernel_sem_down()
+#define KERNEL_RELOCK     kernel_lock()
+
+#endif
+
+void kernel_unlock()
+{
+	spin_lock(& kernel_mutex);
+	kernel_sem_up();
+	spin_unlock(& kernel_mutex);
+}
+
+#ifdef FINE_GRAINED_LOCKING
+
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, NULL, cv, cause, timeout);
+}
+
+#else
+
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
+	KERNEL_SITE_SAVE;
+
 	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+	spin_lock(& kernel_mutex);
+	kernel_sem_up();
+	int ret = cv_wait(NULL, &kernel_mutex, cv, cause, timeout);
 
 	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);	
+	KERNEL_SEM_DOWN;
+	spin_unlock(& kernel_mutex);	
+
+	return ret;
+}
 
+#endif
+
+int kernel_spin_wait(Spinlock* mx, CondVar* cv, int* flag, enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+#ifndef FINE_GRAINED_LOCKING
+	KERNEL_SITE_SAVE;
+	kernel_unlock();
+#endif
+
+	int pre = preempt_off;
+	spin_lock(mx);
+	if(! *flag)
+		cv_wait(NULL, mx, cv, cause, timeout);
+	int ret = *flag;
+	*flag = 0;
+	spin_unlock(mx);
+	if(pre) preempt_on;
+
+#ifndef FINE_GRAINED_LOCKING
+	KERNEL_RELOCK;
+#endif
 	return ret;
 }
 
@@ -279,12 +1563,11 @@ void kernel_broadcast(CondVar* cv)
 
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
+#ifdef FINE_GRAINED_LOCKING
+	sleep_releasing(newstate, NULL, cause, NO_TIMEOUT);
+#else
+	spin_lock(& kernel_mutex);
+	kernel_sem_up();
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+#endif
 }
-
-
-
-
@@ -32,6 +32,43 @@
 
 
 
+/**
+	@brief Lock a spinlock.
+
+	Spinlocks are used for short critical sections inside the kernel, 
+	mainly in the scheduler, where the caller cannot sleep. In the 
+	non-preemptive domain this is a pure spinlock; in the preemptive 
+	domain, the caller yields after spinning for a while.
+
+	A spinlock that may be locked with preemption off must always be locked
+	with preemption off.
+
+	@see Spinlock
+  */
+void spin_lock(Spinlock* lock);
+
+/**
+	@brief Lock a spinlock only if it is free.
+
+	@returns 1 if the spinlock was locked, 0 otherwise
+  */
+int spin_trylock(Spinlock* lock);
+
+/**
+	@brief Unlock a spinlock.
+  */
+void spin_unlock(Spinlock* lock);
+
+/** @brief The name of the spinlock implementation, for reports */
+#if defined(SPINLOCK_MCS)
+#define SPINLOCK_NAME "mcs"
+#elif defined(SPINLOCK_TICKET)
+#define SPINLOCK_NAME "ticket"
+#else
+#define SPINLOCK_NAME "tas"
+#endif
+
+
 /*
  * Kernel preemption control.
  * These are wrappers for the kernel monitor.
@@ -47,17 +84,112 @@ void kernel_lock();
  */
 void kernel_unlock();
 
+
+#ifdef LOCK_PROFILING
+
+/**
+	@brief Lock the kernel, for a site of the lock profile.
+
+	This is called by the system calls, with the name of the call as the site.
+	Plain @c kernel_lock calls count under the site "kernel".
+	@see OpenLockInfo
+ */
+void kernel_lock_at(const char* site);
+
+/**
+	@brief Clear the lock profile.
+
+	This is called before the VM boots.
+ */
+void lock_profile_reset();
+
+/**
+	@brief Print the lock profile to stderr, sorted by the total hold time.
+
+	This is called after the VM stops.
+ */
+void lock_profile_print();
+
+#endif
+
+
+/*
+ * Fine-grained kernel locking.
+ *
+ * By default, every system call runs inside the kernel monitor (the big kernel
+ * semaphore). When the kernel is built with FINE_GRAINED_LOCKING (make FINE_LOCKING=1),
+ * system calls do not take the kernel semaphore; instead, each kernel structure is
+ * protected by its own mutex:
+ *
+ *   - PT_mutex:        the process table, the PCB free list and the thread lists
+ *   - PORT_MAP_mutex:  the port map
+ *   - scb->mutex:      a socket control block
+ *   - FT_mutex:        the file table, the FCB free list and the FIDT of every process
+ *   - pipe->mutex:     a pipe control block
+ *
+ * Locks must be taken in the above order, and a thread must not hold more than
+ * one lock when it waits. FT_mutex and pipe mutexes are never held together.
+ * The mutex of a listening socket may be held while locking a connecting socket.
+ * Splice and Tee hold two pipe mutexes together, locking them in address order.
+ *
+ * The spinlocks of poll queues and poll tables (see kernel_streams.h) are locked in
+ * every build, inside any of the above, and a poll queue lock before a poll table lock.
+ */
+
+/**
+	@brief Lock a kernel object mutex.
+
+	In the default build this is a no-op, as the kernel monitor already protects
+	every kernel object.
+  */
+#ifdef FINE_GRAINED_LOCKING
+#define kernel_lock_obj(mx)  Mutex_Lock(mx)
+#else
+#define kernel_lock_obj(mx)  ((void)(mx))
+#endif
+
+/**
+	@brief Unlock a kernel object mutex.
+	@see kernel_lock_obj
+  */
+#ifdef FINE_GRAINED_LOCKING
+#define kernel_unlock_obj(mx)  Mutex_Unlock(mx)
+#else
+#define kernel_unlock_obj(mx)  ((void)(mx))
+#endif
+
+
 /**
 	@brief Wait on a condition variable using the kernel lock.
+
+	The caller must hold @c mx, the mutex of the kernel object that @c cv
+	belongs to (see @ref kernel_lock_obj). In the default build, @c mx is ignored
+	and the kernel monitor is released during the wait.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
+
+/**
+	@brief Wait until a flag is set, possibly outside the kernel lock.
+
+	The flag is protected by @c mx, a spinlock that is locked with preemption
+	off in every build, because the flag may be set by an interrupt handler.
+	The waker sets @c *flag and signals @c cv while holding @c mx. The caller
+	must not hold @c mx. Unless the flag is already set, the caller sleeps
+	until @c cv is signalled or the timeout expires, and then the flag is
+	cleared. In the default build, the kernel monitor is released for the whole
+	call, as it must not be acquired with preemption off.
+
+	@returns 1 if the flag was set, 0 if not
+  */
+int kernel_spin_wait(Spinlock* mx, CondVar* cv, int* flag, enum SCHED_CAUSE cause, TimerDuration timeout);
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -76,7 +208,8 @@ void kernel_broadcast(CondVar* cv);
 	@brief Put thread to sleep, unlocking the kernel.
 
 	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	as the kernel lock is not a mutex. With FINE_GRAINED_LOCKING, the caller
+	must not hold any kernel object mutex.
   */
 void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
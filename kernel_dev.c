@@ -37,6 +37,23 @@ int nulldev_write(void* dev, const char* buf, unsigned int size)
 }
 
 
+int nulldev_readv(void* dev, const iovec_t* iov, unsigned int iovcnt)
+{
+  unsigned int count = 0;
+  for(unsigned int i=0; i<iovcnt; i++)
+    count += nulldev_read(dev, iov[i].buf, iov[i].size);
+  return count;
+}
+
+int nulldev_writev(void* dev, const iovec_t* iov, unsigned int iovcnt)
+{
+  unsigned int count = 0;
+  for(unsigned int i=0; i<iovcnt; i++)
+    count += iov[i].size;
+  return count;
+}
+
+
 int nulldev_close(void* dev) 
 {
   return 0;
@@ -51,7 +68,9 @@ static file_ops nulldev_fops = {
   .Open = nulldev_open,
   .Read = nulldev_read,
   .Write = nulldev_write,
-  .Close = nulldev_close
+  .Close = nulldev_close,
+  .ReadV = nulldev_readv,
+  .WriteV = nulldev_writev
 };
 
 
@@ -70,6 +89,7 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  poll_queue pollq;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -90,40 +110,61 @@ void serial_rx_handler()
    */
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
+    kernel_lock_obj(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    kernel_unlock_obj(&dcb->spinlock);
+    poll_wakeup(&dcb->pollq);
   }
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Read from the device into the segments of iov, sleeping if needed.
  */
-int serial_read(void* dev, char *buf, unsigned int size)
+int serial_readv(void* dev, const iovec_t* iov, unsigned int iovcnt)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  kernel_lock_obj(&dcb->spinlock);
 
   uint count =  0;
+  uint seg = 0, pos = 0;  /* The next byte goes to iov[seg].buf[pos] */
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
+  while(seg < iovcnt) {
+    if(pos == iov[seg].size) {
+      seg++; pos = 0;
+      continue;
+    }
+
+    /* Read as much of the segment as the device has */
+    uint valid = bios_read_serial_buf(dcb->devno, &iov[seg].buf[pos], iov[seg].size - pos);
     
     if (valid) {
-      count++;
+      count += valid; pos += valid;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  kernel_unlock_obj(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
 }
 
+/*
+  Read from the device, sleeping if needed.
+ */
+int serial_read(void* dev, char *buf, unsigned int size)
+{
+  iovec_t iov = { buf, size };
+  return serial_readv(dev, &iov, 1);
+}
+
 
 /*
   A polling driver for serial writes
@@ -132,23 +173,33 @@ int serial_read(void* dev, char *buf, unsigned int size)
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  /* Writers poll the device, but Poll callers may be waiting */
+  for(int i=0;i<bios_serial_ports();i++)
+    poll_wakeup(&serial_dcb[i].pollq);
 }
 
 /* 
-  Write call 
+  Write call, from the segments of iov
   This is currently a polling driver.
 */
-int serial_write(void* dev, const char* buf, unsigned int size)
+int serial_writev(void* dev, const iovec_t* iov, unsigned int iovcnt)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
+  uint seg = 0, pos = 0;  /* The next byte is iov[seg].buf[pos] */
+
+  while(seg < iovcnt) {
+    if(pos == iov[seg].size) {
+      seg++; pos = 0;
+      continue;
+    }
+
+    /* Write as much of the segment as the device takes */
+    uint success = bios_write_serial_buf(dcb->devno, &iov[seg].buf[pos], iov[seg].size - pos);
 
     if(success) {
-      count++;
+      count += success; pos += success;
     } 
     else if(count==0)
     {
@@ -161,6 +212,30 @@ int serial_write(void* dev, const char* buf, unsigned int size)
   return count;  
 }
 
+/* 
+  Write call 
+*/
+int serial_write(void* dev, const char* buf, unsigned int size)
+{
+  iovec_t iov = { (char*) buf, size };
+  return serial_writev(dev, &iov, 1);
+}
+
+
+/*
+  Poll call
+  The device is checked after the poll table is queued, so an interrupt
+  that comes after the check will find it.
+*/
+int serial_poll(void* dev, poll_table* pt)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  poll_wait(pt, &dcb->pollq);
+  return (bios_serial_ready(dcb->devno, 0) ? POLL_READ : 0)
+       | (bios_serial_ready(dcb->devno, 1) ? POLL_WRITE : 0);
+}
+
 
 int serial_close(void* dev) 
 {
@@ -180,7 +255,10 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .ReadV = serial_readv,
+  .WriteV = serial_writev,
+  .Poll = serial_poll
 };
 
 
@@ -211,6 +289,7 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    poll_queue_init(&serial_dcb[i].pollq);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -33,6 +34,9 @@
   @{ 
 */
 
+/* See kernel_streams.h */
+struct poll_table;
+
 
 /**
   @brief The device-specific file operations table.
@@ -92,6 +96,55 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Pipe size operation (optional).
+
+      Resize the buffer of a pipe-like stream to at least 'size' bytes, or
+      only report its capacity if 'size' is 0. This function returns the
+      capacity of the stream, or -1 on error. Streams without a buffer
+      leave it NULL.
+
+    Possible errors are:
+    - The requested size is illegal, or too small for the buffered data.
+     */
+    int (*PipeSize)(void* this, unsigned int size);
+
+    /** @brief Pipe access operation (optional).
+
+      Return the pipe that the Read operation (if 'write' is 0) or the Write
+      operation (if 'write' is 1) of stream 'this' works on, or NULL if there is
+      none. This is used by @c Splice and @c Tee, to copy data directly between
+      pipe buffers. Streams without a buffer leave it NULL.
+     */
+    struct pipe_control_block* (*Pipe)(void* this, int write);
+
+    /** @brief Scatter read operation (optional).
+
+      Like Read, but the bytes are stored into the 'iovcnt' segments of 'iov',
+      in order, filling each one before the next. The total size of the
+      segments fits in an int. Streams that leave it NULL are read with one
+      Read call per segment, stopping at the first short read.
+     */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+    /** @brief Gather write operation (optional).
+
+      Like Write, but the bytes are taken from the 'iovcnt' segments of 'iov',
+      in order. Streams that leave it NULL are written with one Write call per
+      segment, stopping at the first short write.
+     */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+    /** @brief Poll operation (optional).
+
+      Return the events (@c POLL_READ, @c POLL_WRITE, @c POLL_HANGUP) that
+      stream 'this' is ready for. Before checking its state, the stream must
+      add 'pt' to its poll queue by calling @c poll_wait, and every change that
+      may make it ready must wake up this queue. Streams that leave it NULL are
+      always ready.
+      @see poll_wait
+     */
+    int (*Poll)(void* this, struct poll_table* pt);
 } file_ops;
 
 
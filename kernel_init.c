@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -54,7 +55,8 @@ void boot_tinyos_kernel()
   run_scheduler();
 
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* Cleanup after the scheduler has ended. */
+    finalize_scheduler();
   }
 }
 
@@ -65,7 +67,13 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+#ifdef LOCK_PROFILING
+  lock_profile_reset();
+#endif
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+#ifdef LOCK_PROFILING
+  lock_profile_print();
+#endif
 }
 
 
@@ -4,22 +4,66 @@
 #include "kernel_sched.h"
 #include "kernel_cc.h"
 
+/*
+	The positions are free-running counters: they are masked only to index the
+	buffer, so their difference is the amount of unread bytes even when the 
+	buffer is full.
+ */
+
+/*The amount of unread bytes in the pipe*/
+static inline unsigned int pipe_count(PIPE_CB* pipe) {
+	return pipe->w_position - pipe->r_position;
+}
+
+/*The amount of bytes that can be written without corrupting unread data*/
+static inline unsigned int pipe_space(PIPE_CB* pipe) {
+	return pipe->capacity - pipe_count(pipe);
+}
+
+/*Copy n bytes into the buffer at the write position, in at most two segments if we wrap around*/
+static void pipe_copy_in(PIPE_CB* pipe, const char* buf, unsigned int n) {
+	unsigned int pos = pipe->w_position & (pipe->capacity - 1);
+	unsigned int first = pipe->capacity - pos;
+	if (first > n) first = n;
+	memcpy(&pipe->BUFFER[pos], buf, first);
+	memcpy(pipe->BUFFER, buf + first, n - first);
+}
+
+/*Copy n bytes out of the buffer from the read position, in at most two segments if we wrap around*/
+static void pipe_copy_out(PIPE_CB* pipe, char* buf, unsigned int n) {
+	unsigned int pos = pipe->r_position & (pipe->capacity - 1);
+	unsigned int first = pipe->capacity - pos;
+	if (first > n) first = n;
+	memcpy(buf, &pipe->BUFFER[pos], first);
+	memcpy(buf + first, pipe->BUFFER, n - first);
+}
+
+/*Wake up the threads polling the read end, unless it is closed*/
+static void pipe_wakeup_reader(PIPE_CB* pipe) {
+	if (pipe->reader != NULL)
+		poll_wakeup(pipe->reader_pollq);
+}
+
+/*Wake up the threads polling the write end, unless it is closed*/
+static void pipe_wakeup_writer(PIPE_CB* pipe) {
+	if (pipe->writer != NULL)
+		poll_wakeup(pipe->writer_pollq);
+}
+
+/*Free a pipe that both ends have closed*/
+static void pipe_free(PIPE_CB* pipe) {
+	free(pipe->BUFFER);
+	free(pipe);
+}
+
 /*Checks if the pipe is able to write*/
 int can_write(PIPE_CB* pipe) {
-	/** if writer has come full circle behind the reader ->
-	 *  can't read anymore without corrupting unread data
-	 */
-	if (pipe->r_position == (pipe->w_position + 1) % PIPE_BUFFER_SIZE) return 0;
-	return 1;
+	return pipe_space(pipe) > 0;
 }
 
 /*Checks if the pipe is able to read*/
 int can_read(PIPE_CB* pipe) {
-	/** if reader is in same position as writer
-	 *  means there is no data to read
-	 */
-	if (pipe->r_position == pipe->w_position) return 0;
-	return 1;
+	return pipe_count(pipe) > 0;
 }
 
 void* false_open_pipe (uint minor) {
@@ -34,70 +78,131 @@ int false_write (void* pipecb, const char *buf, unsigned int n) {
 	return -1;
 }
 
-int pipe_write(void* pipecb, const char *buf, unsigned int n) {
+/*The total size of the segments of iov*/
+static unsigned int iovec_size(const iovec_t* iov, unsigned int iovcnt) {
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < iovcnt; i++)
+		n += iov[i].size;
+	return n;
+}
+
+/*Copy n bytes from the segments of iov into the buffer, advancing the write position*/
+static void pipe_gather(PIPE_CB* pipe, const iovec_t* iov, unsigned int n) {
+	for (; n > 0; iov++) {
+		unsigned int len = (iov->size < n) ? iov->size : n;
+		pipe_copy_in(pipe, iov->buf, len);
+		pipe->w_position += len;
+		n -= len;
+	}
+}
+
+/*Copy n bytes out of the buffer into the segments of iov, advancing the read position*/
+static void pipe_scatter(PIPE_CB* pipe, const iovec_t* iov, unsigned int n) {
+	for (; n > 0; iov++) {
+		unsigned int len = (iov->size < n) ? iov->size : n;
+		pipe_copy_out(pipe, iov->buf, len);
+		pipe->r_position += len;
+		n -= len;
+	}
+}
+
+int pipe_writev(void* pipecb, const iovec_t* iov, unsigned int iovcnt) {
 	if (!pipecb) return -1;
 
 	PIPE_CB* pipe = (PIPE_CB*) pipecb;
-	if (pipe->reader == NULL || pipe->writer == NULL) return -1;
+	unsigned int n = iovec_size(iov, iovcnt);
+	kernel_lock_obj(&pipe->mutex);
+	if (pipe->reader == NULL || pipe->writer == NULL) {
+		kernel_unlock_obj(&pipe->mutex);
+		return -1;
+	}
 
 	//Wait for space to write
-	while (!can_write(pipe) && pipe->reader != NULL) {
-		//Broadcast we are full
-		kernel_broadcast(&pipe->has_data);
-		kernel_wait(&pipe->has_space, SCHED_PIPE);
-	}
+	while (!can_write(pipe) && pipe->reader != NULL)
+		kernel_wait(&pipe->mutex, &pipe->has_space, SCHED_PIPE);
 
 	//copy data to BUFFER
-	int chars_written;
-	for (chars_written = 0; chars_written < n && can_write(pipe); chars_written++) {
-		pipe->BUFFER[pipe->w_position] = buf[chars_written];
-		pipe->w_position = (pipe->w_position + 1) % PIPE_BUFFER_SIZE;
+	int was_empty = (pipe_count(pipe) == 0);
+	unsigned int chars_written = pipe_space(pipe);
+	if (chars_written > n) chars_written = n;
+
+	pipe_gather(pipe, iov, chars_written);
+
+	/*
+	  Readers only sleep on an empty pipe, so only the empty -> non-empty
+	  transition needs to wake one. If space is left over, pass the baton
+	  to the next waiting writer (it was only woken by one reader).
+	*/
+	if (was_empty && chars_written > 0) {
+		kernel_signal(&pipe->has_data);
+		pipe_wakeup_reader(pipe);
 	}
-	
-	//GET MY DATA
-	kernel_broadcast(&pipe->has_data);
+	if (can_write(pipe))
+		kernel_signal(&pipe->has_space);
+	kernel_unlock_obj(&pipe->mutex);
 	return chars_written;
 }
 
-int pipe_read(void* pipecb, char *buf, unsigned int n) {
+int pipe_readv(void* pipecb, const iovec_t* iov, unsigned int iovcnt) {
 	if (!pipecb) return -1;
 	PIPE_CB* pipe = (PIPE_CB*) pipecb;
+	unsigned int n = iovec_size(iov, iovcnt);
+	kernel_lock_obj(&pipe->mutex);
 	//We don't really need the writer to read
-	if (pipe->reader == NULL) return -1;
+	if (pipe->reader == NULL) {
+		kernel_unlock_obj(&pipe->mutex);
+		return -1;
+	}
 
 	//Wait for data to read
-	while (!can_read(pipe) && pipe->writer != NULL) {
-		//Broadcast we are empty
-		kernel_broadcast(&pipe->has_space);
-		kernel_wait(&pipe->has_data, SCHED_PIPE);
-	}
+	while (!can_read(pipe) && pipe->writer != NULL)
+		kernel_wait(&pipe->mutex, &pipe->has_data, SCHED_PIPE);
 
 	//Get data from buf
-	int chars_read;
-	for (chars_read = 0; chars_read < n && can_read(pipe); chars_read++) {
-		buf[chars_read] = pipe->BUFFER[pipe->r_position];
-		pipe->r_position = (pipe->r_position + 1) % PIPE_BUFFER_SIZE;
-	}
+	int was_full = (pipe_space(pipe) == 0);
+	unsigned int chars_read = pipe_count(pipe);
+	if (chars_read > n) chars_read = n;
 
-	//GIVE ME MORE DATA
-	kernel_broadcast(&pipe->has_space);
+	pipe_scatter(pipe, iov, chars_read);
+
+	/* Symmetric to pipe_writev: wake one writer on full -> non-full. */
+	if (was_full && chars_read > 0) {
+		kernel_signal(&pipe->has_space);
+		pipe_wakeup_writer(pipe);
+	}
+	if (can_read(pipe))
+		kernel_signal(&pipe->has_data);
+	kernel_unlock_obj(&pipe->mutex);
 	return chars_read;
 }
 
+int pipe_write(void* pipecb, const char *buf, unsigned int n) {
+	iovec_t iov = { (char*) buf, n };
+	return pipe_writev(pipecb, &iov, 1);
+}
+
+int pipe_read(void* pipecb, char *buf, unsigned int n) {
+	iovec_t iov = { buf, n };
+	return pipe_readv(pipecb, &iov, 1);
+}
+
 int pipe_writer_close(void* pipecb) {
 	PIPE_CB* pipe = (PIPE_CB*) pipecb;
 
 	if (!pipe) return -1;
 
+	kernel_lock_obj(&pipe->mutex);
 	pipe->writer = NULL;
 	//If reader is also closed, we dont need the pipe
 	//Else we need the current data to leave the pipe
-	if (pipe->reader == NULL) {
-		free(pipe);
-		// pipe = NULL;
-	} else {
-		kernel_broadcast(&pipe->has_space);
+	int unused = (pipe->reader == NULL);
+	if (!unused) {
+		kernel_broadcast(&pipe->has_data);
+		pipe_wakeup_reader(pipe);
 	}
+	kernel_unlock_obj(&pipe->mutex);
+
+	if (unused) pipe_free(pipe);
 	return 0;
 }
 
@@ -106,24 +211,300 @@ int pipe_reader_close(void* pipecb) {
 
 	if (!pipe) return -1;
 
+	kernel_lock_obj(&pipe->mutex);
 	pipe->reader = NULL;
 	//If writer is also closed, we dont need the pipe
 	//Else we can still write
-	if (pipe->writer == NULL) {
-		free(pipe);
-		// pipe = NULL;
-	} else {
+	int unused = (pipe->writer == NULL);
+	if (!unused) {
 		kernel_broadcast(&pipe->has_space);
+		pipe_wakeup_writer(pipe);
 	}
+	kernel_unlock_obj(&pipe->mutex);
+
+	if (unused) pipe_free(pipe);
 	return 0;
 }
 
+/*Round a requested capacity up to a legal one. Returns 0 if the request is too large.*/
+unsigned int pipe_capacity(unsigned int size) {
+	if (size > PIPE_MAX_SIZE) return 0;
+
+	unsigned int capacity = PIPE_BUFFER_SIZE;
+	while (capacity < size) capacity <<= 1;
+	return capacity;
+}
+
+int pipe_resize(PIPE_CB* pipe, unsigned int size) {
+	if (!pipe) return -1;
+
+	if (size == 0) {
+		kernel_lock_obj(&pipe->mutex);
+		int capacity = pipe->capacity;
+		kernel_unlock_obj(&pipe->mutex);
+		return capacity;
+	}
+
+	unsigned int capacity = pipe_capacity(size);
+	if (capacity == 0) return -1;
+
+	//Allocate before locking, the pipe mutex may be a spinlock
+	char* buffer = xmalloc(capacity);
+
+	kernel_lock_obj(&pipe->mutex);
+	unsigned int count = pipe_count(pipe);
+	if (count > capacity) {
+		kernel_unlock_obj(&pipe->mutex);
+		free(buffer);
+		return -1;
+	}
+	int was_full = (pipe_space(pipe) == 0);
+
+	//Move the unread data to the start of the new buffer
+	pipe_copy_out(pipe, buffer, count);
+	char* old = pipe->BUFFER;
+	pipe->BUFFER = buffer;
+	pipe->capacity = capacity;
+	pipe->r_position = 0;
+	pipe->w_position = count;
+
+	/* As in pipe_readv: wake one writer on full -> non-full, it passes the signal on */
+	if (was_full && pipe_space(pipe) > 0) {
+		kernel_signal(&pipe->has_space);
+		pipe_wakeup_writer(pipe);
+	}
+	kernel_unlock_obj(&pipe->mutex);
+
+	free(old);
+	return capacity;
+}
+
+int pipe_size(void* pipecb, unsigned int size) {
+	return pipe_resize((PIPE_CB*) pipecb, size);
+}
+
+/*Copy n bytes from the read position of pipe in to the write position of pipe out*/
+static void pipe_copy_between(PIPE_CB* in, PIPE_CB* out, unsigned int n) {
+	unsigned int r = in->r_position, w = out->w_position;
+	while (n > 0) {
+		unsigned int rpos = r & (in->capacity - 1);
+		unsigned int wpos = w & (out->capacity - 1);
+		unsigned int len = n;
+		if (len > in->capacity - rpos) len = in->capacity - rpos;
+		if (len > out->capacity - wpos) len = out->capacity - wpos;
+		memcpy(&out->BUFFER[wpos], &in->BUFFER[rpos], len);
+		r += len;
+		w += len;
+		n -= len;
+	}
+}
+
+/*Lock two pipes in address order, so that two splices in opposite directions cannot deadlock*/
+static void pipe_lock_pair(PIPE_CB* a, PIPE_CB* b) {
+	if (a > b) { PIPE_CB* t = a; a = b; b = t; }
+	kernel_lock_obj(&a->mutex);
+	kernel_lock_obj(&b->mutex);
+}
+
+static void pipe_unlock_pair(PIPE_CB* a, PIPE_CB* b) {
+	kernel_unlock_obj(&a->mutex);
+	kernel_unlock_obj(&b->mutex);
+}
+
+/*
+  A thread that waited for a pipe may take less than it was woken up for,
+  or drop the lock and wait elsewhere. It must then pass the signal on to
+  the next waiter, which would otherwise keep sleeping on a ready pipe.
+*/
+static void pipe_pass_data(PIPE_CB* pipe) {
+	if (can_read(pipe))
+		kernel_signal(&pipe->has_data);
+}
+
+static void pipe_pass_space(PIPE_CB* pipe) {
+	if (can_write(pipe))
+		kernel_signal(&pipe->has_space);
+}
+
+/*Wait until there is data to read. Returns 1 if there is, 0 at end of data, -1 if the read end is closed.*/
+static int pipe_wait_data(PIPE_CB* pipe) {
+	while (!can_read(pipe) && pipe->writer != NULL && pipe->reader != NULL)
+		kernel_wait(&pipe->mutex, &pipe->has_data, SCHED_PIPE);
+	if (pipe->reader == NULL) return -1;
+	return can_read(pipe);
+}
+
+int pipe_splice(PIPE_CB* in, PIPE_CB* out, unsigned int n, int keep) {
+	if (!in || !out || in == out) return -1;
+	if (n == 0) return 0;
+
+	for (;;) {
+		/*
+		  Wait for data at the input and for space at the output, one pipe at a time,
+		  since a thread must not hold two locks while it waits.
+		*/
+		kernel_lock_obj(&in->mutex);
+		int status = pipe_wait_data(in);
+		pipe_pass_data(in);
+		kernel_unlock_obj(&in->mutex);
+		if (status <= 0) return status;
+
+		kernel_lock_obj(&out->mutex);
+		while (!can_write(out) && out->reader != NULL && out->writer != NULL)
+			kernel_wait(&out->mutex, &out->has_space, SCHED_PIPE);
+		pipe_pass_space(out);
+		kernel_unlock_obj(&out->mutex);
+
+		//Other threads may have used the pipes meanwhile, so check again
+		pipe_lock_pair(in, out);
+		if (in->reader == NULL || out->reader == NULL || out->writer == NULL) {
+			pipe_pass_data(in);
+			pipe_pass_space(out);
+			pipe_unlock_pair(in, out);
+			return -1;
+		}
+
+		int was_full = (pipe_space(in) == 0);
+		int was_empty = (pipe_count(out) == 0);
+		unsigned int count = pipe_count(in);
+		if (count > pipe_space(out)) count = pipe_space(out);
+		if (count > n) count = n;
+
+		if (count > 0) {
+			pipe_copy_between(in, out, count);
+			out->w_position += count;
+			if (was_empty) {
+				kernel_signal(&out->has_data);
+				pipe_wakeup_reader(out);
+			}
+			if (!keep) {
+				in->r_position += count;
+				if (was_full) {
+					kernel_signal(&in->has_space);
+					pipe_wakeup_writer(in);
+				}
+			}
+		}
+		//A Tee leaves the data for the readers of in
+		pipe_pass_data(in);
+		pipe_pass_space(out);
+		pipe_unlock_pair(in, out);
+
+		if (count > 0) return count;
+	}
+}
+
+int pipe_splice_to(PIPE_CB* in, void* dev, int (*devwrite)(void*, const char*, unsigned int), unsigned int n) {
+	if (!in || !devwrite) return -1;
+	if (n == 0) return 0;
+
+	kernel_lock_obj(&in->mutex);
+	int status = pipe_wait_data(in);
+	if (status <= 0) {
+		pipe_pass_data(in);
+		kernel_unlock_obj(&in->mutex);
+		return status;
+	}
+
+	//Write the first contiguous segment straight out of the buffer
+	int was_full = (pipe_space(in) == 0);
+	unsigned int pos = in->r_position & (in->capacity - 1);
+	unsigned int count = pipe_count(in);
+	if (count > in->capacity - pos) count = in->capacity - pos;
+	if (count > n) count = n;
+
+	int written = devwrite(dev, &in->BUFFER[pos], count);
+	if (written > 0) {
+		in->r_position += written;
+		if (was_full) {
+			kernel_signal(&in->has_space);
+			pipe_wakeup_writer(in);
+		}
+	}
+	pipe_pass_data(in);
+	kernel_unlock_obj(&in->mutex);
+	return written;
+}
+
+int pipe_splice_from(PIPE_CB* out, void* dev, int (*devread)(void*, char*, unsigned int), unsigned int n) {
+	if (!out || !devread) return -1;
+	if (n == 0) return 0;
+
+	//Do not take more data from the device than the pipe can hold now
+	kernel_lock_obj(&out->mutex);
+	while (!can_write(out) && out->reader != NULL && out->writer != NULL)
+		kernel_wait(&out->mutex, &out->has_space, SCHED_PIPE);
+	unsigned int space = (out->reader == NULL) ? 0 : pipe_space(out);
+	//The device read may sleep, so let the next writer use the space meanwhile
+	pipe_pass_space(out);
+	kernel_unlock_obj(&out->mutex);
+
+	if (space == 0) return -1;
+	if (n > space) n = space;
+	if (n > PIPE_SPLICE_CHUNK) n = PIPE_SPLICE_CHUNK;
+
+	/*
+	  The device may sleep while reading, and the pipe cannot be held meanwhile,
+	  so the data goes through a small kernel buffer.
+	*/
+	char chunk[PIPE_SPLICE_CHUNK];
+	int count = devread(dev, chunk, n);
+	if (count <= 0) return count;
+
+	for (int done = 0; done < count; ) {
+		int rc = pipe_write(out, chunk + done, count - done);
+		if (rc < 0) return -1;
+		done += rc;
+	}
+	return count;
+}
+
+int pipe_poll(PIPE_CB* pipe, int write) {
+	if (!pipe) return write ? POLL_WRITE : POLL_READ;
+
+	int events = 0;
+	kernel_lock_obj(&pipe->mutex);
+	if (write) {
+		if (pipe->reader == NULL) events = POLL_WRITE | POLL_HANGUP;
+		else if (can_write(pipe)) events = POLL_WRITE;
+	} else {
+		if (pipe->writer == NULL) events = POLL_READ | POLL_HANGUP;
+		else if (can_read(pipe)) events = POLL_READ;
+	}
+	kernel_unlock_obj(&pipe->mutex);
+	return events;
+}
+
+static int pipe_reader_poll(void* pipecb, poll_table* pt) {
+	PIPE_CB* pipe = (PIPE_CB*) pipecb;
+	poll_wait(pt, &pipe->pollq);
+	return pipe_poll(pipe, 0);
+}
+
+static int pipe_writer_poll(void* pipecb, poll_table* pt) {
+	PIPE_CB* pipe = (PIPE_CB*) pipecb;
+	poll_wait(pt, &pipe->pollq);
+	return pipe_poll(pipe, 1);
+}
+
+static PIPE_CB* pipe_reader_pipe(void* pipecb, int write) {
+	return write ? NULL : (PIPE_CB*) pipecb;
+}
+
+static PIPE_CB* pipe_writer_pipe(void* pipecb, int write) {
+	return write ? (PIPE_CB*) pipecb : NULL;
+}
+
 /*The calls a reader can make*/
 static file_ops reader_file_ops = {
 	.Open = false_open_pipe,
 	.Read = pipe_read,
 	.Write = false_write,
-	.Close = pipe_reader_close
+	.Close = pipe_reader_close,
+	.PipeSize = pipe_size,
+	.Pipe = pipe_reader_pipe,
+	.ReadV = pipe_readv,
+	.Poll = pipe_reader_poll
 };
 
 /*The calls a writer can make*/
@@ -131,18 +512,28 @@ static file_ops writer_file_ops = {
 	.Open = false_open_pipe,
 	.Read = false_read,
 	.Write = pipe_write,
-	.Close = pipe_writer_close
+	.Close = pipe_writer_close,
+	.PipeSize = pipe_size,
+	.Pipe = pipe_writer_pipe,
+	.WriteV = pipe_writev,
+	.Poll = pipe_writer_poll
 };
 
 /*Initialize and return a new pipe_cb*/
-PIPE_CB* init_pipe_cb() {
+PIPE_CB* init_pipe_cb(unsigned int capacity) {
 	PIPE_CB* pipe_cb = (PIPE_CB*) xmalloc(sizeof(PIPE_CB));
+	pipe_cb->capacity = capacity;
+	pipe_cb->BUFFER = (char*) xmalloc(capacity);
 	pipe_cb->reader = NULL;
 	pipe_cb->writer = NULL;
+	pipe_cb->mutex = MUTEX_INIT;
 	pipe_cb->has_space = COND_INIT;
 	pipe_cb->has_data = COND_INIT;
 	pipe_cb->w_position = 0;
 	pipe_cb->r_position = 0;
+	poll_queue_init(&pipe_cb->pollq);
+	pipe_cb->reader_pollq = &pipe_cb->pollq;
+	pipe_cb->writer_pollq = &pipe_cb->pollq;
 
 	return pipe_cb;
 }
@@ -156,7 +547,7 @@ int sys_Pipe(pipe_t* pipe)
 	pipe->read = fids[0];
 	pipe->write = fids[1];
 	
-	PIPE_CB* new_pipe_cb = init_pipe_cb();
+	PIPE_CB* new_pipe_cb = init_pipe_cb(PIPE_BUFFER_SIZE);
 
 	new_pipe_cb->reader = fcb[0];
 	new_pipe_cb->writer = fcb[1];
@@ -5,10 +5,16 @@
 
 
 /** 
- * 	@brief The amount of bytes the buffer can hold
+ * 	@brief The amount of bytes the buffer of a new pipe can hold
+ * 
+ * 	This is also the smallest capacity of a pipe. Capacities are powers of two,
+ * 	so that buffer positions wrap around with a mask.
  */
 #define PIPE_BUFFER_SIZE 4096
 
+_Static_assert((PIPE_BUFFER_SIZE & (PIPE_BUFFER_SIZE - 1)) == 0, "PIPE_BUFFER_SIZE must be a power of two");
+_Static_assert((PIPE_MAX_SIZE & (PIPE_MAX_SIZE - 1)) == 0, "PIPE_MAX_SIZE must be a power of two");
+
 
 /** @brief The pipe control block.
  * 
@@ -18,10 +24,15 @@
  */
 typedef struct pipe_control_block {
 	FCB *reader, *writer;				/**< @brief The FCBs used to read or write to the pipe. */
+	Mutex mutex;						/**< @brief Protects the pipe (only with FINE_GRAINED_LOCKING). */
 	CondVar has_space;    				/**< @brief CondVar used to block writer if no space is available. */
 	CondVar has_data;     				/**< @brief CondVar used to block reader until data are available. */
-	int w_position, r_position;  		/**< @brief Write and read positions in buffer. */
-	char BUFFER[PIPE_BUFFER_SIZE];   	/**< @brief A bounded (cyclic) byte buffer */
+	unsigned int w_position, r_position; /**< @brief Write and read positions in buffer. */
+	unsigned int capacity;				/**< @brief The size of the buffer, a power of two. */
+	char* BUFFER;   					/**< @brief A bounded (cyclic) byte buffer */
+	poll_queue pollq;					/**< @brief The poll queue of both ends of the pipe */
+	poll_queue* reader_pollq;			/**< @brief Woken up when the reader may read; @c pollq, or that of a socket */
+	poll_queue* writer_pollq;			/**< @brief Woken up when the writer may write; @c pollq, or that of a socket */
 } PIPE_CB;
 
 /**
@@ -34,6 +45,16 @@ int pipe_write(void* pipecb, const char *buf, unsigned int n);
  */
 int pipe_read(void* pipecb, char *buf, unsigned int n);
 
+/**
+ * @brief Like @c pipe_write, but the data are taken from the segments of @c iov
+ */
+int pipe_writev(void* pipecb, const iovec_t* iov, unsigned int iovcnt);
+
+/**
+ * @brief Like @c pipe_read, but the data are stored into the segments of @c iov
+ */
+int pipe_readv(void* pipecb, const iovec_t* iov, unsigned int iovcnt);
+
 /**
  * @brief Close the write end of a pipe
  */
@@ -45,8 +66,66 @@ int pipe_writer_close(void* _pipecb);
 int pipe_reader_close(void* _pipecb);
 
 /**
- * @brief Initialize and return a new PIPE_CB
+ * @brief Return the events that an end of a pipe is ready for
+ * 
+ * The events of the read end (or the write end, if @c write is nonzero) are
+ * returned. A NULL pipe is ready, since a transfer on it fails at once.
+ * @see Poll
+ */
+int pipe_poll(PIPE_CB* pipe, int write);
+
+/**
+ * @brief Initialize and return a new PIPE_CB with a buffer of @c capacity bytes
+ */
+PIPE_CB* init_pipe_cb(unsigned int capacity);
+
+/**
+ * @brief Round a requested pipe capacity up to a legal one
+ * 
+ * @returns the capacity, or 0 if @c size is larger than @c PIPE_MAX_SIZE
+ */
+unsigned int pipe_capacity(unsigned int size);
+
+/**
+ * @brief Resize the buffer of a pipe
+ * 
+ * If @c size is 0, the capacity of the pipe is returned unchanged.
+ * @returns the new capacity, or -1 if @c size is illegal or the pipe holds more than @c size bytes
+ * @see SetPipeSize
+ */
+int pipe_resize(PIPE_CB* pipe, unsigned int size);
+
+/**
+ * @brief The largest amount of data moved from a device to a pipe by one @c Splice
+ */
+#define PIPE_SPLICE_CHUNK 512
+
+/**
+ * @brief Move data from pipe @c in to pipe @c out
+ * 
+ * The data are copied directly between the two buffers. If @c keep is nonzero,
+ * they are not removed from @c in (see @c Tee).
+ * @returns the number of bytes moved, 0 at end of data, or -1 on error
+ * @see Splice
+ */
+int pipe_splice(PIPE_CB* in, PIPE_CB* out, unsigned int n, int keep);
+
+/**
+ * @brief Move data from pipe @c in to the device stream @c dev
+ * 
+ * The data are passed to @c devwrite straight from the pipe buffer. Since the
+ * pipe stays locked during the call, @c devwrite must not sleep.
+ * @returns the number of bytes moved, 0 at end of data, or -1 on error
+ */
+int pipe_splice_to(PIPE_CB* in, void* dev, int (*devwrite)(void*, const char*, unsigned int), unsigned int n);
+
+/**
+ * @brief Move data from the device stream @c dev to pipe @c out
+ * 
+ * At most as many bytes as @c out can hold (and at most @c PIPE_SPLICE_CHUNK)
+ * are read with @c devread and written to the pipe.
+ * @returns the number of bytes moved, 0 at end of data, or -1 on error
  */
-PIPE_CB* init_pipe_cb();
+int pipe_splice_from(PIPE_CB* out, void* dev, int (*devread)(void*, char*, unsigned int), unsigned int n);
 
 #endif
\ No newline at end of file
@@ -18,6 +18,7 @@
 /* The process table */
 PCB PT[MAX_PROC];
 unsigned int process_count;
+Mutex PT_mutex = MUTEX_INIT;
 
 PCB* get_pcb(Pid_t pid)
 {
@@ -139,15 +140,27 @@ void start_thread() {
   void* args = CURPTCB->args;
 
   exitval = call(argl, args);
-  sys_ThreadExit(exitval);
+  /* Go through the system call, the kernel lock is not held here */
+  ThreadExit(exitval);
 }
 
 /*
 	System call to create a new process.
  */
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecEx(call, argl, args, 0);
+}
+
+Pid_t sys_ExecEx(Task call, int argl, void* args, unsigned int stack_size)
 {
   PCB *curproc, *newproc;
+  TCB* main_thread = NULL;
+
+  size_t ssize = thread_stack_size(stack_size);
+  if(ssize == 0) return NOPROC;
+
+  kernel_lock_obj(&PT_mutex);
   
   /* The new process PCB */
   newproc = acquire_PCB();
@@ -169,11 +182,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    FIDT_inherit(newproc, curproc);
   }
 
 
@@ -195,7 +204,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    TCB* tcb = spawn_thread(newproc, start_main_thread);
+    TCB* tcb = spawn_thread(newproc, start_main_thread, ssize);
     PTCB* ptcb = init_ptcb(call, argl, args);
 
     tcb->ptcb = ptcb;
@@ -205,11 +214,14 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->thread_count = 1;
     
     newproc->main_thread = tcb;
-    wakeup(newproc->main_thread);
+    main_thread = tcb;
   }
 
 
 finish:
+  kernel_unlock_obj(&PT_mutex);
+  if(main_thread)
+    wakeup(main_thread);
   return get_pid(newproc);
 }
 
@@ -223,7 +235,10 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  kernel_lock_obj(&PT_mutex);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  kernel_unlock_obj(&PT_mutex);
+  return ppid;
 }
 
 
@@ -255,7 +270,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
   }
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&PT_mutex, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
 finish:
@@ -278,7 +293,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&PT_mutex, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -295,15 +310,20 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Pid_t retval;
+
+  kernel_lock_obj(&PT_mutex);
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    retval = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    retval = wait_for_any_child(status);
   }
+  kernel_unlock_obj(&PT_mutex);
 
+  return retval;
 }
 
 
@@ -332,11 +352,16 @@ int procinfo_read(void* __procinfo_cb, char* buf, unsigned int n) {
   procinfo_cb* procinfo = (procinfo_cb*) __procinfo_cb;
   if(!procinfo || procinfo->pcbcursor == MAX_PROC) return 0;
 
+  kernel_lock_obj(&PT_mutex);
+
   /*Find the next non-Free process*/
   PCB* pcb = &PT[procinfo->pcbcursor];
   while(pcb->pstate == FREE) {
     procinfo->pcbcursor++;
-    if (procinfo->pcbcursor == MAX_PROC) return 0;
+    if (procinfo->pcbcursor == MAX_PROC) {
+      kernel_unlock_obj(&PT_mutex);
+      return 0;
+    }
 
     pcb = &PT[procinfo->pcbcursor];
   }
@@ -354,6 +379,16 @@ int procinfo_read(void* __procinfo_cb, char* buf, unsigned int n) {
 
   procinfo->info.thread_count = pcb->thread_count;
   procinfo->info.main_task = pcb->main_task;
+
+  /* The threads that have not exited cannot release their stacks while we hold PT_mutex */
+  procinfo->info.stack_size = 0;
+  procinfo->info.stack_used = 0;
+  for(rlnode* n = pcb->ptcb_list.next; n != &pcb->ptcb_list; n = n->next) {
+    PTCB* ptcb = n->ptcb;
+    if(ptcb->exited || ptcb->tcb == NULL) continue;
+    procinfo->info.stack_size += ptcb->tcb->stack_size;
+    procinfo->info.stack_used += thread_stack_used(ptcb->tcb);
+  }
   
   procinfo->info.argl = pcb->argl;
 
@@ -364,6 +399,8 @@ int procinfo_read(void* __procinfo_cb, char* buf, unsigned int n) {
 
   procinfo->pcbcursor++;
 
+  kernel_unlock_obj(&PT_mutex);
+
   /*Copy the data from info to buf*/
   memcpy(buf, (char*) &procinfo->info, sizeof(procinfo->info));
   return sizeof(procinfo->info);
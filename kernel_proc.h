@@ -105,6 +105,17 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Protects the process table.
+
+  With FINE_GRAINED_LOCKING, this lock protects the PCBs (the process tree,
+  the exited lists and the thread lists), the PTCBs and the @c child_exit
+  and @c exit_cv condition variables. Without it, it is never locked.
+
+  @see kernel_lock_obj
+*/
+extern Mutex PT_mutex;
+
 
 /**
  * @brief Process Info Control Block
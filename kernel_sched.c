@@ -55,24 +55,28 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  Each thread is allocated as one memory mapping, which holds the TCB and the
+  thread's stack. On the x86, the stack grows downward, so the TCB is placed
+  above the stack, and a guard page below it.
 
-  +-------------+
+  +-------------+  high addresses
   |   TCB       |
   +-------------+
+  | first frame |
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
-  +-------------+
-  | first frame |
   +-------------+
+  | guard page  |
+  +-------------+  low addresses
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  The guard page is mapped with no access, so that a stack overflow crashes
+  the thread at once, before it corrupts the memory of another thread.
+  The mapping is reserved, but not committed: the host commits a page of the
+  stack when the thread first touches it, so a thread that uses little stack
+  costs little memory, whatever its stack size.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
@@ -83,7 +87,7 @@ TCB* cur_thread()
   with the exception of idle threads (they don't count).
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+Spinlock active_threads_spinlock = SPINLOCK_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -92,42 +96,164 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The stack is preceded by a guard page */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+/* The size of the mapping of a thread */
+#define THREAD_SIZE(stack_size) (THREAD_GUARD_SIZE + (stack_size) + THREAD_TCB_SIZE)
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* The start of the stack of a thread */
+#define THREAD_STACK(tcb) ((void*)(tcb) - (tcb)->stack_size)
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Allocate a thread with a stack of the given size, which must be a multiple of
+  SYSTEM_PAGE_SIZE.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+static TCB* allocate_thread(size_t stack_size)
+{
+	void* ptr = mmap(NULL, THREAD_SIZE(stack_size), PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+
+	/* The guard page */
+	CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
 
-void* allocate_thread(size_t size)
+	TCB* tcb = (TCB*)(ptr + THREAD_GUARD_SIZE + stack_size);
+	tcb->stack_size = stack_size;
+	return tcb;
+}
+
+/*
+  Unmap a thread. This does not call the allocator, so it can be called with 
+  preemption off.
+ */
+static void free_thread(TCB* tcb)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	CHECK(munmap(THREAD_STACK(tcb) - THREAD_GUARD_SIZE, THREAD_SIZE(tcb->stack_size)));
+}
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+size_t thread_stack_size(unsigned int size)
+{
+	if (size == 0)
+		return THREAD_STACK_SIZE;
+	if (size > MAX_STACK_SIZE)
+		return 0;
+	if (size < MIN_STACK_SIZE)
+		size = MIN_STACK_SIZE;
+	return ((size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+}
 
-	return ptr;
+size_t thread_stack_used(TCB* tcb)
+{
+	unsigned char resident[256];
+	size_t pages = tcb->stack_size / SYSTEM_PAGE_SIZE;
+	size_t used = 0;
+
+	/* Ask the host which pages of the stack are resident, a chunk at a time */
+	for (size_t p = 0; p < pages; p += sizeof(resident)) {
+		size_t n = (pages - p < sizeof(resident)) ? pages - p : sizeof(resident);
+		if (mincore(THREAD_STACK(tcb) + p * SYSTEM_PAGE_SIZE, n * SYSTEM_PAGE_SIZE, resident) != 0)
+			break;
+		for (size_t i = 0; i < n; i++)
+			used += resident[i] & 1;
+	}
+	return used * SYSTEM_PAGE_SIZE;
 }
-#else
+
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Thread caches.
+  --------------
+
+  Mapping and unmapping the memory of every thread is expensive: it takes
+  host system calls, and the stack pages of a new mapping fault when they are
+  first touched. Instead, released threads with the default stack size
+  (THREAD_STACK_SIZE) are kept for reuse; other threads are unmapped at once.
+
+  - Each core caches up to TCB_CACHE_SIZE threads in its CCB. The cache is
+    only accessed by its own core, with preemption off, so it needs no lock.
+  - A full cache moves half of its threads to a global depot, protected by
+    @c tcb_depot_spinlock, and an empty cache takes a batch from the depot.
+  - The depot keeps up to TCB_DEPOT_SIZE threads. Threads beyond that are
+    unmapped after the depot lock is released.
+
+  The threads are linked through their @c sched_node.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+#define TCB_CACHE_SIZE 16
+#define TCB_DEPOT_SIZE 64
+
+static rlnode tcb_depot; /* The global depot of released threads */
+static volatile uint tcb_depot_count; /* The number of threads in tcb_depot */
+static Spinlock tcb_depot_spinlock = SPINLOCK_INIT; /* spinlock for the depot */
 
-void* allocate_thread(size_t size)
+/* Move up to n threads from the tail of list 'from' to list 'to', returning how many moved */
+static uint tcb_list_move(rlnode* to, rlnode* from, uint n)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	uint moved = 0;
+	for (; moved < n && !is_rlist_empty(from); moved++)
+		rlist_push_front(to, rlist_pop_back(from));
+	return moved;
 }
-#endif
 
+/* Unmap the threads of a list */
+static void tcb_list_free(rlnode* list)
+{
+	while (!is_rlist_empty(list))
+		free_thread(rlist_pop_front(list)->tcb);
+}
+
+/*
+  Take a thread from the cache of the current core, or NULL if there is none.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static TCB* tcb_cache_get()
+{
+	CCB* ccb = &CURCORE;
+
+	if (ccb->tcb_cache_count == 0 && tcb_depot_count > 0) {
+		spin_lock(&tcb_depot_spinlock);
+		uint n = tcb_list_move(&ccb->tcb_cache, &tcb_depot, TCB_CACHE_SIZE / 2);
+		tcb_depot_count -= n;
+		spin_unlock(&tcb_depot_spinlock);
+		ccb->tcb_cache_count += n;
+	}
+
+	if (ccb->tcb_cache_count == 0)
+		return NULL;
+	ccb->tcb_cache_count--;
+	return rlist_pop_front(&ccb->tcb_cache)->tcb;
+}
+
+/*
+  Put a released thread in the cache of the current core. The most recently
+  released threads are reused first, as their stacks are more likely to be cached.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static void tcb_cache_put(TCB* tcb)
+{
+	CCB* ccb = &CURCORE;
+
+	if (ccb->tcb_cache_count == TCB_CACHE_SIZE) {
+		rlnode excess;
+		rlnode_init(&excess, NULL);
+		uint n = tcb_list_move(&excess, &ccb->tcb_cache, TCB_CACHE_SIZE / 2);
+		ccb->tcb_cache_count -= n;
+
+		spin_lock(&tcb_depot_spinlock);
+		uint room = TCB_DEPOT_SIZE - tcb_depot_count;
+		tcb_depot_count += tcb_list_move(&tcb_depot, &excess, (room < n) ? room : n);
+		spin_unlock(&tcb_depot_spinlock);
+
+		/* The depot is full */
+		tcb_list_free(&excess);
+	}
+
+	rlnode_init(&tcb->sched_node, tcb);
+	rlist_push_front(&ccb->tcb_cache, &tcb->sched_node);
+	ccb->tcb_cache_count++;
+}
 
 
 
@@ -170,14 +296,25 @@ PTCB* init_ptcb(Task task, int argl, void* args) {
 	return ptcb;
 }
 
+static void timeout_heap_reserve(uint n); /* forward */
+
 /*
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	/* Reuse a released thread if possible */
+	TCB* tcb = NULL;
+	if (stack_size == THREAD_STACK_SIZE) {
+		int preempt = preempt_off;
+		tcb = tcb_cache_get();
+		if (preempt)
+			preempt_on;
+	}
+
+	if (tcb == NULL)
+		tcb = allocate_thread(stack_size);
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -199,26 +336,33 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 
 	tcb->priority = DEFAULT_PRIORITY;
 
+	tcb->state_spinlock = (Spinlock) SPINLOCK_INIT;
+	tcb->last_core = cpu_core_id;
+
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = THREAD_STACK(tcb);
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, tcb->stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + tcb->stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	spin_lock(&active_threads_spinlock);
+	uint nthreads = ++active_threads;
+	spin_unlock(&active_threads_spinlock);
+
+	/* make sure the new thread will find room in the timeout heap */
+	timeout_heap_reserve(nthreads);
 
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called after the scheduler locks have been released, with preemption
+  off. The thread is EXITED, so nobody else can be touching the TCB.
  */
 void release_TCB(TCB* tcb)
 {
@@ -226,11 +370,14 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		tcb_cache_put(tcb);
+	else
+		free_thread(tcb);
 
-	Mutex_Lock(&active_threads_spinlock);
+	spin_lock(&active_threads_spinlock);
 	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	spin_unlock(&active_threads_spinlock);
 }
 
 /*
@@ -244,175 +391,697 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core has its own scheduler queues (one doubly linked list per
+  priority level), stored in its CCB and protected by the core's
+  @c rq_spinlock. A core takes work from its own queues first; when they
+  are empty, it steals from the queues of other cores.
+
+  Also, the scheduler contains a binary min-heap of all the sleeping
+  threads with a timeout, ordered by wakeup time and protected by
+  @c timeout_spinlock. Each thread in the heap knows its position
+  (@c timeout_slot), so that a timeout is armed or cancelled in O(log n).
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+  The state of each thread is protected by its own @c state_spinlock.
+  The locking order is
 
-  Both of these structures are protected by @c sched_spinlock.
+     tcb->state_spinlock  -->  timeout_spinlock  -->  ccb->rq_spinlock
+
+  and at most one @c rq_spinlock is held at any time.
 */
 
-rlnode SCHED[MAX_PRIORITY_LEVEL + 1]; /* The scheduler queues. Lower index -> Lower Priority */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+static TCB** timeout_heap; /* The heap of threads with a timeout */
+static uint timeout_count; /* The number of threads in timeout_heap */
+static uint timeout_capacity; /* The allocated size of timeout_heap */
+Spinlock timeout_spinlock = SPINLOCK_INIT; /* spinlock for the timeout heap */
+
+/* The earliest wakeup time in timeout_heap, read without locking */
+static volatile TimerDuration next_timeout = NO_TIMEOUT;
+
+static void sched_tick_timeout(CCB* ccb); /* forward */
+static void sched_tick_update(CCB* ccb); /* forward */
 
 /* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+void yield_handler()
+{
+	/* In tickless mode, the ALARM may be for a timeout */
+	if (sched_tickless && CURCORE.tick != TICK_QUANTUM)
+		sched_tick_timeout(&CURCORE);
+	else
+		yield(SCHED_QUANTUM);
+}
 
 /* Interrupt handle for inter-core interrupts */
 void ici_handler()
-{ /* noop for now... */
+{
+	/* In tickless mode, another core may have queued a thread here */
+	if (sched_tickless)
+		sched_tick_update(&CURCORE);
+}
+
+/*
+  Recompute next_timeout.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static inline void sched_update_next_timeout()
+{
+	next_timeout = (timeout_count == 0) ? NO_TIMEOUT : timeout_heap[0]->wakeup_time;
+}
+
+/*
+  Timeout heap helpers.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static inline void timeout_heap_place(TCB* tcb, uint slot)
+{
+	timeout_heap[slot] = tcb;
+	tcb->timeout_slot = slot;
+}
+
+static void timeout_heap_sift_up(uint slot)
+{
+	TCB* tcb = timeout_heap[slot];
+	while (slot > 0) {
+		uint parent = (slot - 1) / 2;
+		if (timeout_heap[parent]->wakeup_time <= tcb->wakeup_time)
+			break;
+		timeout_heap_place(timeout_heap[parent], slot);
+		slot = parent;
+	}
+	timeout_heap_place(tcb, slot);
+}
+
+static void timeout_heap_sift_down(uint slot)
+{
+	TCB* tcb = timeout_heap[slot];
+	for (;;) {
+		uint child = 2 * slot + 1;
+		if (child >= timeout_count)
+			break;
+		if (child + 1 < timeout_count
+			&& timeout_heap[child + 1]->wakeup_time < timeout_heap[child]->wakeup_time)
+			child++;
+		if (tcb->wakeup_time <= timeout_heap[child]->wakeup_time)
+			break;
+		timeout_heap_place(timeout_heap[child], slot);
+		slot = child;
+	}
+	timeout_heap_place(tcb, slot);
+}
+
+static void timeout_heap_insert(TCB* tcb)
+{
+	/* See timeout_heap_reserve() */
+	assert(timeout_count < timeout_capacity);
+	timeout_heap_place(tcb, timeout_count++);
+	timeout_heap_sift_up(tcb->timeout_slot);
+}
+
+static void timeout_heap_remove(TCB* tcb)
+{
+	uint slot = tcb->timeout_slot;
+	assert(slot < timeout_count && timeout_heap[slot] == tcb);
+
+	TCB* last = timeout_heap[--timeout_count];
+	if (last != tcb) {
+		timeout_heap_place(last, slot);
+		/* the moved thread may belong above or below its new slot */
+		timeout_heap_sift_up(slot);
+		timeout_heap_sift_down(last->timeout_slot);
+	}
+}
+
+/*
+  Make room in the timeout heap for n threads.
+
+  The heap is never grown by the scheduler itself: the scheduler runs with
+  preemption off, and may have preempted a thread inside malloc(). Instead,
+  spawn_thread() reserves a heap slot for every active thread.
+*/
+static void timeout_heap_reserve(uint n)
+{
+	/* A racy peek, checked again below */
+	if (n <= timeout_capacity)
+		return;
+
+	uint capacity = (timeout_capacity == 0) ? 64 : timeout_capacity;
+	while (capacity < n)
+		capacity *= 2;
+	TCB** heap = xmalloc(capacity * sizeof(TCB*));
+
+	int preempt = preempt_off;
+	spin_lock(&timeout_spinlock);
+	if (capacity > timeout_capacity) {
+		if (timeout_count > 0)
+			memcpy(heap, timeout_heap, timeout_count * sizeof(TCB*));
+		TCB** old = timeout_heap;
+		timeout_heap = heap;
+		timeout_capacity = capacity;
+		heap = old;
+	}
+	spin_unlock(&timeout_spinlock);
+	if (preempt)
+		preempt_on;
+
+	/* Either the old heap or the unused new one */
+	free(heap);
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the scheduler timeout heap.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
+		spin_lock(&timeout_spinlock);
+
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
 		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		timeout_heap_insert(tcb);
+
+		sched_update_next_timeout();
+		spin_unlock(&timeout_spinlock);
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Remove TCB from the scheduler timeout heap.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_cancel_timeout(TCB* tcb)
+{
+	spin_lock(&timeout_spinlock);
+	timeout_heap_remove(tcb);
+	tcb->wakeup_time = NO_TIMEOUT;
+	sched_update_next_timeout();
+	spin_unlock(&timeout_spinlock);
+}
+
+/*
+  The queue of priority level p of a core. Queues are indexed through
+  ccb->rq_base, so that raise_priorities() can rotate all levels at once.
+*/
+static inline rlnode* sched_rq(CCB* ccb, int p)
+{
+	return &ccb->rq[(p + ccb->rq_base) % (MAX_PRIORITY_LEVEL + 1)];
+}
+
+/*
+  Add TCB to the end of its priority queue of a core.
+
+  *** MUST BE CALLED WITH ccb->rq_spinlock HELD ***
+*/
+static inline void sched_rq_push(CCB* ccb, TCB* tcb)
+{
+	tcb->rq_index = (tcb->priority + ccb->rq_base) % (MAX_PRIORITY_LEVEL + 1);
+	tcb->rq_raised = ccb->rq_raises;
+	rlist_push_back(&ccb->rq[tcb->rq_index], &tcb->sched_node);
+	ccb->rq_mask |= 1u << tcb->priority;
+	ccb->rq_count++;
+}
+
+/*
+  Directed yield.
+
+  A thread that wakes up another thread is often about to block, e.g., a client
+  that has written a request to a pipe and will now read the reply. The woken
+  thread should then run next on this core, instead of waiting behind the threads
+  that were queued before it.
+
+  When a thread wakes up a thread on its own core, the woken thread is queued
+  as usual, and it is also remembered in ccb->handoff. If the next yield on the
+  core blocks the current thread, the woken thread is taken out of the queues
+  and runs at once. At any other yield, the hint is dropped.
+
+  ccb->handoff is protected by ccb->rq_spinlock, and it is cleared whenever
+  its thread leaves the queues, so that it always points to a queued thread.
+*/
+#ifndef SCHED_HANDOFF
+#define SCHED_HANDOFF 0
+#endif
+int sched_handoff = SCHED_HANDOFF;
+
+/*
+  The woken thread runs on the rest of the quantum of the waker. When little 
+  of it is left, the core is not handed over, and the queues take their turn.
+*/
+#define HANDOFF_MIN_QUANTUM (QUANTUM/10)
+
+/*
+  Add TCB to the end of the scheduler queue of core c. If 'handoff' is set,
+  the thread is also handed the core when the current thread blocks.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static void sched_queue_add(TCB* tcb, uint c, int handoff)
 {
+	CCB* ccb = &cctx[c];
+
 	/* Insert at the end of the scheduling list */
-	if (tcb)
-		rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	spin_lock(&ccb->rq_spinlock);
+	sched_rq_push(ccb, tcb);
+	if (handoff && ccb->handoff == NULL)
+		ccb->handoff = tcb;
+	spin_unlock(&ccb->rq_spinlock);
+}
+
+/*
+  Tickless scheduling.
+
+  When sched_tickless is set, the timer of a core is armed for the end of
+  the quantum only while other threads are queued on the core, since the
+  quantum is what lets them run. Any queued thread counts, whatever its 
+  priority: the end of the quantum also lowers the priority of the running
+  thread, so that the threads of lower priority run in time. Else, the timer 
+  is armed for the earliest timeout, if any, and its ALARM expires the 
+  timeouts without ending the timeslice. Else, it is not armed, and yield() 
+  does not need to cancel it.
+
+  A core that runs without a quantum timer must arm it when a thread is
+  queued on it: the core itself does it before it turns preemption back on,
+  and the other cores send it an ICI (see sched_tick_notify()). A core 
+  decides under its rq_spinlock, so a thread that is queued after the 
+  decision is seen by the notification.
+
+  In tickless mode, an idle core may sleep indefinitely, so the idle thread
+  must not miss the notification that comes just before it halts. It halts 
+  with preemption off, so that the ICI stays pending.
+*/
+#ifndef SCHED_TICKLESS
+#define SCHED_TICKLESS 0
+#endif
+int sched_tickless = SCHED_TICKLESS;
+
+/* The delay of a timeout that has expired, but not by bios_clock() yet */
+#define TICK_MIN_DELAY (QUANTUM / 10)
+
+/* The rest of the timeslice of the current core */
+static TimerDuration sched_tick_remaining(CCB* ccb)
+{
+	TimerDuration elapsed = (bios_clock_ns() - ccb->slice_start) / 1000;
+	return (elapsed < ccb->slice_length) ? ccb->slice_length - elapsed : 0;
+}
+
+/*
+  Arm the timer of the current core as needed.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static void sched_tick_update(CCB* ccb)
+{
+	/* Threads are woken up at boot, before the scheduler starts */
+	TCB* current = ccb->current_thread;
+	if (current == NULL || current->state != RUNNING || ccb->tick == TICK_QUANTUM)
+		return;
+
+	spin_lock(&ccb->rq_spinlock);
+	int queued = current->type != IDLE_THREAD && ccb->rq_count > 0;
+	ccb->tick = queued ? TICK_QUANTUM : TICK_NONE;
+	spin_unlock(&ccb->rq_spinlock);
+
+	TimerDuration delay = 0;
+	TimerDuration timeout = next_timeout;
+	if (queued) {
+		delay = sched_tick_remaining(ccb);
+		if (delay == 0) delay = 1;
+	} else if (timeout != NO_TIMEOUT) {
+		TimerDuration now = bios_clock();
+		delay = (timeout > now) ? timeout - now : TICK_MIN_DELAY;
+		ccb->tick = TICK_TIMEOUT;
+	}
+	if (ccb->tick != TICK_NONE)
+		bios_set_timer(delay);
+}
+
+/*
+  Start the timeslice of the current thread. This is called by gain().
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static void sched_tick_start(CCB* ccb, TimerDuration quantum)
+{
+	ccb->slice_start = bios_clock_ns();
+	ccb->slice_length = quantum;
+	ccb->tick = TICK_NONE;
+	sched_tick_update(ccb);
+}
+
+/*
+  Cancel the timer of the current core, if armed, and return the rest of 
+  the timeslice. This is called by yield().
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static TimerDuration sched_tick_stop(CCB* ccb)
+{
+	if (ccb->tick != TICK_NONE) {
+		bios_cancel_timer();
+		ccb->tick = TICK_NONE;
+	}
+	return sched_tick_remaining(ccb);
+}
+
+/*
+  The ALARM of a timeout, in tickless mode. The timeslice goes on.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static void sched_wakeup_expired_timeouts(); /* forward */
+static void sched_tick_timeout(CCB* ccb)
+{
+	ccb->tick = TICK_NONE;
+	sched_wakeup_expired_timeouts();
+	sched_tick_update(ccb);
+}
+
+/*
+  Core c got a new thread in its queues, and it was not halted.
+*/
+static void sched_tick_notify(uint c)
+{
+	/* The quantum timer of core c is armed until its next yield() */
+	if (cctx[c].tick == TICK_QUANTUM)
+		return;
+
+	int preempt = preempt_off;
+	if (c == cpu_core_id)
+		sched_tick_update(&cctx[c]);
+	else
+		cpu_ici(c);
+	if (preempt)
+		preempt_on;
+}
+
+/*
+  Restart core c if it is halted, else some other halted core, which may
+  steal the newly queued thread.
+
+  This should be called after the scheduler locks have been released, so that
+  a restarted core does not immediately spin on them.
+*/
+static void sched_notify_core(uint c)
+{
+	if (!cpu_core_restart(c)) {
+		if (sched_tickless)
+			sched_tick_notify(c);
+		cpu_core_restart_one();
+	}
+}
+
+/*
+  Remove the head of the highest priority non-empty queue of a core, if any, and
+  return it. Return NULL if the queues are empty.
+
+  *** MUST BE CALLED WITH ccb->rq_spinlock HELD ***
+*/
+static TCB* sched_queue_pop(CCB* ccb)
+{
+	if (ccb->rq_mask == 0)
+		return NULL;
+
+	/* The highest non-empty level */
+	int p = 31 - __builtin_clz(ccb->rq_mask);
+	rlnode* q = sched_rq(ccb, p);
+
+	TCB* tcb = rlist_pop_front(q)->tcb;
+	if (is_rlist_empty(q))
+		ccb->rq_mask &= ~(1u << p);
+	ccb->rq_count--;
+	if (ccb->handoff == tcb)
+		ccb->handoff = NULL;
+
+	/* The thread may have been raised while in the queue */
+	tcb->priority = p;
+	return tcb;
+}
+
+/*
+  Remove the thread of ccb->handoff from the queues of a core, and return it.
+
+  *** MUST BE CALLED WITH ccb->rq_spinlock HELD ***
+*/
+static TCB* sched_queue_take_handoff(CCB* ccb)
+{
+	const uint levels = MAX_PRIORITY_LEVEL + 1;
+	TCB* tcb = ccb->handoff;
+	ccb->handoff = NULL;
+
+	/*
+	  The level of the queue the thread was pushed to. Each raise moves it up
+	  by one; once it reaches the top, raise_priorities() moves it to the new top
+	  queue instead, and the level of its old queue wraps around below the
+	  number of raises since the push.
+	 */
+	uint raises = ccb->rq_raises - tcb->rq_raised;
+	uint p = (tcb->rq_index + levels - ccb->rq_base) % levels;
+	if (raises > MAX_PRIORITY_LEVEL || p < raises)
+		p = MAX_PRIORITY_LEVEL;
+
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(sched_rq(ccb, p)))
+		ccb->rq_mask &= ~(1u << p);
+	ccb->rq_count--;
+
+	/* As in sched_queue_pop() */
+	tcb->priority = p;
+	return tcb;
+}
+
+/*
+  Take a ready thread from the queues of some other core. The scan starts
+  at the next core, so that thieves spread over their victims.
+ */
+static TCB* sched_steal(CCB* thief)
+{
+	uint ncores = cpu_cores();
+	for (uint i = 1; i < ncores; i++) {
+		CCB* victim = &cctx[(thief->id + i) % ncores];
+
+		/* Peek without locking first */
+		if (victim->rq_count == 0)
+			continue;
+
+		spin_lock(&victim->rq_spinlock);
+		TCB* tcb = sched_queue_pop(victim);
+		spin_unlock(&victim->rq_spinlock);
+
+		if (tcb)
+			return tcb;
+	}
+	return NULL;
+}
+
+/*
+  Choose the core on which a woken thread is queued. Normally, this is the
+  waker's core: the waker often blocks soon after (e.g., at a pipe), and the
+  woken thread can use the data it left in the cache. However, if the waker's core
+  already has queued work and the thread's last core is idle, the thread goes back to
+  its last core. New threads always start at the waker's core; idle cores will steal
+  them from there.
+ */
+static uint sched_wakeup_core(TCB* tcb)
+{
+	uint self = cpu_core_id;
+	uint last = tcb->last_core;
+
+	if (tcb->state != INIT && last != self && last < cpu_cores()
+		&& cctx[self].rq_count > 0 && cctx[last].current_thread == &cctx[last].idle_thread)
+		return last;
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	return self;
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+	Adjust the state of a thread to make it READY. Returns the core
+	on which the thread must be queued, or NOCORE if it must not be
+	queued (the caller should pass this to sched_notify_core()).
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
-static void sched_make_ready(TCB* tcb)
+static uint sched_set_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timeout heap */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
+		/* tcb is in the timeout heap, fix it */
+		assert(tcb->state == STOPPED);
+		sched_cancel_timeout(tcb);
 	}
 
+	uint c = sched_wakeup_core(tcb);
+
 	/* Mark as ready */
 	tcb->state = READY;
 
+	/* A thread that is still switching out is queued by its core */
+	return (tcb->phase == CTX_CLEAN) ? c : NOCORE;
+}
+
+/*
+	Like sched_set_ready, but also add the thread to the queue of its core. 
+	If 'handoff' is set and the thread is queued on the current core, it will 
+	run next if the current thread blocks (see sched_handoff).
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static uint sched_make_ready(TCB* tcb, int handoff)
+{
+	uint c = sched_set_ready(tcb);
+
 	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+	if (c != NOCORE)
+		sched_queue_add(tcb, c, handoff && c == cpu_core_id);
+	return c;
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Remove from the timeout heap all threads whose timeout has expired, and
+  wake them up. The whole batch is expired in one critical section, against
+  one reading of the clock, and the cores that got threads are notified
+  after the locks are released.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Since the timeout lock is taken after the thread lock, a thread that is
+  locked by someone else is left for a later call.
 */
 static void sched_wakeup_expired_timeouts()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
+	/* Empty the timeout heap up to the current time and wake up each thread */
 	TimerDuration curtime = bios_clock();
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
+	/* The common case: nothing has expired */
+	if (next_timeout > curtime)
+		return;
+
+	uint32_t notify = 0; /* the cores that got new threads (MAX_CORES <= 32) */
+	spin_lock(&timeout_spinlock);
+	while (timeout_count > 0) {
+		TCB* tcb = timeout_heap[0];
 		if (tcb->wakeup_time > curtime)
 			break;
-		sched_make_ready(tcb);
+		if (!spin_trylock(&tcb->state_spinlock))
+			break;
+
+		timeout_heap_remove(tcb);
+		tcb->wakeup_time = NO_TIMEOUT;
+		uint c = sched_make_ready(tcb, 0);
+		if (c != NOCORE)
+			notify |= 1u << c;
+
+		spin_unlock(&tcb->state_spinlock);
+	}
+	sched_update_next_timeout();
+	spin_unlock(&timeout_spinlock);
+
+	while (notify) {
+		uint c = __builtin_ctz(notify);
+		notify &= notify - 1;
+		sched_notify_core(c);
 	}
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Select the next thread to run on the current core: the thread that the current
+  thread has just woken up, if the current thread blocks, else the head of the
+  local queues, else the current thread if it is still ready, else a thread stolen
+  from another core, else the idle thread.
 */
 static TCB* sched_queue_select(TCB* current)
 {
-	/* Get the head of the SCHED list */
-	rlnode* sel = NULL;
-	for (int i = MAX_PRIORITY_LEVEL; i >= 0; i--) {
-		if (!is_rlist_empty(&SCHED[i])) {
-			sel = rlist_pop_front(&SCHED[i]);
-			break;
-		}
+	CCB* ccb = &CURCORE;
+	TCB* next_thread;
+	int blocked = (current->state == STOPPED || current->state == EXITED);
+
+	spin_lock(&ccb->rq_spinlock);
+	int handoff = (blocked && ccb->handoff != NULL && current->rts >= HANDOFF_MIN_QUANTUM);
+	if (handoff)
+		next_thread = sched_queue_take_handoff(ccb);
+	else {
+		ccb->handoff = NULL;
+		next_thread = sched_queue_pop(ccb);
+	}
+	spin_unlock(&ccb->rq_spinlock);
+
+	if (handoff) {
+		/* 
+		  The woken thread only gets the rest of the quantum, so that threads which 
+		  keep handing the core to each other cannot starve the queued threads.
+		 */
+		next_thread->its = current->rts;
+		return next_thread;
 	}
 
-	TCB* next_thread = NULL; /* When the list is empty, this is NULL */
-	if (sel) (next_thread = sel->tcb);
+	int current_ready = (current->state == READY && current->type != IDLE_THREAD);
+
+	if (next_thread == NULL && !current_ready)
+		next_thread = sched_steal(ccb);
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = (current->state == READY) ? current : &ccb->idle_thread;
 
 	next_thread->its = QUANTUM;
 
 	return next_thread;
 }
-/* Yield calls counter*/
-static int yields_counter = 0;
 
 /*
-	Raise the priority of all threads by 1 after @c YIELDS_TO_RAISE number of yields,
+	Raise the priority of all threads in the queues of a core by 1,
 	except those that are already of the highest priority ofc
+
+	This takes constant time: rotating rq_base moves every queue one level up.
+	The old top queue would wrap around to level 0, so its threads are moved
+	to the head of the new top queue. The priority of a queued thread is
+	updated when it is removed from the queue (see sched_queue_pop).
+
+	*** MUST BE CALLED WITH ccb->rq_spinlock HELD ***
 */
-void raise_priorities() {
-	for (int i = MAX_PRIORITY_LEVEL; i > 0; i--) {
-		while(!is_rlist_empty(&SCHED[i-1])) {
-			TCB* tcb = rlist_pop_front(&SCHED[i-1])->tcb;
-			if (tcb) {
-				tcb->priority++;
-				rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
-			}
-		}
-	}
-	yields_counter = 0;
+static void raise_priorities(CCB* ccb) {
+	const uint all_levels = (1u << (MAX_PRIORITY_LEVEL + 1)) - 1;
+	const uint top_level = 1u << MAX_PRIORITY_LEVEL;
+
+	rlnode* old_top = sched_rq(ccb, MAX_PRIORITY_LEVEL);
+	ccb->rq_base = (ccb->rq_base + MAX_PRIORITY_LEVEL) % (MAX_PRIORITY_LEVEL + 1);
+	rlist_prepend(sched_rq(ccb, MAX_PRIORITY_LEVEL), old_top);
+	ccb->rq_raises++;
+
+	ccb->rq_mask = ((ccb->rq_mask << 1) | (ccb->rq_mask & top_level)) & all_levels;
+	ccb->yields_counter = 0;
 }
 
 /*
-  Make the process ready.
+  Make the process ready, but leave it to the caller to notify its core
+  (see wakeup_notify).
  */
-int wakeup(TCB* tcb)
+int wakeup_deferred(TCB* tcb, uint* core)
 {
 	int ret = 0;
+	*core = NOCORE;
 
 	/* Preemption off */
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	spin_lock(&tcb->state_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
+		/* Only a thread can hand over its core (there is none at boot time) */
+		TCB* waker = CURTHREAD;
+		int handoff = sched_handoff && waker != NULL && waker->type != IDLE_THREAD;
+		*core = sched_make_ready(tcb, handoff);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	spin_unlock(&tcb->state_spinlock);
+
+	/* Arm the quantum timer while preemption is off (see sched_tick_notify) */
+	if (sched_tickless && *core == cpu_core_id)
+		sched_tick_update(&CURCORE);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -421,10 +1090,105 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+/*
+  Notify a core that got a thread from wakeup_deferred.
+ */
+void wakeup_notify(uint core)
+{
+	if (core != NOCORE)
+		sched_notify_core(core);
+}
+
+/*
+  Batched wakeups.
+
+  The threads of a batch are made READY at once, but they are kept in 
+  per-core lists (linked by their sched_node) until the batch ends. This is
+  safe, because preemption is off in between: the threads are not running, 
+  and no other core can find them in the queues until they are added.
+ */
+void wakeup_batch_begin(wakeup_batch* wb)
+{
+	wb->preempt = preempt_off;
+	for (uint c = 0; c < cpu_cores(); c++)
+		rlnode_init(&wb->ready[c], NULL);
+	wb->cores = 0;
+	wb->count = 0;
+}
+
+int wakeup_batch_add(wakeup_batch* wb, TCB* tcb)
+{
+	int ret = 0;
+	spin_lock(&tcb->state_spinlock);
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		uint c = sched_set_ready(tcb);
+		if (c != NOCORE) {
+			rlist_push_back(&wb->ready[c], &tcb->sched_node);
+			wb->cores |= 1u << c;
+			wb->count++;
+		}
+		ret = 1;
+	}
+	spin_unlock(&tcb->state_spinlock);
+	return ret;
+}
+
+void wakeup_batch_end(wakeup_batch* wb)
+{
+	uint self = cpu_core_id;
+	TCB* waker = CURTHREAD;
+	int handoff = sched_handoff && waker != NULL && waker->type != IDLE_THREAD;
+
+	/* Queue the threads, taking the queue lock of each core once */
+	for (uint32_t cores = wb->cores; cores; cores &= cores - 1) {
+		uint c = __builtin_ctz(cores);
+		CCB* ccb = &cctx[c];
+		rlnode* list = &wb->ready[c];
+
+		spin_lock(&ccb->rq_spinlock);
+		if (handoff && c == self && ccb->handoff == NULL)
+			ccb->handoff = list->next->tcb;
+		while (!is_rlist_empty(list))
+			sched_rq_push(ccb, rlist_pop_front(list)->tcb);
+		spin_unlock(&ccb->rq_spinlock);
+	}
+	if (sched_tickless && (wb->cores & (1u << self)))
+		sched_tick_update(&cctx[self]);
+
+	if (wb->preempt)
+		preempt_on;
+
+	/* 
+	  Restart the halted cores that got threads, and then enough other halted
+	  cores to steal the rest of the threads. 
+	 */
+	uint needed = wb->count;
+	for (uint32_t cores = wb->cores; cores; cores &= cores - 1) {
+		uint c = __builtin_ctz(cores);
+		if (cpu_core_restart(c))
+			needed--;
+		else if (sched_tickless)
+			sched_tick_notify(c);
+	}
+	if (needed > 0)
+		cpu_core_restart_many(needed);
+}
+
+/*
+  Make the process ready.
+ */
+int wakeup(TCB* tcb)
+{
+	uint core;
+	int ret = wakeup_deferred(tcb, &core);
+	wakeup_notify(core);
+	return ret;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+void sleep_releasing(Thread_state state, Spinlock* mx, enum SCHED_CAUSE cause,
 	TimerDuration timeout)
 {
 	assert(state == STOPPED || state == EXITED);
@@ -432,7 +1196,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	spin_lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -443,10 +1207,10 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	/* Release mx */
 	if (mx != NULL)
-		Mutex_Unlock(mx);
+		spin_unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* Release the thread spinlock before calling yield() !!! */
+	spin_unlock(&tcb->state_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -461,19 +1225,29 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 void yield(enum SCHED_CAUSE cause)
 {	
 	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
+	TimerDuration remaining = sched_tickless ? 0 : bios_cancel_timer();
 
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
-	Mutex_Lock(&sched_spinlock);
+	CCB* ccb = &CURCORE;
+	if (sched_tickless)
+		remaining = sched_tick_stop(ccb);
+	TCB* current = ccb->current_thread; /* Make a local copy of current process, for speed */
 
 	/* If we called yield enough times, raise thread priorities */
-	(yields_counter == YIELDS_TO_RAISE) ? raise_priorities() : yields_counter++;
+	if (ccb->yields_counter == YIELDS_TO_RAISE) {
+		spin_lock(&ccb->rq_spinlock);
+		raise_priorities(ccb);
+		spin_unlock(&ccb->rq_spinlock);
+	} else
+		ccb->yields_counter++;
+
 	/* Update CURTHREAD state */
+	spin_lock(&current->state_spinlock);
 	if (current->state == RUNNING)
 		current->state = READY;
+	spin_unlock(&current->state_spinlock);
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
@@ -501,12 +1275,11 @@ void yield(enum SCHED_CAUSE cause)
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-	Mutex_Unlock(&sched_spinlock);
+	ccb->previous_thread = current;
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		ccb->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 	/* This is where we get after we are switched back on! A long time
@@ -529,42 +1302,122 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {	
-	Mutex_Lock(&sched_spinlock);
-
-	TCB* current = CURTHREAD;
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread;
 
 	/* Mark current state */
+	spin_lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->last_core = ccb->id;
+	spin_unlock(&current->state_spinlock);
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = ccb->previous_thread;
 	if (current != prev) {
+		int exited = 0, queued = 0;
+
+		spin_lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
-			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+			if (prev->type != IDLE_THREAD) {
+				sched_queue_add(prev, ccb->id, 0);
+				queued = 1;
+			}
 			break;
 		case EXITED:
-			release_TCB(prev);
+			exited = 1;
 			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
+		spin_unlock(&prev->state_spinlock);
+
+		if (queued)
+			cpu_core_restart_one();
+		if (exited)
+			release_TCB(prev);
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* In tickless mode, the timer is armed before preemption is back on */
+	if (sched_tickless)
+		sched_tick_start(ccb, current->rts);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
 	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	if (!sched_tickless) {
+		ccb->tick = TICK_QUANTUM;
+		bios_set_timer(current->rts);
+	}
+}
+
+/*
+  Move a thread from another core to the queues of this core, if there
+  is nothing to run here. Returns 1 if this core has work.
+ */
+static int sched_find_work()
+{
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+
+	int found = (ccb->rq_count > 0);
+	if (!found) {
+		TCB* tcb = sched_steal(ccb);
+		if (tcb) {
+			spin_lock(&ccb->rq_spinlock);
+			sched_rq_push(ccb, tcb);
+			spin_unlock(&ccb->rq_spinlock);
+			found = 1;
+		}
+	}
+
+	if (preempt)
+		preempt_on;
+	return found;
+}
+
+/*
+  Adaptive spinning of idle cores.
+
+  When work arrives while an idle core spins, its spin budget moves by 1/4
+  toward twice the rounds spun (plus IDLE_SPIN_MIN), and every time the core
+  halts, the budget shrinks by 1/8. It is kept between IDLE_SPIN_MIN and 
+  sched_idle_spin.
+*/
+#ifndef SCHED_IDLE_SPIN
+#define SCHED_IDLE_SPIN 0
+#endif
+int sched_idle_spin = SCHED_IDLE_SPIN;
+
+#define IDLE_SPIN_MIN 4
+
+static void idle_halt(CCB* ccb)
+{
+	int max = sched_idle_spin;
+	if (max <= 0) {
+		cpu_core_halt();
+		return;
+	}
+
+	int spin = ccb->idle_spin;
+	int spun = cpu_core_halt_spin(spin);
+	if (spun < spin)
+		spin += (2 * spun + IDLE_SPIN_MIN - spin) / 4;
+	else
+		spin -= spin / 8;
+
+	if (spin < IDLE_SPIN_MIN)
+		spin = IDLE_SPIN_MIN;
+	if (spin > max)
+		spin = max;
+	ccb->idle_spin = spin;
 }
 
 static void idle_thread()
@@ -574,7 +1427,12 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		/* Only halt if there is no work to steal (see sched_tickless) */
+		int preempt = sched_tickless ? preempt_off : 0;
+		if (!sched_find_work())
+			idle_halt(&CURCORE);
+		if (preempt)
+			preempt_on;
 		yield(SCHED_IDLE);
 	}
 
@@ -584,15 +1442,46 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues. The queues of all cores are initialized
+  here, since threads may be woken up before the cores enter the scheduler.
  */
 void initialize_scheduler()
 {
-	for (int i = 0; i <= MAX_PRIORITY_LEVEL; i++) {
-		rlnode_init(&SCHED[i], NULL);
+	for (int c = 0; c < MAX_CORES; c++) {
+		CCB* ccb = &cctx[c];
+		ccb->id = c;
+		ccb->current_thread = NULL;
+		ccb->rq_spinlock = (Spinlock) SPINLOCK_INIT;
+		for (int i = 0; i <= MAX_PRIORITY_LEVEL; i++)
+			rlnode_init(&ccb->rq[i], NULL);
+		ccb->rq_base = 0;
+		ccb->rq_mask = 0;
+		ccb->rq_raises = 0;
+		ccb->rq_count = 0;
+		ccb->yields_counter = 0;
+		ccb->handoff = NULL;
+		rlnode_init(&ccb->tcb_cache, NULL);
+		ccb->tcb_cache_count = 0;
+		ccb->idle_spin = IDLE_SPIN_MIN;
+		ccb->tick = TICK_QUANTUM;
 	}
-	
-	rlnode_init(&TIMEOUT_LIST, NULL);
+
+	rlnode_init(&tcb_depot, NULL);
+	tcb_depot_count = 0;
+
+	timeout_count = 0;
+	next_timeout = NO_TIMEOUT;
+}
+
+void finalize_scheduler()
+{
+	/* Unmap the cached threads of all cores, and the depot */
+	for (int c = 0; c < MAX_CORES; c++) {
+		tcb_list_free(&cctx[c].tcb_cache);
+		cctx[c].tcb_cache_count = 0;
+	}
+	tcb_list_free(&tcb_depot);
+	tcb_depot_count = 0;
 }
 
 void run_scheduler()
@@ -617,6 +1506,9 @@ void run_scheduler()
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
+	curcore->idle_thread.state_spinlock = (Spinlock) SPINLOCK_INIT;
+	curcore->idle_thread.last_core = curcore->id;
+
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
 	cpu_interrupt_handler(ICI, ici_handler);
@@ -124,13 +124,20 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock slept, or @c spin_lock yielded, on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
 	SCHED_USER /**< @brief User-space code called yield */
 };
 
+/** @brief What the timer of a core is armed for (see @c sched_tickless) */
+enum SCHED_TICK {
+	TICK_QUANTUM, /**< @brief The end of the quantum */
+	TICK_TIMEOUT, /**< @brief The earliest timeout, in tickless mode */
+	TICK_NONE /**< @brief Not armed, in tickless mode */
+};
+
 /**
   @brief The thread control block
 
@@ -151,6 +158,7 @@ typedef struct thread_control_block {
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	uint timeout_slot; /**< @brief The position of this thread in the timeout heap, if it has a timeout */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -160,6 +168,13 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
   int priority; /**< @brief The priority of the TCB to schedule */
+	uint rq_index; /**< @brief The run queue, @c rq[rq_index], of the thread while it is queued */
+	uint rq_raised; /**< @brief The value of @c rq_raises of the core when the thread was queued */
+
+	Spinlock state_spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time */
+	uint last_core; /**< @brief The core this thread last ran on */
+
+	size_t stack_size; /**< @brief The size of the stack, which lies right below the TCB */
 
 
 #ifndef NVALGRIND
@@ -181,15 +196,65 @@ typedef struct thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief Return the stack size for a requested size.
+
+  A size of 0 selects @c THREAD_STACK_SIZE. Other sizes are raised to
+  @c MIN_STACK_SIZE and rounded up to whole pages.
+
+  @param size the requested stack size
+  @returns the stack size, or 0 if @c size is larger than @c MAX_STACK_SIZE
+ */
+size_t thread_stack_size(unsigned int size);
+
+/** @brief Return the stack memory committed by a thread.
+
+  This is the number of bytes in the resident pages of the thread's stack.
+  The thread must not exit during the call.
+ */
+size_t thread_stack_used(TCB* tcb);
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/**
+ * @brief Priority levels
+ * 
+ * This is the amount of priority levels threads can have.
+ */
+#define MAX_PRIORITY_LEVEL (3)
+
+_Static_assert(MAX_PRIORITY_LEVEL < 32, "The run queue bitmap has one bit per priority level");
+
+/**
+ * @brief Initialize priority
+ * 
+ * The priority level of a TCB that has never been scheduled
+ */
+#define PRIO_INIT (-1)
+
+/**
+ * @brief Initial priority
+ * 
+ * The priority level a TCB will get when it first gets scheduled
+ */
+#define DEFAULT_PRIORITY (MAX_PRIORITY_LEVEL / 2)
+
+/**
+ * @brief Number of yields to raise priority
+ * 
+ * After this many amounts of calls of the yield() function the thread priorities will be raised by 1
+ */
+#define YIELDS_TO_RAISE (50)
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns its run queues. A thread that becomes ready is queued on a single
+  core, and cores whose queues run dry steal work from other cores before halting.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -198,6 +263,24 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Spinlock rq_spinlock; /**< @brief Protects the run queues of this core */
+	rlnode rq[MAX_PRIORITY_LEVEL + 1]; /**< @brief The run queues. Priority level @c p is in @c rq[(p+rq_base)%(MAX_PRIORITY_LEVEL+1)] */
+	uint rq_base; /**< @brief Rotated by one to raise the priority of all queued threads */
+	uint rq_mask; /**< @brief Bit @c p is set iff the queue of priority level @c p is non-empty */
+	uint rq_raises; /**< @brief The number of times @c rq_base has been rotated */
+	volatile uint rq_count; /**< @brief The number of threads in the run queues */
+	int yields_counter; /**< @brief Yields on this core since the last priority raise */
+	TCB* handoff; /**< @brief A queued thread, woken by the current thread, that runs next if the current thread blocks */
+
+	rlnode tcb_cache; /**< @brief Released threads, kept for reuse by @c spawn_thread on this core */
+	uint tcb_cache_count; /**< @brief The number of threads in @c tcb_cache */
+
+	uint idle_spin; /**< @brief The rounds the idle thread spins before halting (see @c sched_idle_spin) */
+
+	enum SCHED_TICK tick; /**< @brief What the timer of the core is armed for */
+	unsigned long slice_start; /**< @brief When the current timeslice started (nsec), in tickless mode */
+	TimerDuration slice_length; /**< @brief The length of the current timeslice, in tickless mode */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -251,9 +334,41 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the stack, as returned by @c thread_stack_size().
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+  @brief Enable directed yield.
+
+  If this is non-zero, a thread that is woken up on the core of the waker runs
+  right after the waker blocks, ahead of the other queued threads, even those of
+  higher priority. This may cut the latency of request/response exchanges, e.g.,
+  over pipes. The default is 0, or @c SCHED_HANDOFF (build with HANDOFF=1).
+ */
+extern int sched_handoff;
+
+/**
+  @brief The max. rounds that an idle core spins before it halts.
+
+  An idle core waits for new work in @c cpu_core_halt_spin(). Its spin budget 
+  adapts, up to this value, to how soon work arrived in the recent past. 
+  A thread that is woken up on a spinning core runs sooner than on a halted 
+  core. If this is 0, idle cores halt at once. The default is 0, or 
+  @c SCHED_IDLE_SPIN (build with IDLE_SPIN=n).
+ */
+extern int sched_idle_spin;
+
+/**
+  @brief Enable tickless scheduling.
+
+  If this is non-zero, the quantum timer of a core is armed only while other 
+  threads are queued on the core. Else, it is armed only for the earliest 
+  timeout, if any. The default is 0: the timer is armed at every timeslice.
+  Build with TICKLESS=1 to make it @c SCHED_TICKLESS.
+ */
+extern int sched_tickless;
 
 /**
   @brief Wakeup a blocked thread.
@@ -267,15 +382,91 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/** @brief Returned for threads that were not queued on any core */
+#define NOCORE ((uint)-1)
+
+/**
+  @brief Wakeup a blocked thread, without notifying its core.
+
+  This is like @c wakeup(), but the core that the thread was queued on (or 
+  @c NOCORE) is stored in @c core, and the caller must pass it to 
+  @c wakeup_notify() later.
+
+  Notifying a halted core may let it run at once, and on a host with fewer
+  processors than cores, it may even stop the caller.
+  A caller that holds a spinlock which the woken thread needs (such as the 
+  lock of a condition variable) should release it before notifying the core.
+
+  @param tcb the thread to be made @c READY.
+  @param core where the core of the thread is stored
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+  @see wakeup_notify
+*/
+int wakeup_deferred(TCB* tcb, uint* core);
+
+/**
+  @brief Notify a core that was given a thread by @c wakeup_deferred().
+
+  @param core the core, or @c NOCORE
+*/
+void wakeup_notify(uint core);
+
+/**
+  @brief A batch of threads that are woken up together.
+
+  Waking up many threads one by one with @c wakeup() takes the queue lock
+  of a core and notifies a core once per thread. A batch makes the threads
+  ready one by one, but holds them in per-core lists. When the batch ends,
+  each list is added to the queues of its core in one critical section, and
+  the halted cores are restarted once, as many as the new ready threads.
+
+  The batch is used as follows:
+  @code
+  wakeup_batch wb;
+  wakeup_batch_begin(&wb);
+  ...
+  wakeup_batch_add(&wb, tcb);   // as many times as needed
+  ...
+  wakeup_batch_end(&wb);
+  @endcode
+  Preemption is off between @c wakeup_batch_begin() and @c wakeup_batch_end().
+  As with @c wakeup_deferred(), a caller that holds a lock that the woken 
+  threads need should release it before ending the batch.
+ */
+typedef struct wakeup_batch {
+  rlnode ready[MAX_CORES];  /**< @brief The threads made ready, per core */
+  uint32_t cores;           /**< @brief The cores in @c ready that got threads */
+  uint count;               /**< @brief The number of threads in @c ready */
+  int preempt;              /**< @brief The preemption state at @c wakeup_batch_begin() */
+} wakeup_batch;
+
+/** @brief Start a batch of wakeups. */
+void wakeup_batch_begin(wakeup_batch* wb);
+
+/**
+  @brief Make a blocked thread ready, as part of a batch.
+
+  This is like @c wakeup(), but the thread will only be queued and its core
+  notified by @c wakeup_batch_end().
+
+  @param wb the batch
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+ */
+int wakeup_batch_add(wakeup_batch* wb, TCB* tcb);
+
+/** @brief Queue the threads of a batch and notify their cores. */
+void wakeup_batch_end(wakeup_batch* wb);
+
 /** 
   @brief Block the current thread.
 
 	This call will block the current thread, changing its state to @c STOPPED
-	or @c EXITED. Also, the mutex @c mx, if not `NULL`, will be unlocked, atomically
+	or @c EXITED. Also, the spinlock @c mx, if not `NULL`, will be unlocked, atomically
 	with the blocking of the thread. 
 
 	In particular, what is meant by 'atomically' is that the thread state will change
-	to @c newstate atomically with the mutex unlocking. Note that, the state of
+	to @c newstate atomically with the spinlock unlocking. Note that, the state of
 	the current thread is @c RUNNING. 
 	Therefore, no other state change (such as a wakeup, a yield, another sleep etc) 
 	can happen "between" the thread's state change and the unlocking.
@@ -293,11 +484,11 @@ int wakeup(TCB* tcb);
 	@c wakeup() by another thread.
 
 	@param newstate the new state for the current thread, which must be either stopped or exited
-	@param mx the mutex to unlock.
+	@param mx the spinlock to unlock, or NULL.
 	@param cause the cause of the sleep
 	@param timeout a timeout for the sleep, or 
    */
-void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
+void sleep_releasing(Thread_state newstate, Spinlock* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
 /**
   @brief Give up the CPU.
@@ -325,39 +516,20 @@ void run_scheduler(void);
 void initialize_scheduler(void);
 
 /**
-  @brief Quantum (in microseconds) 
-
-  This is the default quantum for each thread, in microseconds.
-  */
-#define QUANTUM (10000L)
+  @brief Release the memory held by the scheduler.
 
-/**
- * @brief Priority levels
- * 
- * This is the amount of priority levels threads can have.
+  This function is called after the scheduler has stopped on all cores,
+  to free the threads kept for reuse.
  */
-#define MAX_PRIORITY_LEVEL (3)
+void finalize_scheduler(void);
 
 /**
- * @brief Initialize priority
- * 
- * The priority level of a TCB that has never been scheduled
- */
-#define PRIO_INIT (-1)
+  @brief Quantum (in microseconds) 
 
-/**
- * @brief Initial priority
- * 
- * The priority level a TCB will get when it first gets scheduled
- */
-#define DEFAULT_PRIORITY (MAX_PRIORITY_LEVEL / 2)
+  This is the default quantum for each thread, in microseconds.
+  */
+#define QUANTUM (10000L)
 
-/**
- * @brief Number of yields to raise priority
- * 
- * After this many amounts of calls of the yield() function the thread priorities will be raised by 1
- */
-#define YIELDS_TO_RAISE (50)
 /** @} */
 
 #endif
@@ -7,6 +7,7 @@
 
 /*The PORT_MAP contains the SCBs that listen to the port that is equal to the index of the SCB in the array. */
 SCB* PORT_MAP[MAX_PORT + 1] = {NULL};
+Mutex PORT_MAP_mutex = MUTEX_INIT;
 
 /*Checks if the given fid is legal*/
 int fid_legal(Fid_t fid) {
@@ -20,13 +21,28 @@ int port_legal(port_t port) {
 	return 1;
 }
 
-/*Finds the scb that corresponds to the given fid. */
+/*Functions peer sockets can use*/
+static file_ops socket_file_ops = {
+    .Open = false_open_sock,
+    .Read = socket_read,
+    .Write = socket_write,
+    .Close = socket_close,
+    .PipeSize = socket_pipe_size,
+    .Pipe = socket_pipe,
+    .ReadV = socket_readv,
+    .WriteV = socket_writev,
+    .Poll = socket_poll
+};
+
+/*Finds the scb that corresponds to the given FCB, or NULL if the FCB is not a socket. */
+static SCB* fcb_scb (FCB* fcb) {
+	if (!fcb || fcb->streamfunc != &socket_file_ops) return NULL;
+	return fcb->streamobj;
+}
+
+/*Finds the scb that corresponds to the given fid. Must be called with FT_mutex held. */
 SCB* get_scb (Fid_t fid) {
-	FCB* fcb = get_fcb(fid);
-	if (!fcb) return NULL;
-	SCB* scb = fcb->streamobj;
-	if (!scb) return NULL;
-	return scb;
+	return fcb_scb(get_fcb(fid));
 }
 
 /* Initializes a new SCB and returns it. The initial type of the socket will be unbound. */
@@ -34,8 +50,11 @@ SCB* init_scb() {
 	SCB* scb = xmalloc(sizeof(SCB));
 
 	scb->refcount = 0;
+	scb->pipe_size = PIPE_BUFFER_SIZE;
+	scb->mutex = MUTEX_INIT;
 	scb->fcb = NULL;
 	scb->port = NOPORT;
+	poll_queue_init(&scb->pollq);
 
 	scb->type = SOCKET_UNBOUND;
 	rlnode_init(&scb->unbound_s.unbound_socket, scb);
@@ -43,9 +62,8 @@ SCB* init_scb() {
 	return scb;
 }
 
-Fid_t sys_Socket(port_t port) {
-	if (port < NOPORT || port > MAX_PORT) return -1;
-
+/*Creates a new unbound socket, returning its fid and its SCB. */
+static Fid_t socket_open(port_t port, SCB** scbp) {
 	FCB* fcb;
 	Fid_t fid;
 	if(!FCB_reserve(1, &fid, &fcb)) return -1;
@@ -58,9 +76,16 @@ Fid_t sys_Socket(port_t port) {
 
 	if (port != NOPORT) scb->port = port;
 
+	if (scbp) *scbp = scb;
 	return fid;
 }
 
+Fid_t sys_Socket(port_t port) {
+	if (port < NOPORT || port > MAX_PORT) return -1;
+
+	return socket_open(port, NULL);
+}
+
 void* false_open_sock (uint minor) {
 	return NULL;
 }
@@ -68,66 +93,168 @@ void* false_open_sock (uint minor) {
 int socket_read(void* __scb, char *buf, unsigned int size) {
 	SCB* scb = (SCB*) __scb;
 	if (!scb) return -1;
-	return pipe_read(scb->peer_s.read_pipe, buf, size);
+
+	kernel_lock_obj(&scb->mutex);
+	PIPE_CB* pipe = (scb->type == SOCKET_PEER) ? scb->peer_s.read_pipe : NULL;
+	kernel_unlock_obj(&scb->mutex);
+
+	return pipe_read(pipe, buf, size);
 }
 
 int socket_write(void* __scb, const char* buf, unsigned int size) {
 	SCB* scb = (SCB*) __scb;
 	if (!scb) return -1;
-	return pipe_write(scb->peer_s.write_pipe, buf, size);
+
+	kernel_lock_obj(&scb->mutex);
+	PIPE_CB* pipe = (scb->type == SOCKET_PEER) ? scb->peer_s.write_pipe : NULL;
+	kernel_unlock_obj(&scb->mutex);
+
+	return pipe_write(pipe, buf, size);
+}
+
+int socket_readv(void* __scb, const iovec_t* iov, unsigned int iovcnt) {
+	return pipe_readv(socket_pipe(__scb, 0), iov, iovcnt);
+}
+
+int socket_writev(void* __scb, const iovec_t* iov, unsigned int iovcnt) {
+	return pipe_writev(socket_pipe(__scb, 1), iov, iovcnt);
+}
+
+int socket_poll(void* __scb, poll_table* pt) {
+	SCB* scb = (SCB*) __scb;
+	if (!scb) return POLL_INVALID;
+
+	kernel_lock_obj(&scb->mutex);
+	poll_wait(pt, &scb->pollq);
+	int events = 0;
+	switch (scb->type) {
+		case SOCKET_LISTENER:
+			if (!is_rlist_empty(&scb->listener_s.queue)) events = POLL_READ;
+			break;
+		case SOCKET_UNBOUND:
+			break;
+		case SOCKET_PEER:
+			events = pipe_poll(scb->peer_s.read_pipe, 0) | pipe_poll(scb->peer_s.write_pipe, 1);
+	}
+	kernel_unlock_obj(&scb->mutex);
+
+	return events;
+}
+
+PIPE_CB* socket_pipe(void* __scb, int write) {
+	SCB* scb = (SCB*) __scb;
+	if (!scb) return NULL;
+
+	kernel_lock_obj(&scb->mutex);
+	PIPE_CB* pipe = NULL;
+	if (scb->type == SOCKET_PEER)
+		pipe = write ? scb->peer_s.write_pipe : scb->peer_s.read_pipe;
+	kernel_unlock_obj(&scb->mutex);
+
+	return pipe;
 }
 
 int socket_close(void* __scb) {
 	SCB* scb = (SCB*) __scb;
 	if (!scb) return -1;
-	
+
+	PIPE_CB *read_pipe = NULL, *write_pipe = NULL;
+
+	//Stop listening to the port
+	kernel_lock_obj(&PORT_MAP_mutex);
+	if (scb->type == SOCKET_LISTENER && PORT_MAP[scb->port] == scb)
+		PORT_MAP[scb->port] = NULL;
+	kernel_unlock_obj(&PORT_MAP_mutex);
+
+	kernel_lock_obj(&scb->mutex);
 	switch(scb->type) {
 		case SOCKET_LISTENER:
-			PORT_MAP[scb->port] = NULL;
-
+			//Pending requests will not be admitted
+			while (!is_rlist_empty(&scb->listener_s.queue)) {
+				request* req = rlist_pop_front(&scb->listener_s.queue)->req;
+				kernel_signal(&req->request_honored);
+			}
 			kernel_broadcast(&scb->listener_s.req_available);
 			break;
 		case SOCKET_UNBOUND:
 			break;
 		case SOCKET_PEER:
 			scb->peer_s.peer = NULL;
-			pipe_reader_close(scb->peer_s.read_pipe);
-			pipe_writer_close(scb->peer_s.write_pipe);
+			read_pipe = scb->peer_s.read_pipe;
+			write_pipe = scb->peer_s.write_pipe;
 			scb->peer_s.read_pipe = NULL;
 			scb->peer_s.write_pipe = NULL;
 	}
 	scb->port = NOPORT;
 	scb->fcb = NULL;
 	scb->type = SOCKET_UNBOUND;
-	
-	if (scb->refcount == 0) {
-		free(scb);
-		scb = NULL;
-	}
+	int unused = (scb->refcount == 0);
+	kernel_unlock_obj(&scb->mutex);
+
+	//The pipes have their own locks
+	if (read_pipe) pipe_reader_close(read_pipe);
+	if (write_pipe) pipe_writer_close(write_pipe);
+
+	if (unused) free(scb);
 
 	return 0;
 }
 
+int socket_pipe_size(void* __scb, unsigned int size) {
+	SCB* scb = (SCB*) __scb;
+	if (!scb) return -1;
+
+	unsigned int capacity = pipe_capacity(size);
+	if (size != 0 && capacity == 0) return -1;
+
+	kernel_lock_obj(&scb->mutex);
+	if (size != 0) scb->pipe_size = capacity;
+	int retval = scb->pipe_size;
+	PIPE_CB *read_pipe = NULL, *write_pipe = NULL;
+	if (scb->type == SOCKET_PEER) {
+		read_pipe = scb->peer_s.read_pipe;
+		write_pipe = scb->peer_s.write_pipe;
+	}
+	kernel_unlock_obj(&scb->mutex);
+
+	//Resize both directions of a connection, and report the receiving side
+	if (write_pipe && (retval = pipe_resize(write_pipe, size)) < 0) return -1;
+	if (read_pipe && (retval = pipe_resize(read_pipe, size)) < 0) return -1;
+	return retval;
+}
+
 int sys_Listen(Fid_t sock) {
-	SCB* scb = get_scb(sock);
+	FCB* fcb = get_fcb_ref(sock);
+	SCB* scb = fcb_scb(fcb);
+	int retval = -1;
+
+	kernel_lock_obj(&PORT_MAP_mutex);
+	if (scb) kernel_lock_obj(&scb->mutex);
+
 	if (!scb
 		|| scb->port == NOPORT
 		|| scb->type != SOCKET_UNBOUND			//Socket has to be unbound to be able to become a listener
 		|| PORT_MAP[scb->port] != NULL)			//If the PORT_MAP position is not null, it means we already appointed a listener to the port
-			return -1;
+			goto finish;
 
 	//make scb a listening SCB
 	PORT_MAP[scb->port] = scb;
 	scb->type = SOCKET_LISTENER;
 	scb->listener_s.req_available = COND_INIT;
 	rlnode_init(&scb->listener_s.queue, NULL);
-	return 0;
+	retval = 0;
+
+finish:
+	if (scb) kernel_unlock_obj(&scb->mutex);
+	kernel_unlock_obj(&PORT_MAP_mutex);
+	if (fcb) FCB_decref(fcb);
+	return retval;
 }
 
 /*Connect two peer sockets. */
 void connect_peers(SCB* peer, SCB* client) {
-	PIPE_CB* pipe1 = init_pipe_cb();
-	PIPE_CB* pipe2 = init_pipe_cb();
+	PIPE_CB* pipe1 = init_pipe_cb(client->pipe_size);
+	PIPE_CB* pipe2 = init_pipe_cb(peer->pipe_size);
 
 	pipe1->reader = client->fcb;
 	pipe1->writer = peer->fcb;
@@ -135,6 +262,10 @@ void connect_peers(SCB* peer, SCB* client) {
 	pipe2->reader = peer->fcb;
 	pipe2->writer = client->fcb;
 
+	//Each side of the connection is polled on its own socket
+	pipe1->reader_pollq = pipe2->writer_pollq = &client->pollq;
+	pipe1->writer_pollq = pipe2->reader_pollq = &peer->pollq;
+
 	client->peer_s.write_pipe = pipe2;
 	client->peer_s.read_pipe = pipe1;
 
@@ -144,57 +275,88 @@ void connect_peers(SCB* peer, SCB* client) {
 }
 
 Fid_t sys_Accept(Fid_t lsock) {
-	SCB* listener = get_scb(lsock);
-	if(!listener || listener->type != SOCKET_LISTENER) return NOFILE;
-	port_t port = listener->port;
-	listener->refcount++;
+	FCB* lfcb = get_fcb_ref(lsock);
+	SCB* listener = fcb_scb(lfcb);
+	if (!listener) {
+		if (lfcb) FCB_decref(lfcb);
+		return NOFILE;
+	}
+
+	/* 
+		Pin the listener by its refcount instead of its FCB, 
+		so that closing the listener can wake us up.
+	 */
+	kernel_lock_obj(&listener->mutex);
+	int is_listener = (listener->type == SOCKET_LISTENER);
+	if (is_listener) listener->refcount++;
+	kernel_unlock_obj(&listener->mutex);
+	FCB_decref(lfcb);
+	if (!is_listener) return NOFILE;
+
+	Fid_t peer_fid = NOFILE;
+	SCB* peer = NULL;
+	int admitted = 0;
+	kernel_lock_obj(&listener->mutex);
 	
 	//wait until a request is available
-	while(PORT_MAP[port] && is_rlist_empty(&listener->listener_s.queue)) {
-		kernel_wait(&listener->listener_s.req_available, SCHED_PIPE);
+	while(listener->type == SOCKET_LISTENER && is_rlist_empty(&listener->listener_s.queue)) {
+		kernel_wait(&listener->mutex, &listener->listener_s.req_available, SCHED_PIPE);
 	}
 
 	//oops, port is closed
-	if (!PORT_MAP[port]) {
-		listener->refcount--;
-		return NOFILE;
-	}
+	if (listener->type != SOCKET_LISTENER) goto finish;
 
 	//get request from queue
 	request* req = rlist_pop_front(&listener->listener_s.queue)->req;
-	listener->refcount--;
-
-	if (!req) return NOFILE;
 
 	SCB* client = req->peer;
 
 	//initialize a new socket to connect with the client
-	Fid_t peer_fid = sys_Socket(NOPORT);
-	if (peer_fid == NOFILE) return -1;
-	
-	SCB* peer = get_scb(peer_fid);
+	peer_fid = socket_open(NOPORT, &peer);
+	if (peer_fid == NOFILE) {
+		kernel_signal(&req->request_honored);
+		goto finish;
+	}
 
 	peer->type = SOCKET_PEER;
 	peer->peer_s.peer = client;
+	peer->pipe_size = listener->pipe_size;
 
-	//convert client to peer socket
-	client->type = SOCKET_PEER;
-	client->peer_s.peer = peer;
+	//convert client to peer socket, unless it was closed or connected meanwhile
+	kernel_lock_obj(&client->mutex);
+	if (client->type == SOCKET_UNBOUND && client->fcb != NULL) {
+		client->type = SOCKET_PEER;
+		client->peer_s.peer = peer;
 
-	connect_peers(peer, client);
+		connect_peers(peer, client);
 
-	//request was handled succesfully
-	req->admitted = 1;
+		//request was handled succesfully
+		req->admitted = admitted = 1;
+		poll_wakeup(&client->pollq);
+	}
+	kernel_unlock_obj(&client->mutex);
 	kernel_signal(&req->request_honored);
 
+finish:
+	listener->refcount--;
+	int unused = (listener->refcount == 0 && listener->fcb == NULL);
+	kernel_unlock_obj(&listener->mutex);
+
+	if (unused) free(listener);
+
+	if (peer_fid != NOFILE && !admitted) {
+		sys_Close(peer_fid);
+		peer_fid = NOFILE;
+	}
+
 	return peer_fid;
 }
 
 /*Initialize a new request and return it*/
-request* create_request(Fid_t sock) {
+request* create_request(SCB* client) {
 	request* newreq = xmalloc(sizeof(request));
 
-	newreq->peer = get_scb(sock);
+	newreq->peer = client;
 	newreq->admitted = 0;
 
 	newreq->request_honored = COND_INIT;
@@ -204,53 +366,101 @@ request* create_request(Fid_t sock) {
 }
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout) {
-	if (!port_legal(port) || !PORT_MAP[port]) return -1;
+	if (!port_legal(port)) return -1;
 
-	SCB* listener = PORT_MAP[port];
+	/* The FCB reference keeps the client alive until we return */
+	FCB* cfcb = get_fcb_ref(sock);
+	SCB* client = fcb_scb(cfcb);
+	if (!client) goto fail;
 
-	SCB* client = get_scb(sock);
-	if (!client) return -1;
+	//Only unbound sockets can connect
+	kernel_lock_obj(&client->mutex);
+	int is_unbound = (client->type == SOCKET_UNBOUND);
+	kernel_unlock_obj(&client->mutex);
+	if (!is_unbound) goto fail;
 
-	client->refcount++;
+	kernel_lock_obj(&PORT_MAP_mutex);
+	SCB* listener = PORT_MAP[port];
+	if (!listener) {
+		kernel_unlock_obj(&PORT_MAP_mutex);
+		goto fail;
+	}
+	kernel_lock_obj(&listener->mutex);
+	kernel_unlock_obj(&PORT_MAP_mutex);
+
+	listener->refcount++;
 
 	//create a connection request and send it to server
-	request* req = create_request(sock);
-	rlist_push_back(&PORT_MAP[port]->listener_s.queue, &req->request_node);
+	request* req = create_request(client);
+	rlist_push_back(&listener->listener_s.queue, &req->request_node);
 	kernel_signal(&listener->listener_s.req_available);
+	poll_wakeup(&listener->pollq);
 	
 	//wait for the request to be accepted
-	kernel_timedwait(&req->request_honored, SCHED_PIPE, timeout);
-	client->refcount--;
+	kernel_timedwait(&listener->mutex, &req->request_honored, SCHED_PIPE, timeout);
 
 	int retval = (req->admitted) ? 0 : -1;
 	if (retval == -1) rlist_remove(&req->request_node);
 
+	listener->refcount--;
+	int unused = (listener->refcount == 0 && listener->fcb == NULL);
+	kernel_unlock_obj(&listener->mutex);
+
+	if (unused) free(listener);
+
 	req->peer = NULL;
 	
 	free(req);
 	req = NULL;
 
+	FCB_decref(cfcb);
 	return retval;
+
+fail:
+	if (cfcb) FCB_decref(cfcb);
+	return -1;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how) {
-	SCB* scb = get_scb(sock);
-	if (!scb) return -1;
-
-	switch (how) {
-		case SHUTDOWN_READ:
-			pipe_reader_close(scb->peer_s.read_pipe);
-			break;
-		case SHUTDOWN_WRITE:
-			pipe_writer_close(scb->peer_s.write_pipe);
-			break;
-		case SHUTDOWN_BOTH:
-			pipe_reader_close(scb->peer_s.read_pipe);
-			pipe_writer_close(scb->peer_s.write_pipe);
-			break;
-		default: 
-			return -1;
+	FCB* fcb = get_fcb_ref(sock);
+	SCB* scb = fcb_scb(fcb);
+	PIPE_CB *read_pipe = NULL, *write_pipe = NULL;
+	int retval = -1;
+
+	if (!scb) goto finish;
+
+	kernel_lock_obj(&scb->mutex);
+	if (scb->type == SOCKET_PEER) {
+		retval = 0;
+		switch (how) {
+			case SHUTDOWN_READ:
+				read_pipe = scb->peer_s.read_pipe;
+				scb->peer_s.read_pipe = NULL;
+				break;
+			case SHUTDOWN_WRITE:
+				write_pipe = scb->peer_s.write_pipe;
+				scb->peer_s.write_pipe = NULL;
+				break;
+			case SHUTDOWN_BOTH:
+				read_pipe = scb->peer_s.read_pipe;
+				write_pipe = scb->peer_s.write_pipe;
+				scb->peer_s.read_pipe = NULL;
+				scb->peer_s.write_pipe = NULL;
+				break;
+			default: 
+				retval = -1;
+		}
 	}
-	return 0;
+	kernel_unlock_obj(&scb->mutex);
+
+	if (read_pipe) pipe_reader_close(read_pipe);
+	if (write_pipe) pipe_writer_close(write_pipe);
+
+	//Transfers in the shut down directions now fail at once
+	if (retval == 0) poll_wakeup(&scb->pollq);
+
+finish:
+	if (fcb) FCB_decref(fcb);
+	return retval;
 }
\ No newline at end of file
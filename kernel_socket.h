@@ -19,6 +19,16 @@ int socket_read(void* __scb, char *buf, unsigned int size);
  */
 int socket_write(void* __scb, const char* buf, unsigned int size);
 
+/**
+ * @brief Like @c socket_read, but the data are stored into the segments of @c iov
+ */
+int socket_readv(void* __scb, const iovec_t* iov, unsigned int iovcnt);
+
+/**
+ * @brief Like @c socket_write, but the data are taken from the segments of @c iov
+ */
+int socket_writev(void* __scb, const iovec_t* iov, unsigned int iovcnt);
+
 /**
  * @brief Terminates the given socket
  * 
@@ -30,21 +40,38 @@ int socket_write(void* __scb, const char* buf, unsigned int size);
 int socket_close(void* __scb);
 
 /**
- * @brief Just a dummy function to use in socket_file_ops.
+ * @brief Resize the pipes of the given socket
  * 
- * Returns NULL.
+ * For a peer socket, both its pipes are resized, and the capacity of the
+ * pipe it reads from is returned. Other sockets remember
+ * the size, and use it for the pipes created when they connect.
+ * @see SetPipeSize
+ * @returns the capacity, or -1 on error
  */
-void* false_open_sock (uint minor);
+int socket_pipe_size(void* __scb, unsigned int size);
 
 /**
- * @brief Functions peer sockets can use
+ * @brief Returns the events that a socket is ready for
+ * 
+ * A listener is ready for reading when a request is waiting to be accepted. A peer
+ * is ready as the ends of its pipes are. An unbound socket is never ready.
+ * @see Poll
  */
-static file_ops socket_file_ops = {
-    .Open = false_open_sock,
-    .Read = socket_read,
-    .Write = socket_write,
-    .Close = socket_close
-};
+int socket_poll(void* __scb, poll_table* pt);
+
+/**
+ * @brief Returns the pipe that a socket reads from (or writes to, if @c write is nonzero)
+ * 
+ * @returns the pipe, or NULL if the socket is not connected
+ */
+PIPE_CB* socket_pipe(void* __scb, int write);
+
+/**
+ * @brief Just a dummy function to use in socket_file_ops.
+ * 
+ * Returns NULL.
+ */
+void* false_open_sock (uint minor);
 
 /**
  * @brief The type of the socket
@@ -94,9 +121,12 @@ struct peer_socket {
  */
 typedef struct socket_control_block {
     uint refcount;                      /**< @brief The amount of processes currently using the socket. */
+    Mutex mutex;                        /**< @brief Protects the socket (only with FINE_GRAINED_LOCKING). */
     FCB* fcb;                           /**< @brief The FCB connected to the socket. */
     enum socket_type type;              /**< @brief The type of the socket (listening, unbound, peer) */
     port_t port;                        /**< @brief A port the socket is bound to. If it becomes either a listening or peer socket, the port will be used to listen or connect to. */
+    unsigned int pipe_size;             /**< @brief The capacity of the pipes of the socket. */
+    poll_queue pollq;                   /**< @brief The poll queue of the socket, also woken up by its pipes. */
 
     union {
         struct listener_socket listener_s;
@@ -117,6 +147,11 @@ typedef struct connection_request {
     rlnode request_node;            /**< @brief A node to register the request in the queue of the port it wants to connect. */
 } request;
 
+/**
+ * @brief Protects the PORT_MAP (only with FINE_GRAINED_LOCKING).
+ */
+extern Mutex PORT_MAP_mutex;
+
 // Fid_t sys_Socket(port_t port);
 #define SERVER_TIMEOUT 500          /**< @brief How long to wait (msec) before a connection request times out. */
 
@@ -1,15 +1,18 @@
 
+#include <limits.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_pipe.h"
 
 #define MAX_FILES MAX_PROC
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+Mutex FT_mutex = MUTEX_INIT;
 
 
 void initialize_files()
@@ -24,17 +27,26 @@ void initialize_files()
 }
 
 
+/*
+  Must be called with FT_mutex held
+*/
 FCB* acquire_FCB()
 {
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    /* Until the stream is set up, the fid must not be usable */
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
     return fcb;
   }
   else
     return NULL;
 }
 
+/*
+  Must be called with FT_mutex held
+*/
 void release_FCB(FCB* fcb)
 {
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
@@ -44,20 +56,41 @@ void release_FCB(FCB* fcb)
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
+  kernel_lock_obj(&FT_mutex);
   fcb->refcount++;
+  kernel_unlock_obj(&FT_mutex);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
+  kernel_lock_obj(&FT_mutex);
   fcb->refcount --;
   if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
+    void* sobj = fcb->streamobj;
+    file_ops* sfunc = fcb->streamfunc;
     release_FCB(fcb);
-    return retval;
+    kernel_unlock_obj(&FT_mutex);
+
+    /* The stream is closed outside FT_mutex, it may need other locks */
+    return (sfunc && sfunc->Close) ? sfunc->Close(sobj) : 0;
   }
-  else
+  else {
+    kernel_unlock_obj(&FT_mutex);
     return 0;
+  }
+}
+
+
+void FIDT_inherit(PCB* child, PCB* parent)
+{
+  kernel_lock_obj(&FT_mutex);
+  for(int i=0; i<MAX_FILEID; i++) {
+    child->FIDT[i] = parent->FIDT[i];
+    if(child->FIDT[i])
+      child->FIDT[i]->refcount++;
+  }
+  kernel_unlock_obj(&FT_mutex);
 }
 
 
@@ -68,6 +101,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    kernel_lock_obj(&FT_mutex);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +110,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +121,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	fcb[i]->refcount++;
     }
+    kernel_unlock_obj(&FT_mutex);
     return 1;
+
+fail:
+    kernel_unlock_obj(&FT_mutex);
+    return 0;
 }
 
 
@@ -101,11 +141,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    kernel_lock_obj(&FT_mutex);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    kernel_unlock_obj(&FT_mutex);
 }
 
 
@@ -128,23 +170,32 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  kernel_lock_obj(&FT_mutex);
+  FCB* fcb = get_fcb(fid);
+  if(fcb)
+    fcb->refcount++;
+  kernel_unlock_obj(&FT_mutex);
+  return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
+  int (*devread)(void*,char*,uint) = NULL;
   void* sobj;
 
 
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will not be 
+     closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
+    if(fcb->streamfunc)
+      devread = fcb->streamfunc->Read;
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -167,18 +218,15 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will not be 
+     closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+    if(fcb->streamfunc)
+      devwrite = fcb->streamfunc->Write;
 
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
@@ -193,21 +241,181 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/* Check the segments of a ReadV/WriteV call */
+static int iovec_legal(const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOVEC || (iov == NULL && iovcnt > 0)) return 0;
+
+  uint64_t total = 0;
+  for(unsigned int i = 0; i < iovcnt; i++)
+    total += iov[i].size;
+  return total <= INT_MAX;
+}
+
+
+/*
+  Do a ReadV or WriteV on a stream without such a method,
+  with one call per segment.
+ */
+static int iovec_each(FCB* fcb, int write, const iovec_t* iov, unsigned int iovcnt)
+{
+  int total = 0;
+  for(unsigned int i = 0; i < iovcnt; i++) {
+    if(iov[i].size == 0) continue;
+    int rc = write ? fcb->streamfunc->Write(fcb->streamobj, iov[i].buf, iov[i].size)
+                   : fcb->streamfunc->Read(fcb->streamobj, iov[i].buf, iov[i].size);
+    if(rc < 0) return (total > 0) ? total : -1;
+    total += rc;
+    if((unsigned int) rc < iov[i].size) break;
+  }
+  return total;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
+
+  if(! iovec_legal(iov, iovcnt)) return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    file_ops* ops = fcb->streamfunc;
+    if(ops && ops->ReadV)
+      retcode = ops->ReadV(fcb->streamobj, iov, iovcnt);
+    else if(ops && ops->Read)
+      retcode = iovec_each(fcb, 0, iov, iovcnt);
+
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
+
+  if(! iovec_legal(iov, iovcnt)) return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    file_ops* ops = fcb->streamfunc;
+    if(ops && ops->WriteV)
+      retcode = ops->WriteV(fcb->streamobj, iov, iovcnt);
+    else if(ops && ops->Write)
+      retcode = iovec_each(fcb, 1, iov, iovcnt);
+
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
+  kernel_lock_obj(&FT_mutex);
   FCB* fcb = get_fcb(fd);
-
-  if(fcb) {
+  if(fcb)
     CURPROC->FIDT[fd] = NULL;
+  kernel_unlock_obj(&FT_mutex);
+
+  if(fcb)
     retcode = FCB_decref(fcb);    
+
+  return retcode;
+}
+
+
+/* Call the PipeSize method of a stream */
+static int stream_pipe_size(Fid_t fd, unsigned int size)
+{
+  int retcode = -1;
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    if(fcb->streamfunc && fcb->streamfunc->PipeSize)
+      retcode = fcb->streamfunc->PipeSize(fcb->streamobj, size);
+    FCB_decref(fcb);
   }
 
   return retcode;
 }
 
 
+int sys_SetPipeSize(Fid_t fd, unsigned int size)
+{
+  if(size == 0) return -1;
+  return stream_pipe_size(fd, size);
+}
+
+
+int sys_GetPipeSize(Fid_t fd)
+{
+  return stream_pipe_size(fd, 0);
+}
+
+
+/* Return the pipe that a stream reads from (or writes to), if any */
+static PIPE_CB* stream_pipe(FCB* fcb, int write)
+{
+  if(fcb->streamfunc->Pipe)
+    return fcb->streamfunc->Pipe(fcb->streamobj, write);
+  return NULL;
+}
+
+
+/* 
+  Move (or copy, if keep is set) data between two streams, at least one 
+  of which is a pipe. 
+ */
+static int stream_splice(Fid_t fd_in, Fid_t fd_out, unsigned int size, int keep)
+{
+  int retcode = -1;
+  FCB* in = get_fcb_ref(fd_in);
+  FCB* out = get_fcb_ref(fd_out);
+
+  if(in && out && in->streamfunc && out->streamfunc) {
+    PIPE_CB* inpipe = stream_pipe(in, 0);
+    PIPE_CB* outpipe = stream_pipe(out, 1);
+
+    /* A pipe end (or socket) that cannot be used in this direction is an error, not a device */
+    int indev = (in->streamfunc->Pipe == NULL);
+    int outdev = (out->streamfunc->Pipe == NULL);
+
+    if(inpipe && outpipe)
+      retcode = pipe_splice(inpipe, outpipe, size, keep);
+    else if(inpipe && outdev && !keep)
+      retcode = pipe_splice_to(inpipe, out->streamobj, out->streamfunc->Write, size);
+    else if(outpipe && indev && !keep)
+      retcode = pipe_splice_from(outpipe, in->streamobj, in->streamfunc->Read, size);
+  }
+
+  if(in) FCB_decref(in);
+  if(out) FCB_decref(out);
+
+  return retcode;
+}
+
+
+int sys_Splice(Fid_t fd_in, Fid_t fd_out, unsigned int size)
+{
+  return stream_splice(fd_in, fd_out, size, 0);
+}
+
+
+int sys_Tee(Fid_t fd_in, Fid_t fd_out, unsigned int size)
+{
+  return stream_splice(fd_in, fd_out, size, 1);
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
@@ -221,18 +429,27 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
+  kernel_lock_obj(&FT_mutex);
+
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
 
   if(old==NULL) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
-    FCB_incref(old);
+    old->refcount++;
     CURPROC->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+
+  kernel_unlock_obj(&FT_mutex);
+
+  /* The replaced stream is released outside FT_mutex */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -281,3 +498,138 @@ Fid_t sys_OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+
+/*
+ *
+ *   Poll
+ *
+ */
+
+
+void poll_queue_init(poll_queue* pq)
+{
+  pq->lock = (Spinlock) SPINLOCK_INIT;
+  rlnode_init(&pq->waiters, NULL);
+}
+
+
+/*
+  The poll queue and poll table spinlocks are also taken by interrupt
+  handlers, so they are always locked with preemption off.
+ */
+void poll_wait(poll_table* pt, poll_queue* pq)
+{
+  if(pt == NULL) return;
+
+  assert(pt->count < MAX_FILEID);
+  poll_entry* pe = & pt->entries[pt->count++];
+  pe->queue = pq;
+  pe->table = pt;
+  rlnode_init(& pe->node, pe);
+
+  int pre = preempt_off;
+  spin_lock(& pq->lock);
+  rlist_push_back(& pq->waiters, & pe->node);
+  spin_unlock(& pq->lock);
+  if(pre) preempt_on;
+
+  /* The caller checks the state of the object next; see poll_wakeup */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void poll_wakeup(poll_queue* pq)
+{
+  /* 
+    The state of the object has changed before this. A table that is not
+    in the queue yet will be added before its thread checks the state.
+   */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(is_rlist_empty(& pq->waiters)) return;
+
+  int pre = preempt_off;
+  spin_lock(& pq->lock);
+  for(rlnode* n = pq->waiters.next; n != & pq->waiters; n = n->next) {
+    poll_table* pt = ((poll_entry*) n->obj)->table;
+    spin_lock(& pt->lock);
+    pt->woken = 1;
+    Cond_Signal(& pt->woken_cv);
+    spin_unlock(& pt->lock);
+  }
+  spin_unlock(& pq->lock);
+  if(pre) preempt_on;
+}
+
+
+/* Remove a poll table from all the queues it was added to */
+static void poll_table_clear(poll_table* pt)
+{
+  int pre = preempt_off;
+  for(unsigned int i = 0; i < pt->count; i++) {
+    poll_queue* pq = pt->entries[i].queue;
+    spin_lock(& pq->lock);
+    rlist_remove(& pt->entries[i].node);
+    spin_unlock(& pq->lock);
+  }
+  pt->count = 0;
+  if(pre) preempt_on;
+}
+
+
+/* Return the events that a stream is ready for, adding pt to its poll queues */
+static int stream_poll(FCB* fcb, poll_table* pt)
+{
+  if(fcb == NULL)
+    return POLL_INVALID;
+  if(fcb->streamfunc && fcb->streamfunc->Poll)
+    return fcb->streamfunc->Poll(fcb->streamobj, pt);
+  return POLL_READ | POLL_WRITE;
+}
+
+
+int sys_Poll(pollfd_t* fds, unsigned int n, timeout_t timeout)
+{
+  if(n > MAX_FILEID || (fds == NULL && n > 0)) return -1;
+
+  /* Pin the streams, so that they are not closed while we are polling them */
+  FCB* fcb[MAX_FILEID];
+  for(unsigned int i = 0; i < n; i++)
+    fcb[i] = (fds[i].fd == NOFILE) ? NULL : get_fcb_ref(fds[i].fd);
+
+  /* A negative timeout means "for ever" */
+  TimerDuration deadline = ((long) timeout < 0) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+
+  poll_table pt = { .lock = SPINLOCK_INIT, .woken_cv = COND_INIT, .woken = 0, .count = 0 };
+  int ready;
+
+  for(;;) {
+    /* Once a stream is ready, we will not sleep, so there is no need to add pt to queues */
+    ready = 0;
+    for(unsigned int i = 0; i < n; i++) {
+      fds[i].revents = 0;
+      if(fds[i].fd == NOFILE) continue;
+
+      int events = stream_poll(fcb[i], ready ? NULL : &pt);
+      fds[i].revents = events & (fds[i].events | POLL_HANGUP | POLL_INVALID);
+      if(fds[i].revents) ready++;
+    }
+    if(ready || timeout == 0) break;
+
+    TimerDuration now = bios_clock();
+    if(deadline != NO_TIMEOUT && now >= deadline) break;
+
+    /* Sleep until one of the queues is woken up */
+    kernel_spin_wait(& pt.lock, & pt.woken_cv, & pt.woken, SCHED_POLL,
+      (deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now);
+
+    /* The streams may be polled on different queues next time */
+    poll_table_clear(& pt);
+  }
+  poll_table_clear(& pt);
+
+  for(unsigned int i = 0; i < n; i++)
+    if(fcb[i]) FCB_decref(fcb[i]);
+
+  return ready;
+}
@@ -121,12 +121,101 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	With FINE_GRAINED_LOCKING, the caller must hold @c FT_mutex.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
+/** @brief Translate an fid to an FCB and take a reference to it.
+
+	This is like @ref get_fcb, but the reference count of the returned FCB
+	is increased, so that the stream will not be closed while it is being used.
+	The caller must release the reference with @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+/** @brief Copy the file table of a process to a new process.
+
+	The reference counts of all the copied FCBs are increased.
+
+	@param child the new process
+	@param parent the process whose streams are inherited
+ */
+void FIDT_inherit(PCB* child, PCB* parent);
+
+/** @brief Protects the file table, the FCB free list and the FIDT of every process.
+
+	This is only used with FINE_GRAINED_LOCKING.
+	@see kernel_lock_obj
+ */
+extern Mutex FT_mutex;
+
+
+/** @brief A queue of the threads that poll a stream.
+
+	Streams that can be polled (pipes, sockets and serial devices) have a 
+	poll queue. The @c Poll operation of the stream adds the poll table of
+	the caller to the queue (@ref poll_wait), and the stream calls
+	@ref poll_wakeup when its state changes.
+
+	The queue is protected by its own spinlock, so that it can be woken up by
+	interrupt handlers and outside of the kernel lock.
+ */
+typedef struct poll_queue {
+	Spinlock lock;			/**< @brief Spinlock for @c waiters */
+	rlnode waiters;			/**< @brief List of @c poll_entry nodes */
+} poll_queue;
+
+/** @brief Initialize a poll queue. */
+void poll_queue_init(poll_queue* pq);
+
+/** @brief An entry of a poll table in a poll queue. */
+typedef struct poll_entry {
+	rlnode node;				/**< @brief Node in the @c waiters of @c queue */
+	poll_queue* queue;			/**< @brief The queue */
+	struct poll_table* table;	/**< @brief The table the entry belongs to */
+} poll_entry;
+
+/** @brief The state of a thread in a @c Poll call.
+
+	The table is added to the poll queues of the streams that are polled, and
+	@ref poll_wakeup sets the @c woken flag. The table lives on the stack of
+	the polling thread, which removes it from all the queues before returning.
+ */
+typedef struct poll_table {
+	Spinlock lock;				/**< @brief Spinlock for @c woken */
+	CondVar woken_cv;			/**< @brief Signalled when @c woken is set */
+	int woken;					/**< @brief Set when a queue is woken up */
+	unsigned int count;			/**< @brief The number of used entries */
+	poll_entry entries[MAX_FILEID]; /**< @brief The entries, one per stream */
+} poll_table;
+
+/** @brief Add a poll table to a poll queue.
+
+	This is called by the @c Poll operation of a stream, before it checks
+	its state. A stream adds the table to one queue, which must not be freed
+	while the stream is open. If @c pt is NULL, nothing is done.
+
+	@param pt the poll table of the caller, or NULL
+	@param pq the poll queue
+ */
+void poll_wait(poll_table* pt, poll_queue* pq);
+
+/** @brief Wake up the threads that poll an object.
+
+	This is called when the state of an object changes in a way that may make
+	a stream ready. It may be called with the lock of the object held, and from
+	interrupt handlers.
+
+	@param pq the poll queue of the object
+ */
+void poll_wakeup(poll_queue* pq);
+
 
 /** @} */
 
@@ -12,7 +12,24 @@
  */
 
 
-#define PRE_CALL \
+#ifdef FINE_GRAINED_LOCKING
+
+/* Each kernel object is protected by its own lock (see kernel_cc.h) */
+#define PRE_CALL(NAME)
+#define POST_CALL
+
+#elif defined(LOCK_PROFILING)
+
+/* Each system call is a site of the kernel lock */
+#define PRE_CALL(NAME) \
+kernel_lock_at("kernel:" #NAME);\
+
+#define POST_CALL \
+kernel_unlock();\
+
+#else
+
+#define PRE_CALL(NAME) \
 kernel_lock();\
 
 
@@ -20,13 +37,15 @@ kernel_lock();\
 #define POST_CALL \
 kernel_unlock();\
 
+#endif
+
 
 /* with return */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET NAME SIG \
 {\
 	RET __ret;\
-	PRE_CALL\
+	PRE_CALL(NAME)\
 	__ret = sys_##NAME ARGS;\
 	POST_CALL\
 	return __ret;\
@@ -36,7 +55,7 @@ RET NAME SIG \
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
 {\
-	PRE_CALL\
+	PRE_CALL(NAME)\
 	sys_##NAME ARGS;\
 	POST_CALL\
 }\
@@ -6,11 +6,13 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(ExecEx, int, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
@@ -20,15 +22,23 @@ SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
+SYSCALL(WriteV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(Poll, int, (pollfd_t* fds, unsigned int n, timeout_t timeout), (fds, n, timeout))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(SetPipeSize, int, (Fid_t fd, unsigned int size), (fd, size))\
+SYSCALL(GetPipeSize, int, (Fid_t fd), (fd))\
+SYSCALL(Splice, int, (Fid_t fd_in, Fid_t fd_out, unsigned int size), (fd_in, fd_out, size))\
+SYSCALL(Tee, int, (Fid_t fd_in, Fid_t fd_out, unsigned int size), (fd_in, fd_out, size))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenLockInfo, Fid_t, (), ())\
 
 
 
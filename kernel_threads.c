@@ -9,8 +9,21 @@
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadEx(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, unsigned int stack_size)
+{
+  size_t ssize = thread_stack_size(stack_size);
+  if (ssize == 0) return NOTHREAD;
+
+  kernel_lock_obj(&PT_mutex);
+
   /*Create a TCB and a PTCB and initialize them*/
-  TCB* tcb = spawn_thread(CURPROC, start_thread);
+  TCB* tcb = spawn_thread(CURPROC, start_thread, ssize);
   PTCB* ptcb = init_ptcb(task, argl, args);
 
   /*Connect ptcb and tcb together*/
@@ -23,6 +36,8 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   */
   rlist_push_back(&CURPROC->ptcb_list, &ptcb->ptcb_list_node);
   CURPROC->thread_count++;
+  kernel_unlock_obj(&PT_mutex);
+
   /*START RUNNING*/
   wakeup(tcb);
 
@@ -42,23 +57,26 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 { 
+  int retval = -1;
+  kernel_lock_obj(&PT_mutex);
+
   /*Check to see thread exists*/
   rlnode* tempnode = rlist_find(&CURPROC->ptcb_list, (PTCB*) tid, NULL);
-	if (tempnode == NULL) return -1;
+	if (tempnode == NULL) goto finish;
 
   PTCB* joinedptcb = (PTCB*) tid;
 
-  if (joinedptcb->detached || joinedptcb == CURPTCB) return -1;
+  if (joinedptcb->detached || joinedptcb == CURPTCB) goto finish;
   /*hawk tuah wait on that thang*/
   joinedptcb->refcount++;
   while(!(joinedptcb->exited || joinedptcb->detached)) {
-    kernel_wait(&joinedptcb->exit_cv, SCHED_USER);
+    kernel_wait(&PT_mutex, &joinedptcb->exit_cv, SCHED_USER);
   }
   joinedptcb->refcount--;
 
   /*We can't go on if the thread is not exited*/
   if (joinedptcb->detached == 1){
-    return -1;
+    goto finish;
   }
   /*return the exit value*/
   if (exitval) (*exitval = joinedptcb->exitval);
@@ -67,7 +85,11 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     rlist_remove(&joinedptcb->ptcb_list_node);
     free(joinedptcb);
   }
-  return 0;
+  retval = 0;
+
+finish:
+  kernel_unlock_obj(&PT_mutex);
+  return retval;
 }
 
 /**
@@ -75,25 +97,31 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
+  int retval = -1;
+  kernel_lock_obj(&PT_mutex);
+
   /*Check if tid exists*/
   rlnode* node = rlist_find(&CURPROC->ptcb_list, (PTCB*) tid, NULL);
-  if (node == NULL) return -1;
+  if (node == NULL) goto finish;
 
   PTCB* ptcb = node->ptcb;
-  if (ptcb->exited == 1) return -1;
+  if (ptcb->exited == 1) goto finish;
   
   /*detach the thread*/
   ptcb->detached = 1;
 
   /*clear its waitset*/
   kernel_broadcast(&ptcb->exit_cv);
+  retval = 0;
 
-  return 0;
+finish:
+  kernel_unlock_obj(&PT_mutex);
+  return retval;
 }
 
 
 
-/* Terminates the currently running thread*/
+/* Terminates the currently running thread. Called with PT_mutex held */
 void kill_curr_thread(int exitval) {
   /*Steal his exitval and kill it (batman lore ptcb)*/
   PTCB* curptcb = CURPTCB;
@@ -109,6 +137,15 @@ void kill_curr_thread(int exitval) {
 void clean_process() {
   PCB* curproc = CURPROC;
 
+  /* 
+    Close files first: closing a stream takes the stream locks,
+    which must not be nested inside PT_mutex.
+   */
+  for(int i=0;i<MAX_FILEID;i++)
+    sys_Close(i);
+
+  kernel_lock_obj(&PT_mutex);
+
   /*Clear the PTCB list*/
   while(!is_rlist_empty(&curproc->ptcb_list)) {
     PTCB* temp_ptcb = rlist_pop_front(&curproc->ptcb_list)->ptcb;
@@ -141,7 +178,7 @@ void clean_process() {
   assert(is_rlist_empty(& curproc->exited_list));
 
   /* 
-    Do all the other cleanup we want here, close files etc. 
+    Do all the other cleanup we want here. 
    */
 
   /* Release the args data */
@@ -150,19 +187,13 @@ void clean_process() {
     curproc->args = NULL;
   }
 
-  /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
-
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
 
   /* Now, mark the process as exited. */
   curproc->pstate = ZOMBIE;
+
+  kernel_unlock_obj(&PT_mutex);
 }
 
 /**
@@ -170,10 +201,12 @@ void clean_process() {
   */
 void sys_ThreadExit(int exitval)
 {
+  kernel_lock_obj(&PT_mutex);
   kill_curr_thread(exitval);
-  CURPROC->thread_count--;
+  int last_thread = (--CURPROC->thread_count == 0);
+  kernel_unlock_obj(&PT_mutex);
 
-  if (CURPROC->thread_count == 0) {
+  if (last_thread) {
     clean_process();
   }
 
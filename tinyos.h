@@ -66,17 +66,78 @@ typedef uintptr_t Tid_t;
  *      Concurrency control
  *******************************************/
 
+/** @brief A spinlock.
+
+    Spinlocks protect the internals of mutexes and condition variables, and
+    short critical sections of the kernel, such as the scheduler queues. 
+    Programs should use a @c Mutex instead.
+
+    By default, a spinlock is a test-and-set lock. The kernel can be built 
+    with queue locks instead (see the Makefile): ticket locks (SPINLOCK_TICKET),
+    or MCS locks (SPINLOCK_MCS), where the spinlock points to the last 
+    waiter in its queue, and to the waiter that follows the holder.
+
+    @see SPINLOCK_INIT
+*/
+#if defined(SPINLOCK_MCS)
+typedef struct {
+  void* tail;             /**< The last waiter, or the lock itself if there are none */
+  void* next;             /**< The waiter after the holder */
+} Spinlock;
+#elif defined(SPINLOCK_TICKET)
+typedef struct {
+  unsigned short owner;   /**< The ticket that holds the lock */
+  unsigned short next;    /**< The next ticket to hand out */
+} Spinlock;
+#else
+typedef char Spinlock;
+#endif
+
+/**
+  @brief This macro is used to initialize spinlocks. 
+
+  To assign it to a spinlock, use it as a compound literal:
+  @code
+   my_spinlock = (Spinlock) SPINLOCK_INIT;
+  @endcode
+ */
+#if defined(SPINLOCK_MCS)
+#define SPINLOCK_INIT { NULL, NULL }
+#elif defined(SPINLOCK_TICKET)
+#define SPINLOCK_INIT { 0, 0 }
+#else
+#define SPINLOCK_INIT 0
+#endif
+
+
 /** @brief A mutex is used to provide mutual exclusion. 
   
     Mutexes are used extensively to surround critical sections. The TinyOS
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A thread that finds the mutex locked spins for a while, as long as the owner
+    is running on another core, and then sleeps in the @c waitset of the mutex.
+    When the owner unlocks the mutex, it releases it and wakes up the first 
+    thread of the waitset, which competes for the mutex with the running threads.
+    Only if that thread has waited for a while (a tenth of a quantum), the mutex
+    is handed over to it, so that waiters cannot starve.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  char locked;            /**< 0 if unlocked, 1 if locked, 2 if locked and `waitset` may be non-empty */
+  Spinlock waitset_lock;  /**< A spinlock to protect `waitset` */
+  unsigned int owner_core;  /**< The core the owner was running on when it locked the mutex */
+  void *owner;            /**< The thread that holds the mutex */
+  void *waitset;          /**< The set of waiting threads */
+#ifdef LOCK_PROFILING
+  void *site;             /**< The profile of the site that locked the mutex */
+  unsigned long since;    /**< The time the mutex was locked, in nsec */
+#endif
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,14 +147,15 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, SPINLOCK_INIT, 0, NULL, NULL })
 
 
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
-  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
+  in kernel-space (preemptive domain), the caller spins while the owner runs on 
+  another core, and sleeps otherwise. In scheduler space (non-preemptive domain), 
+  the mutex lock operation is pure spinlock.
 
   @see Mutex
   @see Mutex_Unlock
@@ -101,9 +163,19 @@ typedef char Mutex;
   */
 void Mutex_Lock(Mutex*);
 
+#ifdef LOCK_PROFILING
+/* With lock profiling, every call of Mutex_Lock records its site (see OpenLockInfo) */
+void Mutex_Lock_at(Mutex* mx, const char* site);
+#define __MUTEX_LINE(line) #line
+#define __MUTEX_SITE(line) __FILE__ ":" __MUTEX_LINE(line)
+#define Mutex_Lock(mx) Mutex_Lock_at((mx), __MUTEX_SITE(__LINE__))
+#endif
+
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. If there are threads waiting for the
+    mutex, the first of them is woken up, to compete for the mutex. If it has 
+    waited for a while (a tenth of a quantum), the mutex is handed over to it.
     @see Mutex
     @see Mutex_Lock
 */
@@ -122,7 +194,7 @@ void Mutex_Unlock(Mutex*);
  */
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
-  Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  Spinlock waitset_lock;   /**< A spinlock to protect `waitset` */
 } CondVar;
 
 
@@ -133,7 +205,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, SPINLOCK_INIT })
 
 
 /** @brief Wait on a condition variable. 
@@ -202,6 +274,151 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief A reader-writer lock.
+
+  A reader-writer lock can be held by many readers at once, or by a single
+  writer. It is used to protect data that is read much more often than it 
+  is changed.
+
+  The lock is granted in FIFO order: a reader that arrives while a writer 
+  waits will wait too, so that writers are not starved by the readers. When 
+  the lock is released, it is handed over to the first waiting writer, or to 
+  all the readers at the front of the queue, which proceed in parallel. Only
+  these threads are woken up.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  unsigned int state;     /**< The number of readers, and bits for a writer and for waiters */
+  Spinlock waitset_lock;  /**< A spinlock to protect `waitset` */
+  void *waitset;          /**< The set of waiting threads */
+} RWLock;
+
+/**
+  @brief This macro is used to initialize reader-writer locks. 
+
+  @code
+   RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ 0, SPINLOCK_INIT, NULL })
+
+/** @brief Lock a reader-writer lock for reading, waiting as long as it takes. */
+void RWLock_ReadLock(RWLock*);
+
+/** @brief Unlock a reader-writer lock that you locked for reading. */
+void RWLock_ReadUnlock(RWLock*);
+
+/** @brief Lock a reader-writer lock for writing, waiting as long as it takes. */
+void RWLock_WriteLock(RWLock*);
+
+/** @brief Unlock a reader-writer lock that you locked for writing. */
+void RWLock_WriteUnlock(RWLock*);
+
+
+/** @brief A counting semaphore.
+
+  The value of a semaphore is decreased by @c Sem_Wait, which waits while 
+  the value is 0, and it is increased by @c Sem_Post. If threads wait, 
+  @c Sem_Post hands the unit over to the first of them, and wakes it up 
+  alone. A semaphore may be posted by the kernel (e.g., an interrupt handler).
+
+  @see Sem_Wait
+  @see Sem_Post
+  @see SEMAPHORE_INIT
+ */
+typedef struct {
+  int value;              /**< The value, or -1 if it is 0 and threads wait */
+  Spinlock waitset_lock;  /**< A spinlock to protect `waitset` */
+  void *waitset;          /**< The set of waiting threads */
+} Semaphore;
+
+/**
+  @brief This macro is used to initialize a semaphore to value @c n >= 0. 
+
+  @code
+   Semaphore my_sem = SEMAPHORE_INIT(4);
+  @endcode
+ */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), SPINLOCK_INIT, NULL })
+
+/** @brief Decrease the value of a semaphore, waiting while it is 0. */
+void Sem_Wait(Semaphore*);
+
+/** @brief Decrease the value of a semaphore, waiting for a limited time.
+
+  @param sem the semaphore
+  @param timeout the time in milliseconds to wait, 0 to only check the value,
+    or a negative value (e.g., -1) to wait for ever
+  @returns 1 if the value was decreased, 0 if the timeout expired
+ */
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout);
+
+/** @brief Increase the value of a semaphore, or wake up a thread waiting on it. */
+void Sem_Post(Semaphore*);
+
+
+/** @brief A set of event flags.
+
+  Event flags are the bits of an unsigned int. Threads wait for any or all
+  of a set of flags to be set, and optionally clear (consume) them when they
+  do. Setting flags wakes up only the waiters whose condition is met, in FIFO
+  order, so a waiter that consumes a flag is not followed by threads that 
+  will not find it. Flags may be set by the kernel (e.g., an interrupt handler).
+
+  @see Event_Wait
+  @see Event_Set
+  @see EVENT_INIT
+ */
+typedef struct {
+  unsigned int flags;     /**< The flags that are set */
+  Spinlock waitset_lock;  /**< A spinlock to protect `waitset` */
+  void *waitset;          /**< The set of waiting threads */
+} EventFlags;
+
+/**
+  @brief This macro is used to initialize event flags, with no flag set. 
+
+  @code
+   EventFlags my_events = EVENT_INIT;
+  @endcode
+ */
+#define EVENT_INIT ((EventFlags){ 0, SPINLOCK_INIT, NULL })
+
+/** @brief Wait until any of the flags of the mask is set (the default). */
+#define EVENT_ANY   0
+/** @brief Wait until all the flags of the mask are set. */
+#define EVENT_ALL   1
+/** @brief Clear the flags of the mask that were waited for, on return. */
+#define EVENT_CLEAR 2
+
+/** @brief Wait for event flags.
+
+  @param ev the event flags
+  @param mask the flags to wait for
+  @param mode @c EVENT_ANY or @c EVENT_ALL, possibly or-ed with @c EVENT_CLEAR
+  @param timeout the time in milliseconds to wait, 0 to only check the flags,
+    or a negative value (e.g., -1) to wait for ever
+  @returns the flags of @c mask that were set (before clearing them), or 0 if 
+    the timeout expired
+ */
+unsigned int Event_Wait(EventFlags* ev, unsigned int mask, int mode, timeout_t timeout);
+
+/** @brief Set event flags, waking up the threads whose wait is over. 
+
+  @returns the flags that were set before the call
+ */
+unsigned int Event_Set(EventFlags* ev, unsigned int mask);
+
+/** @brief Clear event flags.
+
+  @returns the flags that were set before the call
+ */
+unsigned int Event_Clear(EventFlags* ev, unsigned int mask);
+
+
 /*******************************************
  *
  * Process creation
@@ -240,6 +457,36 @@ typedef int (*Task)(int, void*);
   */
 Pid_t Exec(Task task, int argl, void* args);
 
+/** @brief The minimum size of a thread stack, in bytes. */
+#define MIN_STACK_SIZE (32 * 1024)
+
+/** @brief The maximum size of a thread stack, in bytes. */
+#define MAX_STACK_SIZE (64 * 1024 * 1024)
+
+/** @brief Create a new process with a given stack size.
+
+  This is like @c Exec, but the main thread of the new process gets a stack
+  of @c stack_size bytes. A size of 0 selects the default stack size; other
+  sizes are raised to @c MIN_STACK_SIZE and rounded up to whole pages.
+
+  Stack memory is only reserved when the thread is created. A page is committed
+  when the thread first touches it, so a thread that does not use its stack
+  costs little memory, whatever its stack size. Touching the page below the
+  stack (e.g., by deep recursion) crashes the program.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the stack size of the main thread, or 0 for the default
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  @c stack_size is larger than @c MAX_STACK_SIZE.
+  @see Exec
+  */
+Pid_t ExecEx(Task task, int argl, void* args, unsigned int stack_size);
+
 
 /** @brief Exit the current process.
 
@@ -319,6 +566,21 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread with a given stack size.
+
+  This is like @c CreateThread, but the new thread gets a stack of 
+  @c stack_size bytes, as described in @c ExecEx. A size of 0 selects
+  the default stack size.
+
+  @param task a function to execute
+  @param stack_size the stack size of the thread, or 0 for the default
+  @returns the Tid of the new thread, or @c NOTHREAD if @c stack_size is
+     larger than @c MAX_STACK_SIZE.
+  @see ExecEx
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -458,6 +720,66 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/**
+  @brief A buffer segment, for scatter/gather I/O.
+
+  An array of these describes the buffers passed to @c ReadV() and @c WriteV().
+  @see ReadV
+  @see WriteV
+ */
+typedef struct iovec_s {
+	char* buf;			/**< The start of the segment */
+	unsigned int size;	/**< The size of the segment in bytes */
+} iovec_t;
+
+/** @brief The maximum number of segments in a @c ReadV() or @c WriteV() call. */
+#define MAX_IOVEC 1024
+
+
+/** @brief Read bytes from a stream into several buffers.
+
+  This call is like @c Read() into a single buffer of the total size, whose
+  bytes are then scattered to the segments of @c iov in order: each segment is
+  filled before the next one is used. Pipes, sockets and devices fill all the
+  segments in one call, so the result is the same as a @c Read() of the
+  total size.
+
+  Segments of size 0 are allowed and skipped.
+
+  @param fd  the file ID of the stream to read from
+  @param iov an array of @c iovcnt segments
+  @param iovcnt the number of segments, at most @c MAX_IOVEC
+  @return the number of bytes copied, 0 if we have reached EOF, or -1, indicating some error.
+        Possible errors are:
+         - The file descriptor is invalid.
+         - @c iovcnt is greater than @c MAX_IOVEC, or the total size does
+           not fit in an @c int.
+         - There was a I/O runtime problem.
+  @see Read
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from several buffers.
+
+  This call is like @c Write() from a single buffer, which holds the bytes of
+  the segments of @c iov in order. For example, a message header and its
+  payload can be written with one call, and arrive at a pipe together.
+
+  @param fd  the file ID of the stream to write to
+  @param iov an array of @c iovcnt segments
+  @param iovcnt the number of segments, at most @c MAX_IOVEC
+  @return the number of bytes copied, or -1 on error.
+        Possible errors are:
+         - The file descriptor is invalid.
+         - @c iovcnt is greater than @c MAX_IOVEC, or the total size does
+           not fit in an @c int.
+         - There was a I/O runtime problem.
+  @see Write
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
 /** @brief Close a file id.
    
 
@@ -489,6 +811,53 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/**
+  @brief Stream events, for @c Poll().
+
+  The events are bit flags, and can be combined with '|'.
+  @see Poll
+ */
+typedef enum poll_event_e {
+	POLL_READ = 1,		/**< @c Read() (or @c Accept() for a listening socket) will not block */
+	POLL_WRITE = 2,		/**< @c Write() will not block */
+	POLL_HANGUP = 4,	/**< The other end of a pipe or connection is closed (reported only) */
+	POLL_INVALID = 8	/**< The file id is not open (reported only) */
+} poll_event;
+
+/**
+  @brief A stream to be watched by @c Poll().
+ */
+typedef struct pollfd_s {
+	Fid_t fd;			/**< The file id to watch, or @c NOFILE to ignore this entry */
+	int events;			/**< The events of interest, @c POLL_READ and/or @c POLL_WRITE */
+	int revents;		/**< The events that occurred, filled by @c Poll() */
+} pollfd_t;
+
+/**
+  @brief Wait for one of several streams to become ready.
+
+  For each entry of @c fds, the call checks whether the stream @c fd is ready
+  for the @c events of the entry, and stores the events that occurred in @c revents.
+  If no stream is ready, the calling thread sleeps until one of them becomes ready,
+  or the timeout expires. The events @c POLL_HANGUP and @c POLL_INVALID are
+  always reported, and an entry with @c fd equal to @c NOFILE is ignored.
+
+  Pipes, sockets and terminals wake up the thread when their state changes, so
+  that a single thread can serve many streams. A listening socket is ready for
+  reading when a connection request can be accepted. Other streams (such as
+  the null device) are always ready.
+
+  @param fds an array of @c n entries
+  @param n the number of entries, at most @c MAX_FILEID
+  @param timeout the time in milliseconds to wait, 0 to only check the streams,
+    or a negative value (e.g., -1) to wait for ever
+  @return the number of entries with a nonzero @c revents, 0 if the timeout expired,
+    or -1 on error. Possible reasons for error:
+     - @c n is greater than @c MAX_FILEID
+ */
+int Poll(pollfd_t* fds, unsigned int n, timeout_t timeout);
+
 /*******************************************
  *
  * Pipes
@@ -531,6 +900,84 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+/**
+	@brief The maximum capacity of a pipe, in bytes.
+*/
+#define PIPE_MAX_SIZE (1 << 20)
+
+/**
+	@brief Set the capacity of a pipe.
+
+	The buffer of the pipe (or socket) accessed by @c fd is resized to hold
+	at least @c size bytes. The capacity is rounded up to a power of two, and it
+	is never less than the default capacity of a pipe. The capacity can be
+	increased to ease streaming, and decreased again to release memory.
+
+	If @c fd is a connected socket, both directions of the connection are resized,
+	and the capacity of the direction that @c fd reads from is reported.
+	If it is a socket that is not yet connected, the capacity will be used for the
+	pipes created when the socket connects (or, for a listening socket, when
+	it accepts a connection).
+
+	@param fd the file id of either end of a pipe, or of a socket
+	@param size the requested capacity in bytes
+	@returns the new capacity, or -1 on error. Possible reasons for error:
+		- @c fd is not a pipe or a socket
+		- @c size is 0 or greater than @c PIPE_MAX_SIZE
+		- the pipe holds more than @c size unread bytes
+*/
+int SetPipeSize(Fid_t fd, unsigned int size);
+
+/**
+	@brief Return the capacity of a pipe.
+
+	@param fd the file id of either end of a pipe, or of a socket
+	@returns the capacity in bytes, or -1 if @c fd is not a pipe or a socket.
+	@see SetPipeSize
+*/
+int GetPipeSize(Fid_t fd);
+
+/**
+	@brief Move data from one stream to another, without a user buffer.
+
+	Up to @c size bytes are read from @c fd_in and written to @c fd_out,
+	as if by @c Read() into a buffer followed by @c Write() of the bytes read,
+	but the data are copied directly between the kernel buffers. 
+
+	At least one of the two streams must be the end of a pipe or a connected
+	socket. The other one may also be a device stream, such as a
+	serial terminal.
+	Like @c Read(), the call blocks until some data is available at @c fd_in, and
+	then moves as many bytes as can be moved at once; it may return fewer bytes 
+	than @c size, but at least 1.
+
+	@param fd_in the file id to read from
+	@param fd_out the file id to write to
+	@param size the maximum number of bytes to move
+	@returns the number of bytes moved, 0 if @c fd_in is at end of data, 
+	    or -1 on error. Possible reasons for error:
+		- either file id is invalid, or they refer to the same pipe
+		- neither stream is a pipe or a connected socket
+		- reading from @c fd_in or writing to @c fd_out is not possible
+*/
+int Splice(Fid_t fd_in, Fid_t fd_out, unsigned int size);
+
+/**
+	@brief Copy data from one pipe to another, without consuming it.
+
+	This call is like @c Splice(), but the bytes copied to @c fd_out remain
+	unread in @c fd_in, where a subsequent @c Read() or @c Splice() will
+	return them again. Both streams must be ends of pipes or connected sockets.
+
+	@param fd_in the file id to copy from
+	@param fd_out the file id to write to
+	@param size the maximum number of bytes to copy
+	@returns the number of bytes copied, 0 if @c fd_in is at end of data, 
+	    or -1 on error. 
+	@see Splice
+*/
+int Tee(Fid_t fd_in, Fid_t fd_out, unsigned int size);
+
 /*******************************************
  *
  * Sockets (local)
@@ -736,6 +1183,15 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  unsigned long stack_size; /**< @brief The total stack size of the current threads, in bytes. */
+
+  unsigned long stack_used; /**< @brief The stack memory committed by the current threads, in bytes.
+
+    This counts the stack pages that are resident in memory. A page is committed when
+    a thread first touches it, and stays committed until the thread exits, so this is 
+    the peak stack usage of the threads. Since thread stacks are reused, a new thread
+    may also have pages that a previous thread committed. */
 } procinfo;
 
 
@@ -760,6 +1216,56 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/** @brief The max. size of the site name of a lockinfo structure, including the final 0. */
+#define LOCKINFO_NAME_SIZE 48
+
+/** @brief The number of buckets in the hold time histogram of a lockinfo structure. */
+#define LOCKINFO_HIST 20
+
+/**
+  @brief The profile of a lock site.
+
+  A lock site is a call of @c Mutex_Lock (named by its file and line), or 
+  a system call that locks the kernel (named as "kernel:" followed by the 
+  system call). Times are in nsec.
+
+  This structure is returned by lock information streams.
+  @see OpenLockInfo
+ */
+typedef struct lockinfo
+{
+  char name[LOCKINFO_NAME_SIZE];  /**< @brief The name of the site (possibly truncated). */
+  unsigned long acquisitions;     /**< @brief The number of times the lock was taken. */
+  unsigned long contended;        /**< @brief The number of times the lock had to be waited for. */
+  unsigned long spins;            /**< @brief The spin iterations while waiting. */
+  unsigned long yields;           /**< @brief The times a waiter slept or yielded the core. */
+  unsigned long wait_time;        /**< @brief The total time spent waiting. */
+  unsigned long hold_time;        /**< @brief The total time the lock was held. */
+  unsigned long hold_hist[LOCKINFO_HIST]; /**< @brief The histogram of the hold times.
+
+    Bucket 0 counts the holds shorter than 256 nsec, and every next bucket 
+    doubles the limit. The last bucket counts all the longer holds. */
+} lockinfo;
+
+/**
+  @brief Open a lock information stream.
+
+  This is a read-only stream that returns a sequence of @c lockinfo structures,
+  one per lock site, each packed into a block of size @c sizeof(lockinfo).
+  Each read must ask for at least @c sizeof(lockinfo) bytes.
+
+  Lock sites are only profiled when the kernel is built with LOCK_PROFILING 
+  (make LOCKPROF=1). The counters start when the VM boots, and they are also 
+  printed when it stops.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the kernel was not built with lock profiling.
+    - the available file ids for the process are exhausted.
+ */
+Fid_t OpenLockInfo();
+
+
 
 
 /*******************************************
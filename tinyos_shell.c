@@ -172,8 +172,8 @@ int SystemInfo(size_t argc, const char** argv)
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
 		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		printf("%5s %5s %6s %8s %9s %9s %20s\n",
+			"PID", "PPID", "State", "Threads", "Stack(K)", "Used(K)", "Main program"
 			);
 		/* Read in next piece of info */		
 		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
@@ -189,11 +189,13 @@ int SystemInfo(size_t argc, const char** argv)
 				if(info.pid==1) pname = "init";
 			}
 
-			printf("%5d %5d %6s %8u %20s\n",
+			printf("%5d %5d %6s %8lu %9lu %9lu %20s\n",
 				info.pid,
 				info.ppid,
 				(info.alive?"ALIVE":"ZOMBIE"),
 				info.thread_count,
+				info.stack_size/1024,
+				info.stack_used/1024,
 				pname
 				);
 		}
@@ -759,15 +761,9 @@ int RemoteClient(size_t argc, const char** argv)
 	send_message(sock, args, argl);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
-	/* Read the server data and display */
-	char c;
-	FILE* fin = fidopen(sock, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(c, fout);
-	}
-	fclose(fin);
-	fclose(fout);
+	/* Relay the server data to stdout, without copying it through user space */
+	while(Splice(sock, 1, 4096) > 0);
+	Close(sock);
 	return 0;
 }
 
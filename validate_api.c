@@ -510,6 +510,368 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
+/*
+	Test that waiters signalled while the mutex is held (and moved to the mutex)
+	stay signalled when their timeout expires, and lock the mutex one by one.
+ */
+struct requeue_test {
+	Mutex mx;
+	CondVar cv, pcv;
+	int waiting, inside, signalled;
+};
+
+static int requeue_waiter(int argl, void* args)
+{
+	struct requeue_test* T = args;
+	Mutex_Lock(&T->mx);
+	T->waiting++;
+	Cond_Signal(&T->pcv);
+	int sig = Cond_TimedWait(&T->mx, &T->cv, 300);
+	ASSERT(++T->inside == 1);
+	T->signalled += sig;
+	for(volatile int j=0; j<10000; j++);
+	T->inside--;
+	Mutex_Unlock(&T->mx);
+	return 0;
+}
+
+BOOT_TEST(test_cond_broadcast_mutex_held,
+	"Test that the waiters of a broadcast made with the mutex held are signalled,\n"
+	"even if their timeout expires before the mutex is unlocked."
+	)
+{
+	const int N = 20;
+	struct requeue_test T = { .mx = MUTEX_INIT, .cv = COND_INIT, .pcv = COND_INIT };
+	Tid_t tids[N];
+
+	for(int i=0; i<N; i++) tids[i] = CreateThread(requeue_waiter, 0, &T);
+
+	Mutex_Lock(&T.mx);
+	while(T.waiting < N) Cond_Wait(&T.mx, &T.pcv);
+	Cond_Broadcast(&T.cv);
+
+	/* Hold the mutex past the timeouts */
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do clock_gettime(CLOCK_MONOTONIC, &t1);
+	while((t1.tv_sec - t0.tv_sec)*1000 + (t1.tv_nsec - t0.tv_nsec)/1000000 < 600);
+	Mutex_Unlock(&T.mx);
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(T.signalled == N);
+	return 0;
+}
+
+
+/*
+	Test that a contended Mutex provides mutual exclusion, when the owner
+	is preempted in the critical section and the other threads sleep.
+ */
+
+struct mutex_counter {
+	Mutex mx;
+	volatile int count;
+	volatile int stop;
+};
+
+static int mutex_incrementer(int argl, void* args)
+{
+	struct mutex_counter* C = args;
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&C->mx);
+		int c = C->count;
+		for(volatile int j=0; j<20000; j++);	/* A long critical section */
+		C->count = c+1;
+		Mutex_Unlock(&C->mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a contended Mutex provides mutual exclusion.",
+	.timeout = 30
+	)
+{
+	struct mutex_counter C = { .mx = MUTEX_INIT, .count = 0 };
+	Tid_t tids[8];
+
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(mutex_incrementer, 500, &C);
+	for(int i=0; i<8; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(C.count == 8*500);
+	return 0;
+}
+
+
+/*
+	Test that a thread waiting for a Mutex gets it, even if another thread
+	unlocks and locks it again all the time.
+ */
+
+static int mutex_hog(int argl, void* args)
+{
+	struct mutex_counter* C = args;
+	while(! C->stop) {
+		Mutex_Lock(&C->mx);
+		C->count++;
+		for(volatile int j=0; j<2000; j++);
+		Mutex_Unlock(&C->mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_no_starvation,
+	"Test that a thread waiting for a Mutex is not starved by a thread that relocks it.",
+	.timeout = 30
+	)
+{
+	struct mutex_counter C = { .mx = MUTEX_INIT, .count = 0, .stop = 0 };
+
+	Tid_t hogs[2];
+	for(int i=0; i<2; i++)
+		hogs[i] = CreateThread(mutex_hog, 0, &C);
+
+	for(int i=0; i<100; i++) {
+		Mutex_Lock(&C.mx);
+		Mutex_Unlock(&C.mx);
+	}
+
+	Mutex_Lock(&C.mx);
+	C.stop = 1;
+	Mutex_Unlock(&C.mx);
+
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadJoin(hogs[i], NULL)==0);
+	return 0;
+}
+
+
+
+/*
+	Tests for reader-writer locks, semaphores and event flags.
+ */
+
+struct rwlock_test {
+	RWLock rw;
+	Semaphore inside, go, done;
+	int readers, writers, errors;
+};
+
+static int rwlock_sharing_reader(int argl, void* args)
+{
+	struct rwlock_test* T = args;
+	RWLock_ReadLock(&T->rw);
+	Sem_Post(&T->inside);
+	Sem_Wait(&T->go);
+	RWLock_ReadUnlock(&T->rw);
+	return 0;
+}
+
+static int rwlock_sharing_writer(int argl, void* args)
+{
+	struct rwlock_test* T = args;
+	RWLock_WriteLock(&T->rw);
+	Sem_Post(&T->done);
+	RWLock_WriteUnlock(&T->rw);
+	return 0;
+}
+
+BOOT_TEST(test_rwlock_readers_share,
+	"Test that readers hold an RWLock at the same time, and a writer waits for them."
+	)
+{
+	struct rwlock_test T = { .rw = RWLOCK_INIT, .inside = SEMAPHORE_INIT(0),
+		.go = SEMAPHORE_INIT(0), .done = SEMAPHORE_INIT(0) };
+	Tid_t tids[5];
+
+	/* All the readers get in */
+	for(int i=0; i<4; i++)
+		tids[i] = CreateThread(rwlock_sharing_reader, 0, &T);
+	for(int i=0; i<4; i++)
+		ASSERT(Sem_TimedWait(&T.inside, 5000));
+
+	/* The writer waits until they are out */
+	tids[4] = CreateThread(rwlock_sharing_writer, 0, &T);
+	ASSERT(Sem_TimedWait(&T.done, 50)==0);
+	for(int i=0; i<4; i++)
+		Sem_Post(&T.go);
+	ASSERT(Sem_TimedWait(&T.done, 5000));
+
+	for(int i=0; i<5; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(T.rw.state == 0);
+	return 0;
+}
+
+
+static int rwlock_exclusion_thread(int argl, void* args)
+{
+	struct rwlock_test* T = args;
+	int writer = (argl % 3 == 0);
+	for(int i=0; i<300; i++) {
+		if(writer) {
+			RWLock_WriteLock(&T->rw);
+			if(T->readers != 0 || T->writers++ != 0) T->errors++;
+			for(volatile int j=0; j<2000; j++);
+			T->writers--;
+			RWLock_WriteUnlock(&T->rw);
+		} else {
+			RWLock_ReadLock(&T->rw);
+			__atomic_fetch_add(&T->readers, 1, __ATOMIC_RELAXED);
+			if(T->writers != 0) __atomic_fetch_add(&T->errors, 1, __ATOMIC_RELAXED);
+			for(volatile int j=0; j<2000; j++);
+			__atomic_fetch_sub(&T->readers, 1, __ATOMIC_RELAXED);
+			RWLock_ReadUnlock(&T->rw);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock_exclusion,
+	"Test that a writer holds an RWLock alone, with readers and writers contending for it.",
+	.timeout = 30
+	)
+{
+	struct rwlock_test T = { .rw = RWLOCK_INIT };
+	Tid_t tids[9];
+	for(int i=0; i<9; i++)
+		tids[i] = CreateThread(rwlock_exclusion_thread, i, &T);
+	for(int i=0; i<9; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(T.errors == 0);
+	ASSERT(T.rw.state == 0);
+	return 0;
+}
+
+
+static int sem_consumer(int argl, void* args)
+{
+	Semaphore* sem = args;
+	for(int i=0; i<argl; i++)
+		Sem_Wait(sem);
+	return 0;
+}
+
+BOOT_TEST(test_semaphore,
+	"Test that a Semaphore counts posts, and that timed waits expire."
+	)
+{
+	Semaphore sem = SEMAPHORE_INIT(2);
+	ASSERT(Sem_TimedWait(&sem, 0)==1);
+	ASSERT(Sem_TimedWait(&sem, 0)==1);
+	ASSERT(Sem_TimedWait(&sem, 0)==0);
+	ASSERT(Sem_TimedWait(&sem, 20)==0);
+	ASSERT(sem.value == 0);
+
+	/* Every post goes to exactly one waiter */
+	Tid_t tids[4];
+	for(int i=0; i<4; i++)
+		tids[i] = CreateThread(sem_consumer, 250, &sem);
+	for(int i=0; i<1001; i++)
+		Sem_Post(&sem);
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(sem.value == 1);
+	ASSERT(Sem_TimedWait(&sem, -1)==1);
+	return 0;
+}
+
+
+struct event_test {
+	EventFlags ev;
+	Semaphore done;
+};
+
+static int event_consumer(int argl, void* args)
+{
+	struct event_test* T = args;
+	unsigned int got = Event_Wait(&T->ev, argl, EVENT_ALL|EVENT_CLEAR, -1);
+	Sem_Post(&T->done);
+	return got;
+}
+
+BOOT_TEST(test_event_flags,
+	"Test that event flags wake up the waiters whose condition holds, and that they\n"
+	"are consumed by EVENT_CLEAR."
+	)
+{
+	struct event_test T = { .ev = EVENT_INIT, .done = SEMAPHORE_INIT(0) };
+
+	ASSERT(Event_Set(&T.ev, 0x1)==0);
+	ASSERT(Event_Wait(&T.ev, 0x3, EVENT_ANY, 0)==0x1);
+	ASSERT(Event_Wait(&T.ev, 0x3, EVENT_ALL, 0)==0);
+	ASSERT(Event_Wait(&T.ev, 0x3, EVENT_ALL, 20)==0);
+	ASSERT(Event_Set(&T.ev, 0x2)==0x1);
+	ASSERT(Event_Wait(&T.ev, 0x3, EVENT_ALL|EVENT_CLEAR, 0)==0x3);
+	ASSERT(Event_Wait(&T.ev, 0x3, EVENT_ANY, 0)==0);
+
+	/* Two threads wait to consume the same flags, one of them gets them */
+	Tid_t t1 = CreateThread(event_consumer, 0x30, &T);
+	Tid_t t2 = CreateThread(event_consumer, 0x30, &T);
+	ASSERT(Sem_TimedWait(&T.done, 50)==0);
+	Event_Set(&T.ev, 0x10);
+	ASSERT(Sem_TimedWait(&T.done, 50)==0);
+	Event_Set(&T.ev, 0x60);
+	ASSERT(Sem_TimedWait(&T.done, 5000)==1);
+	ASSERT(Sem_TimedWait(&T.done, 50)==0);
+	ASSERT(Event_Clear(&T.ev, 0x40)==0x40);
+	Event_Set(&T.ev, 0x30);
+	ASSERT(Sem_TimedWait(&T.done, 5000)==1);
+
+	int got1, got2;
+	ASSERT(ThreadJoin(t1, &got1)==0 && got1==0x30);
+	ASSERT(ThreadJoin(t2, &got2)==0 && got2==0x30);
+	ASSERT(T.ev.flags == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_lock_info,
+	"Test that OpenLockInfo reports the mutex sites when the kernel is profiled,\n"
+	"and returns NOFILE when it is not."
+	)
+{
+	static Mutex mx = MUTEX_INIT;
+	Mutex_Lock(&mx);
+	Mutex_Unlock(&mx);
+
+	Fid_t fid = OpenLockInfo();
+#ifndef LOCK_PROFILING
+	ASSERT(fid == NOFILE);
+#else
+	ASSERT(fid != NOFILE);
+	lockinfo info;
+	char small[8];
+	ASSERT(Read(fid, small, sizeof(small)) == -1);
+
+	int found = 0, kernel = 0;
+	while(Read(fid, (char*) &info, sizeof(info)) == sizeof(info)) {
+		ASSERT(info.acquisitions > 0);
+		ASSERT(info.contended <= info.acquisitions);
+		unsigned long holds = 0;
+		for(int i=0; i<LOCKINFO_HIST; i++) holds += info.hold_hist[i];
+		ASSERT(holds <= info.acquisitions);
+		if(strstr(info.name, "validate_api.c:") != NULL) found = 1;
+		if(strncmp(info.name, "kernel", 6) == 0) kernel = 1;
+	}
+	ASSERT(found);
+#ifdef FINE_GRAINED_LOCKING
+	(void) kernel;
+#else
+	ASSERT(kernel);
+#endif
+	ASSERT(Close(fid) == 0);
+#endif
+	return 0;
+}
+
+
+
 /*********************************************
  *
  *
@@ -900,6 +1262,90 @@ BOOT_TEST(test_write_to_many_terminals,
 }
 
 
+BOOT_TEST(test_readv_writev_null,
+	"Test that ReadV and WriteV work on the null device, and check their arguments."
+	)
+{
+	char a[4] = "abc", b[8] = "defghij";
+	iovec_t iov[3] = { { a, 3 }, { NULL, 0 }, { b, 5 } };
+
+	Fid_t fn = OpenNull();
+	ASSERT(fn!=NOFILE);
+
+	ASSERT(ReadV(fn, iov, 3)==8);
+	ASSERT(memcmp(a, "\0\0\0", 4)==0);
+	ASSERT(memcmp(b, "\0\0\0\0\0ij", 8)==0);
+	ASSERT(WriteV(fn, iov, 3)==8);
+	ASSERT(WriteV(fn, iov, 0)==0);
+
+	ASSERT(ReadV(NOFILE, iov, 3)==-1);
+	ASSERT(WriteV(MAX_FILEID, iov, 3)==-1);
+	ASSERT(ReadV(fn, NULL, 1)==-1);
+	ASSERT(WriteV(fn, iov, MAX_IOVEC+1)==-1);
+
+	/* The total size must fit in an int */
+	iovec_t huge[2] = { { a, 1u << 31 }, { b, 1u << 31 } };
+	ASSERT(WriteV(fn, huge, 2)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_readv_writev_terminal,
+	"Test that ReadV and WriteV scatter and gather the bytes of a terminal.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char head[6] = { 0 }, body[6] = { 0 };
+	iovec_t iov[2] = { { head, 5 }, { body, 5 } };
+
+	sendme(0, "HelloWorld");
+	int n = 0;
+	while(n < 10) {
+		/* Skip the segment bytes that are already read */
+		iovec_t rest[2] = { iov[0], iov[1] };
+		unsigned int skip = n;
+		for(int i=0; i<2; i++) {
+			unsigned int k = (skip < rest[i].size) ? skip : rest[i].size;
+			rest[i].buf += k;  rest[i].size -= k;  skip -= k;
+		}
+		int rc = ReadV(fterm, rest, 2);
+		ASSERT(rc > 0);
+		n += rc;
+	}
+	ASSERT(strcmp(head, "Hello")==0);
+	ASSERT(strcmp(body, "World")==0);
+
+	expect(0, "HelloWorld");
+	ASSERT(WriteV(fterm, iov, 2)==10);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll_terminal,
+	"Test that Poll waits for input on a terminal.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	pollfd_t fds[1] = { { .fd = fterm, .events = POLL_READ } };
+	ASSERT(Poll(fds, 1, 0)==0);
+
+	sendme(0, "Hello");
+	ASSERT(Poll(fds, 1, -1)==1);
+	ASSERT(fds[0].revents==POLL_READ);
+	checked_read(fterm, "Hello");
+
+	fds[0].events = POLL_WRITE;
+	ASSERT(Poll(fds, 1, -1)==1 && fds[0].revents==POLL_WRITE);
+	return 0;
+}
+
+
 
 
 TEST_SUITE(basic_tests, 
@@ -920,6 +1366,14 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_mutex_held,
+	&test_mutex_contention,
+	&test_mutex_no_starvation,
+	&test_rwlock_readers_share,
+	&test_rwlock_exclusion,
+	&test_semaphore,
+	&test_event_flags,
+	&test_lock_info,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -937,6 +1391,9 @@ TEST_SUITE(basic_tests,
 	&test_write_con_big,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
+	&test_readv_writev_null,
+	&test_readv_writev_terminal,
+	&test_poll_terminal,
 	&test_child_inherits_files,
 	NULL
 };
@@ -1397,6 +1854,125 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+/* Read the procinfo of a process. Returns 1 if it was found. */
+static int get_procinfo(Pid_t pid, procinfo* info)
+{
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+	int found = 0;
+	while(!found && Read(finfo, (char*) info, sizeof(procinfo)) == sizeof(procinfo))
+		found = (info->pid == pid);
+	ASSERT(Close(finfo) == 0);
+	return found;
+}
+
+static Mutex stack_mx = MUTEX_INIT;
+static CondVar stack_cv = COND_INIT;
+static int stack_touched, stack_done;
+
+#define STACK_TOUCH (512*1024)
+
+/* Use a large part of the stack, and wait until told to exit */
+static int deep_stack_thread(int argl, void* args)
+{
+	volatile char buf[STACK_TOUCH];
+	memset((char*) buf, argl, sizeof(buf));
+
+	Mutex_Lock(&stack_mx);
+	stack_touched = 1;
+	Cond_Broadcast(&stack_cv);
+	while(! stack_done)
+		Cond_Wait(&stack_mx, &stack_cv);
+	Mutex_Unlock(&stack_mx);
+	return buf[argl];
+}
+
+/* Wait until told to exit */
+static int shallow_stack_thread(int argl, void* args)
+{
+	Mutex_Lock(&stack_mx);
+	while(! stack_done)
+		Cond_Wait(&stack_mx, &stack_cv);
+	Mutex_Unlock(&stack_mx);
+	return argl;
+}
+
+BOOT_TEST(test_create_thread_ex,
+	"Test that CreateThreadEx creates threads with the given stack size, and that\n"
+	"the stack size and the committed stack memory are reported by OpenInfo."
+	)
+{
+	procinfo info;
+
+	ASSERT(CreateThreadEx(deep_stack_thread, 1, NULL, MAX_STACK_SIZE+1) == NOTHREAD);
+
+	ASSERT(get_procinfo(GetPid(), &info));
+	ASSERT(info.thread_count == 1);
+	unsigned long main_stack = info.stack_size;
+	ASSERT(main_stack > 0);
+	ASSERT(info.stack_used > 0 && info.stack_used <= main_stack);
+
+	/* A small stack is raised to the minimum size */
+	stack_touched = stack_done = 0;
+	Tid_t t1 = CreateThreadEx(shallow_stack_thread, 1, NULL, 100);
+	ASSERT(t1 != NOTHREAD);
+
+	/* This thread needs a large stack */
+	Tid_t t2 = CreateThreadEx(deep_stack_thread, 2, NULL, 2*STACK_TOUCH);
+	ASSERT(t2 != NOTHREAD);
+
+	Mutex_Lock(&stack_mx);
+	while(! stack_touched)
+		Cond_Wait(&stack_mx, &stack_cv);
+	Mutex_Unlock(&stack_mx);
+
+	ASSERT(get_procinfo(GetPid(), &info));
+	ASSERT(info.thread_count == 3);
+	ASSERT(info.stack_size == main_stack + MIN_STACK_SIZE + 2*STACK_TOUCH);
+	ASSERT(info.stack_used >= STACK_TOUCH && info.stack_used <= info.stack_size);
+
+	Mutex_Lock(&stack_mx);
+	stack_done = 1;
+	Cond_Broadcast(&stack_cv);
+	Mutex_Unlock(&stack_mx);
+
+	int exitval;
+	ASSERT(ThreadJoin(t1, &exitval) == 0);
+	ASSERT(exitval == 1);
+	ASSERT(ThreadJoin(t2, &exitval) == 0);
+	ASSERT(exitval == 2);
+	return 0;
+}
+
+
+static int report_stack_size(int argl, void* args)
+{
+	procinfo info;
+	ASSERT(get_procinfo(GetPid(), &info));
+	ASSERT(info.stack_used > 0 && info.stack_used <= info.stack_size);
+	return info.stack_size / 1024;
+}
+
+BOOT_TEST(test_exec_ex,
+	"Test that ExecEx creates a process whose main thread has the given stack size."
+	)
+{
+	int status;
+	ASSERT(ExecEx(report_stack_size, 0, NULL, MAX_STACK_SIZE+1) == NOPROC);
+
+	Pid_t pid = ExecEx(report_stack_size, 0, NULL, 256*1024 + 1);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, &status) == pid);
+	ASSERT(status == 256 + 4);
+
+	pid = ExecEx(report_stack_size, 0, NULL, 0);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, &status) == pid);
+	ASSERT(status == 128);
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1415,6 +1991,8 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_create_thread_ex,
+	&test_exec_ex,
 	NULL
 };
 
@@ -1632,6 +2210,357 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+BOOT_TEST(test_pipe_set_size,
+	"Test that the capacity of a pipe can be grown and shrunk with SetPipeSize."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	int cap = GetPipeSize(pipe.read);
+	ASSERT(cap > 0);
+	ASSERT(GetPipeSize(pipe.write)==cap);
+
+	/* Illegal sizes and streams */
+	ASSERT(SetPipeSize(pipe.read, 0)==-1);
+	ASSERT(SetPipeSize(pipe.read, PIPE_MAX_SIZE+1)==-1);
+	ASSERT(GetPipeSize(OpenNull())==-1);
+	ASSERT(GetPipeSize(MAX_FILEID)==-1);
+
+	/* Grow it, so that a single thread can fill it without blocking */
+	const unsigned int N = 100000;
+	ASSERT(SetPipeSize(pipe.write, N) >= N);
+	ASSERT(GetPipeSize(pipe.read) >= N);
+
+	char* buf = malloc(N);
+	for(unsigned int i=0; i<N; i++) buf[i] = i % 251;
+	unsigned int n = 0;
+	while(n < N) {
+		int rc = Write(pipe.write, buf+n, N-n);
+		ASSERT(rc > 0);
+		n += rc;
+	}
+
+	/* Cannot shrink below the buffered data */
+	ASSERT(SetPipeSize(pipe.read, cap)==-1);
+
+	/* Resizing keeps the data */
+	ASSERT(SetPipeSize(pipe.read, PIPE_MAX_SIZE)==PIPE_MAX_SIZE);
+	memset(buf, 0, N);
+	n = 0;
+	while(n < N) {
+		int rc = Read(pipe.read, buf+n, N-n);
+		ASSERT(rc > 0);
+		n += rc;
+	}
+	for(unsigned int i=0; i<N; i++) ASSERT(buf[i] == (char)(i % 251));
+	free(buf);
+
+	/* An idle pipe can shrink again */
+	ASSERT(SetPipeSize(pipe.read, 1)==cap);
+	char buffer[12] = { [0] = 0 };
+	ASSERT(Write(pipe.write, "Hello world", 12)==12);
+	ASSERT(Read(pipe.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	return 0;
+}
+
+
+static int splice_producer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	char buf[1000];
+	for(int i=0; i<1000; i++) {
+		for(int j=0; j<1000; j++) buf[j] = (i+j) % 251;
+		for(int n=0; n<1000; ) {
+			int rc = Write(fid, buf+n, 1000-n);
+			if(rc <= 0) return -1;
+			n += rc;
+		}
+	}
+	Close(fid);
+	return 0;
+}
+
+static int splice_consumer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	char c;
+	int count = 0;
+	while(Read(fid, &c, 1) == 1) {
+		if(c != (char)((count/1000 + count%1000) % 251)) return -1;
+		count++;
+	}
+	return count;
+}
+
+BOOT_TEST(test_pipe_splice_tee,
+	"Test that Splice and Tee move data between pipes, and that Tee leaves it in the source."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+	Fid_t null = OpenNull();
+	char buffer[12] = { [0] = 0 };
+
+	/* Nothing can be moved between wrong ends, or within one pipe */
+	ASSERT(Splice(p1.write, p2.write, 10)==-1);
+	ASSERT(Splice(p1.read, p2.read, 10)==-1);
+	ASSERT(Splice(p1.read, p1.write, 10)==-1);
+	ASSERT(Splice(null, null, 10)==-1);
+	ASSERT(Tee(p1.read, null, 10)==-1);
+	ASSERT(Splice(p1.read, MAX_FILEID, 10)==-1);
+
+	ASSERT(Write(p1.write, "Hello world", 12)==12);
+
+	/* Tee copies, and leaves the data in p1 */
+	ASSERT(Tee(p1.read, p2.write, 100)==12);
+	ASSERT(Read(p2.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Splice moves it */
+	memset(buffer, 0, 12);
+	ASSERT(Splice(p1.read, p2.write, 6)==6);
+	ASSERT(Splice(p1.read, p2.write, 100)==6);
+	ASSERT(Read(p2.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Data can be spliced to a device */
+	ASSERT(Write(p1.write, "abc", 3)==3);
+	ASSERT(Splice(p1.read, null, 100)==3);
+
+	/* Stream through two pipes, with both of them filling up */
+	Tid_t prod = CreateThread(splice_producer, sizeof(Fid_t), &p1.write);
+	Tid_t cons = CreateThread(splice_consumer, sizeof(Fid_t), &p2.read);
+	int rc;
+	while((rc = Splice(p1.read, p2.write, 3000)) > 0);
+	ASSERT(rc==0);
+	Close(p2.write);
+
+	int exitval;
+	ASSERT(ThreadJoin(prod, &exitval)==0 && exitval==0);
+	ASSERT(ThreadJoin(cons, &exitval)==0 && exitval==1000000);
+	return 0;
+}
+
+
+struct splice_args { Fid_t in, out; int keep; };
+
+static int splice_thread(int argl, void* args)
+{
+	struct splice_args* a = args;
+	return a->keep ? Tee(a->in, a->out, 100) : Splice(a->in, a->out, 100);
+}
+
+static int splice_reader(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	char buffer[6] = { [0] = 0 };
+	if(Read(fid, buffer, 6)!=6 || strcmp(buffer, "Hello")!=0) return -1;
+	return 0;
+}
+
+static void splice_pause(void)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+}
+
+BOOT_TEST(test_pipe_splice_tee_reader,
+	"Test that a Splice or Tee that waits on a full output pipe does not keep a reader of its input pipe asleep."
+	)
+{
+	for(int keep=0; keep<2; keep++) {
+		pipe_t p1, p2;
+		ASSERT(Pipe(&p1)==0);
+		ASSERT(Pipe(&p2)==0);
+
+		/* Fill up the output pipe */
+		int cap = GetPipeSize(p2.write);
+		char* fill = calloc(cap, 1);
+		ASSERT(Write(p2.write, fill, cap)==cap);
+
+		/* The splice waits for data first, then the reader */
+		struct splice_args args = { p1.read, p2.write, keep };
+		Tid_t splicer = CreateThread(splice_thread, sizeof(args), &args);
+		splice_pause();
+		Tid_t reader = CreateThread(splice_reader, sizeof(Fid_t), &p1.read);
+		splice_pause();
+
+		/* The splice is woken up and blocks on p2, the reader must still get the data */
+		ASSERT(Write(p1.write, "Hello", 6)==6);
+		int exitval;
+		ASSERT(ThreadJoin(reader, &exitval)==0 && exitval==0);
+
+		/* Make room in p2, the splice finds p1 empty and then sees the end of data */
+		Close(p1.write);
+		ASSERT(Read(p2.read, fill, cap)==cap);
+		ASSERT(ThreadJoin(splicer, &exitval)==0 && exitval==0);
+
+		free(fill);
+		Close(p1.read);
+		Close(p2.read);
+		Close(p2.write);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice_terminal,
+	"Test that Splice moves data between a pipe and a terminal.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	sendme(0, "Hello");
+	int n = 0;
+	while(n < 5) {
+		int rc = Splice(fterm, pipe.write, 5-n);
+		ASSERT(rc > 0);
+		n += rc;
+	}
+
+	expect(0, "Hello");
+	n = 0;
+	while(n < 5) {
+		int rc = Splice(pipe.read, fterm, 5-n);
+		ASSERT(rc > 0);
+		n += rc;
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_readv_writev,
+	"Test that ReadV and WriteV scatter and gather the data of a pipe, around the end of its buffer."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	int cap = GetPipeSize(pipe.read);
+	ASSERT(cap > 0);
+
+	char head[4] = "HDR", body[12] = "Hello world", out[16] = { 0 };
+	iovec_t msg[3] = { { head, 3 }, { NULL, 0 }, { body, 12 } };
+
+	/* Wrong ends */
+	ASSERT(ReadV(pipe.write, msg, 3)==-1);
+	ASSERT(WriteV(pipe.read, msg, 3)==-1);
+
+	/* Move the positions near the end of the buffer, so that the message wraps */
+	char* fill = calloc(cap, 1);
+	ASSERT(Write(pipe.write, fill, cap-5)==cap-5);
+	ASSERT(Read(pipe.read, fill, cap-5)==cap-5);
+
+	ASSERT(WriteV(pipe.write, msg, 3)==15);
+
+	/* A short read fills the first segments only */
+	iovec_t in[2] = { { out, 2 }, { out+2, 14 } };
+	ASSERT(ReadV(pipe.read, in, 1)==2);
+	ASSERT(ReadV(pipe.read, in+1, 1)==13);
+	ASSERT(memcmp(out, "HDRHello world", 15)==0);
+
+	/* A full pipe takes as many bytes as it has space for */
+	ASSERT(Write(pipe.write, fill, cap-10)==cap-10);
+	ASSERT(WriteV(pipe.write, msg, 3)==10);
+	ASSERT(Read(pipe.read, fill, cap-10)==cap-10);
+	memset(out, 0, sizeof(out));
+	ASSERT(ReadV(pipe.read, in, 2)==10);
+	ASSERT(memcmp(out, "HDRHello w", 11)==0);
+
+	/* End of data */
+	Close(pipe.write);
+	ASSERT(ReadV(pipe.read, in, 2)==0);
+	free(fill);
+	return 0;
+}
+
+
+static int poll_delayed_writer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+	ASSERT(Write(fid, "Hello", 5)==5);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_poll,
+	"Test that Poll reports the events of pipes, waits for them, and times out."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+	Fid_t null = OpenNull();
+	char buffer[6] = { 0 };
+
+	pollfd_t fds[MAX_FILEID+1] = {
+		{ .fd = p1.read, .events = POLL_READ },
+		{ .fd = p2.read, .events = POLL_READ },
+		{ .fd = p1.write, .events = POLL_WRITE },
+		{ .fd = NOFILE, .events = POLL_READ },
+	};
+
+	ASSERT(Poll(fds, MAX_FILEID+1, 0)==-1);
+	ASSERT(Poll(NULL, 1, 0)==-1);
+	ASSERT(Poll(NULL, 0, 0)==0);
+
+	/* An empty pipe can be written, but not read */
+	ASSERT(Poll(fds, 4, 0)==1);
+	ASSERT(fds[0].revents==0 && fds[1].revents==0 && fds[2].revents==POLL_WRITE && fds[3].revents==0);
+	ASSERT(Poll(fds, 2, 0)==0);
+
+	/* The timeout expires */
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_REALTIME, &t1);
+	ASSERT(Poll(fds, 2, 200)==0);
+	clock_gettime(CLOCK_REALTIME, &t2);
+	unsigned long Dt = tspec2msec(t2)-tspec2msec(t1);
+	ASSERT(Dt >= 150 && Dt < 1000);
+
+	/* A writer wakes up the poller */
+	Tid_t t = CreateThread(poll_delayed_writer, sizeof(Fid_t), &p2.write);
+	ASSERT(Poll(fds, 2, -1)==1);
+	ASSERT(fds[0].revents==0 && fds[1].revents==POLL_READ);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Read(p2.read, buffer, 5)==5);
+
+	/* A full pipe cannot be written */
+	int cap = GetPipeSize(p1.write);
+	char* fill = calloc(cap, 1);
+	ASSERT(Write(p1.write, fill, cap)==cap);
+	ASSERT(Poll(fds+2, 1, 0)==0);
+	ASSERT(Poll(fds, 1, 0)==1 && fds[0].revents==POLL_READ);
+	ASSERT(Read(p1.read, fill, cap)==cap);
+	free(fill);
+
+	/* Closed ends are reported, and so are invalid fids */
+	Close(p2.write);
+	Close(p1.read);
+	fds[3].fd = null;
+	fds[3].events = POLL_READ | POLL_WRITE;
+	ASSERT(Poll(fds, 4, -1)==4);
+	ASSERT(fds[0].revents==POLL_INVALID);
+	ASSERT(fds[1].revents==(POLL_READ|POLL_HANGUP));
+	ASSERT(fds[2].revents==(POLL_WRITE|POLL_HANGUP));
+	ASSERT(fds[3].revents==(POLL_READ|POLL_WRITE));
+	return 0;
+}
+
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1642,6 +2571,12 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_set_size,
+	&test_pipe_splice_tee,
+	&test_pipe_splice_tee_reader,
+	&test_pipe_splice_terminal,
+	&test_pipe_readv_writev,
+	&test_pipe_poll,
 	NULL
 };
 
@@ -2026,6 +2961,202 @@ BOOT_TEST(test_socket_small_transfer,
 }
 
 
+BOOT_TEST(test_socket_set_pipe_size,
+	"Test that SetPipeSize applies to the pipes of a connection, whether set before or after connecting."
+	)
+{
+	Fid_t cli, srv, lsock;
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* The capacity set on unconnected sockets is used by the connection */
+	ASSERT(SetPipeSize(lsock, 65536)==65536);
+	ASSERT(SetPipeSize(cli, 32768)==32768);
+	ASSERT(SetPipeSize(cli, PIPE_MAX_SIZE+1)==-1);
+
+	connect_sockets(cli, lsock, &srv, 100);
+	ASSERT(GetPipeSize(srv)==65536);
+
+	/* Resizing a connected socket resizes both directions */
+	ASSERT(SetPipeSize(cli, 131072)==131072);
+	ASSERT(SetPipeSize(srv, 1) > 0);
+	ASSERT(GetPipeSize(cli) == GetPipeSize(srv));
+	check_transfer(cli, srv);
+	check_transfer(srv, cli);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_splice,
+	"Test that Splice relays data between a pipe and a connected socket."
+	)
+{
+	Fid_t cli, srv, lsock;
+	pipe_t pipe;
+	char buffer[12] = { [0] = 0 };
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	ASSERT(Pipe(&pipe)==0);
+
+	/* Unconnected sockets have no pipes */
+	ASSERT(Splice(pipe.read, cli, 12)==-1);
+	ASSERT(Listen(lsock)==0);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	/* pipe -> socket */
+	ASSERT(Write(pipe.write, "Hello world", 12)==12);
+	ASSERT(Splice(pipe.read, cli, 12)==12);
+	ASSERT(Read(srv, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* socket -> pipe, with a peer that has shut down */
+	memset(buffer, 0, 12);
+	ASSERT(Write(srv, "Hello world", 12)==12);
+	ASSERT(ShutDown(srv, SHUTDOWN_WRITE)==0);
+	ASSERT(Splice(cli, pipe.write, 12)==12);
+	ASSERT(Splice(cli, pipe.write, 12)==0);
+	ASSERT(Read(pipe.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_readv_writev,
+	"Test that ReadV and WriteV work on connected sockets, and fail on unconnected ones."
+	)
+{
+	Fid_t cli, srv, lsock;
+	char head[4] = "HDR", body[12] = "Hello world", out[16] = { 0 };
+	iovec_t msg[2] = { { head, 3 }, { body, 12 } };
+	iovec_t in[2] = { { out, 5 }, { out+5, 11 } };
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+
+	ASSERT(WriteV(cli, msg, 2)==-1);
+	ASSERT(ReadV(cli, in, 2)==-1);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(WriteV(lsock, msg, 2)==-1);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	ASSERT(WriteV(cli, msg, 2)==15);
+	ASSERT(ReadV(srv, in, 2)==15);
+	ASSERT(memcmp(out, "HDRHello world", 15)==0);
+	return 0;
+}
+
+#define POLL_CLIENTS 6
+
+static int poll_echo_client(int argl, void* args)
+{
+	int id = argl;
+	char msg[16], reply[16];
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(sock!=NOFILE);
+	ASSERT(Connect(sock, 100, 1000)==0);
+
+	for(int i=0; i<10; i++) {
+		sprintf(msg, "client %d:%d", id, i);
+		ASSERT(Write(sock, msg, 16)==16);
+		int n = 0;
+		while(n < 16) {
+			int rc = Read(sock, reply+n, 16-n);
+			ASSERT(rc > 0);
+			n += rc;
+		}
+		ASSERT(strcmp(msg, reply)==0);
+	}
+	Close(sock);
+	return 0;
+}
+
+BOOT_TEST(test_socket_poll_server,
+	"Test that a single thread can accept and serve several connections with Poll."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+
+	/* Not ready before listening or connecting */
+	pollfd_t fds[POLL_CLIENTS+1];
+	fds[0] = (pollfd_t){ .fd = lsock, .events = POLL_READ };
+	ASSERT(Poll(fds, 1, 0)==0);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(Poll(fds, 1, 0)==0);
+
+	Tid_t clients[POLL_CLIENTS];
+	for(int i=0; i<POLL_CLIENTS; i++)
+		clients[i] = CreateThread(poll_echo_client, i, NULL);
+
+	/* Echo 16-byte messages, until all clients hang up */
+	unsigned int n = 1;
+	int accepted = 0, closed = 0;
+	while(closed < POLL_CLIENTS) {
+		ASSERT(Poll(fds, n, -1) > 0);
+
+		for(unsigned int i=1; i<n; i++) {
+			if(fds[i].revents & POLL_READ) {
+				char msg[16];
+				int rc = Read(fds[i].fd, msg, 16);
+				if(rc == 0) {
+					Close(fds[i].fd);
+					fds[i--] = fds[--n];
+					closed++;
+					continue;
+				}
+				/* The clients wait for each reply, so a message arrives in one piece */
+				ASSERT(rc == 16);
+				ASSERT(Write(fds[i].fd, msg, 16)==16);
+			}
+		}
+
+		if(fds[0].revents & POLL_READ) {
+			Fid_t sock = Accept(lsock);
+			ASSERT(sock!=NOFILE);
+			fds[n++] = (pollfd_t){ .fd = sock, .events = POLL_READ };
+			accepted++;
+		}
+	}
+	ASSERT(accepted == POLL_CLIENTS);
+
+	for(int i=0; i<POLL_CLIENTS; i++)
+		ASSERT(ThreadJoin(clients[i], NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_poll_shutdown,
+	"Test that Poll reports the state of connected sockets, and wakes up on ShutDown."
+	)
+{
+	Fid_t cli, srv, lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	pollfd_t fds[2] = {
+		{ .fd = srv, .events = POLL_READ | POLL_WRITE },
+		{ .fd = cli, .events = POLL_READ },
+	};
+	ASSERT(Poll(fds, 2, 0)==1);
+	ASSERT(fds[0].revents==POLL_WRITE && fds[1].revents==0);
+
+	check_transfer(srv, cli);
+
+	/* The peer shuts down its write side */
+	ASSERT(ShutDown(srv, SHUTDOWN_WRITE)==0);
+	fds[0].events = POLL_READ;
+	ASSERT(Poll(fds, 2, 0)==1);
+	ASSERT(fds[0].revents==0 && fds[1].revents==(POLL_READ|POLL_HANGUP));
+	return 0;
+}
+
 BOOT_TEST(test_socket_single_producer,
 	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
 	)
@@ -2219,6 +3350,11 @@ TEST_SUITE(socket_tests,
 	&test_connect_fails_on_timeout,
 
 	&test_socket_small_transfer,
+	&test_socket_set_pipe_size,
+	&test_socket_splice,
+	&test_socket_readv_writev,
+	&test_socket_poll_server,
+	&test_socket_poll_shutdown,
 	&test_socket_single_producer,
 	&test_socket_multi_producer,
 